@@ -0,0 +1,821 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <atomic>
+#include <pthread.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_synth.h"
+
+extern "C" {
+#include "ppmb_io.h"
+}
+
+FILE *open_ppm(const char *file_name, struct img *input) {
+  FILE *f = fopen(file_name, "rb");
+  if(!f) {
+    fprintf(stderr, "Cannot open the input file %s.\n", file_name);
+    return NULL;
+  }
+
+  if(ppmb_read_header(f, &input->xsize, &input->ysize, &input->maxrgb)) {
+    fprintf(stderr, "Bad PPM header in %s.\n", file_name);
+    fclose(f);
+    return NULL;
+  }
+
+  if(input->xsize <= 0 || input->ysize <= 0 || input->maxrgb > 255) {
+    fprintf(stderr, "Unsupported image %s (%dx%d, maxrgb %d).\n", file_name,
+            input->xsize, input->ysize, input->maxrgb);
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+bool read_ppm(FILE *f, const char *file_name, struct img *input, size_t *capacity) {
+  size_t pixels = (size_t) input->xsize * input->ysize;
+  if(pixels > *capacity) {
+    free_img(input);
+    input->r = (unsigned char *) malloc(pixels);
+    input->g = (unsigned char *) malloc(pixels);
+    input->b = (unsigned char *) malloc(pixels);
+    if(!input->r || !input->g || !input->b) {
+      fprintf(stderr, "Unable to allocate memory for %s.\n", file_name);
+      free_img(input);
+      *capacity = 0;
+      fclose(f);
+      return true;
+    }
+    *capacity = pixels;
+  }
+
+  bool result = ppmb_read_data(f, input->xsize, input->ysize,
+                               input->r, input->g, input->b);
+  fclose(f);
+  if(result)
+    fprintf(stderr, "Failed reading data from %s.\n", file_name);
+  return result;
+}
+
+bool read_ppm_arena(FILE *f, const char *file_name, struct img *input, struct arena *a,
+                    int threads) {
+  size_t pixels = (size_t) input->xsize * input->ysize;
+  if(arena_reserve(a, 3 * arena_size(pixels), threads)) {
+    fprintf(stderr, "Unable to map an arena for %s.\n", file_name);
+    fclose(f);
+    return true;
+  }
+  input->r = (unsigned char *) arena_alloc(a, pixels);
+  input->g = (unsigned char *) arena_alloc(a, pixels);
+  input->b = (unsigned char *) arena_alloc(a, pixels);
+
+  bool result = ppmb_read_data(f, input->xsize, input->ysize,
+                               input->r, input->g, input->b);
+  fclose(f);
+  if(result)
+    fprintf(stderr, "Failed reading data from %s.\n", file_name);
+  return result;
+}
+
+void report_arenas(const struct arena *arenas, int n) {
+  size_t largest = 0;
+  int maps = 0;
+  unsigned long long fault_ns = 0;
+  const char *backing = "none";
+  for(int i = 0; i < n; i++) {
+    if(arenas[i].size > largest)
+      largest = arenas[i].size;
+    if(arenas[i].base)
+      backing = arena_backing(&arenas[i]);
+    maps += arenas[i].maps;
+    fault_ns += arenas[i].fault_ns;
+  }
+  printf("Arena: %d x up to %.1f MB, %s, mapped %d times, pre-faulted in %.3f ms\n", n,
+         largest / 1048576.0, backing, maps, fault_ns / 1e6);
+}
+
+bool load_ppm(const char *file_name, struct img *input, size_t *capacity) {
+  FILE *f = open_ppm(file_name, input);
+  if(!f)
+    return true;
+  return read_ppm(f, file_name, input, capacity);
+}
+
+bool write_ppm(const char *file_name, int xsize, int ysize, int maxrgb,
+               const unsigned char *data) {
+  FILE *f = fopen(file_name, "wb");
+  if(!f) {
+    fprintf(stderr, "Cannot open the output file %s.\n", file_name);
+    return true;
+  }
+  size_t bytes = (size_t) xsize * ysize * 3;
+  bool failed = fprintf(f, "P6 %d %d %d ", xsize, ysize, maxrgb) < 0 ||
+                fwrite(data, 1, bytes, f) != bytes;
+  if(fclose(f) || failed) {
+    fprintf(stderr, "Failed writing %s.\n", file_name);
+    return true;
+  }
+  return false;
+}
+
+static bool header_number(const unsigned char *data, size_t size, size_t *pos,
+                          int *value) {
+  // skip whitespace and '#' comments up to the next token
+  for(;;) {
+    if(*pos >= size)
+      return true;
+    if(data[*pos] == '#') {
+      while(*pos < size && data[*pos] != '\n')
+        (*pos)++;
+    } else if(isspace(data[*pos])) {
+      (*pos)++;
+    } else {
+      break;
+    }
+  }
+
+  long v = 0;
+  size_t start = *pos;
+  while(*pos < size && isdigit(data[*pos]) && v < (1L << 30)) {
+    v = v * 10 + (data[*pos] - '0');
+    (*pos)++;
+  }
+  if(*pos == start || *pos >= size || !isspace(data[*pos]))
+    return true;
+  *value = (int) v;
+  return false;
+}
+
+bool parse_ppm_header(const unsigned char *data, size_t size, struct img *input,
+                      size_t *offset) {
+  if(size < 2 || data[0] != 'P' || data[1] != '6')
+    return true;
+
+  size_t pos = 2;
+  if(header_number(data, size, &pos, &input->xsize) ||
+     header_number(data, size, &pos, &input->ysize) ||
+     header_number(data, size, &pos, &input->maxrgb))
+    return true;
+  if(input->xsize <= 0 || input->ysize <= 0 || input->maxrgb <= 0 || input->maxrgb > 255)
+    return true;
+
+  // exactly one whitespace byte separates maxrgb from the pixels
+  *offset = pos + 1;
+  return false;
+}
+
+void free_img(struct img *input) {
+  free(input->r);
+  free(input->g);
+  free(input->b);
+  input->r = NULL;
+  input->g = NULL;
+  input->b = NULL;
+}
+
+static const char *channel_names[HISTO_CHANNELS] = {
+  "r", "g", "b", "luma601", "luma709", "hue", "saturation", "value", "chroma"
+};
+
+void emit_histograms(ggc::Emitter &e, const char *name, const uint64_t *hist_r,
+                     const uint64_t *hist_g, const uint64_t *hist_b, int maxrgb,
+                     const struct options *opt) {
+  const uint64_t *hists[3] = { hist_r, hist_g, hist_b };
+  e.begin(name, maxrgb);
+  for(int c = 0; c < opt->nchannels; c++) {
+    int channel = opt->channels[c];
+    bool full = channel == HISTO_CHANNEL_HUE || channel == HISTO_CHANNEL_SATURATION;
+    e.channel(channel_names[channel], hists[c], full ? HISTO_BINS - 1 : maxrgb);
+  }
+  e.end();
+}
+
+void write_histograms(FILE *f, const uint64_t *hist_r, const uint64_t *hist_g,
+                      const uint64_t *hist_b, int maxrgb, const struct options *opt) {
+  ggc::Emitter e(f, opt->format);
+  emit_histograms(e, NULL, hist_r, hist_g, hist_b, maxrgb, opt);
+  e.finish();
+}
+
+int count_channels(const histo_image *img, uint64_t *hist_r, uint64_t *hist_g,
+                   uint64_t *hist_b, unsigned flags, const struct options *opt) {
+  uint64_t *hists[3] = { hist_r, hist_g, hist_b };
+  return histo_compute_channels(img, NULL, opt->channels, opt->nchannels, hists, flags);
+}
+
+void write_stats(FILE *f, const uint64_t *hist_r, const uint64_t *hist_g,
+                 const uint64_t *hist_b, const struct options *opt) {
+  if(!opt->stats)
+    return;
+  const uint64_t *hists[3] = { hist_r, hist_g, hist_b };
+  histo_stats st;
+  for(int c = 0; c < opt->nchannels; c++) {
+    histo_stats_compute(hists[c], &st);
+    fprintf(f, "# stats %s count=%llu min=%d max=%d sum=%llu sum_squares=%llu "
+            "mean=%.4f variance=%.4f stddev=%.4f entropy=%.4f", channel_names[opt->channels[c]],
+            (unsigned long long) st.count, st.min, st.max, (unsigned long long) st.sum,
+            (unsigned long long) st.sum_squares, st.mean, st.variance, sqrt(st.variance),
+            st.entropy);
+    for(int i = 0; i < opt->nstat_percentiles; i++)
+      fprintf(f, " p%g=%d", opt->stat_percentiles[i],
+              histo_percentile(&st, opt->stat_percentiles[i]));
+    fprintf(f, "\n");
+  }
+}
+
+// "luma709,hue" into opt->channels.  Returns true if it is malformed.
+static bool parse_channels(const char *list, struct options *opt) {
+  opt->nchannels = 0;
+  const char *s = list;
+  while(*s) {
+    size_t len = strcspn(s, ",");
+    int found = -1;
+    for(int c = 0; c < HISTO_CHANNELS; c++) {
+      if(strlen(channel_names[c]) == len && strncmp(s, channel_names[c], len) == 0)
+        found = c;
+    }
+    if(found < 0 || opt->nchannels == 3)
+      return true;
+    opt->channels[opt->nchannels++] = found;
+    s += len;
+    if(*s == ',')
+      s++;
+  }
+  return opt->nchannels == 0;
+}
+
+// "1,50,99" into opt->stat_percentiles.  Returns true if it is malformed.
+static bool parse_percentiles(const char *list, struct options *opt) {
+  opt->nstat_percentiles = 0;
+  const char *s = list;
+  while(*s) {
+    char *end;
+    double p = strtod(s, &end);
+    if(end == s || p < 0 || p > 100 || opt->nstat_percentiles == MAX_STAT_PERCENTILES)
+      return true;
+    opt->stat_percentiles[opt->nstat_percentiles++] = p;
+    if(*end == ',')
+      end++;
+    else if(*end)
+      return true;
+    s = end;
+  }
+  return false;
+}
+
+void hist_path(char *buf, size_t len, const char *out_dir, const char *input_file,
+               int format) {
+  const char *base = strrchr(input_file, '/');
+  base = base ? base + 1 : input_file;
+  size_t n = strlen(base);
+  if(n > 4 && strcmp(base + n - 4, ".ppm") == 0)
+    n -= 4;
+  snprintf(buf, len, "%s/%.*s%s", out_dir, (int) n, base, ggc::emit_extension(format));
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s input-file output-file threads\n", prog);
+  printf("       %s --batch list-file|directory [options]\n", prog);
+  printf("       %s --stream file|fifo|- [options]\n", prog);
+  printf("       %s --equalize input-file output-file [--luma] [--threads N]\n", prog);
+  printf("       %s --clahe input-file output-file [--tile N] [--clip F] [--luma]\n", prog);
+  printf("       %s --median input-file output-file [--radius R] [--percentile P]\n", prog);
+  printf("       %s --integral input-file [--bins N] [--queries N] [--verify N]\n", prog);
+  printf("       %s --joint input-file [output-file] [--bits N] [--top N]\n", prog);
+  printf("       %s --quantize input-file output-file [--colors K] [--bits N]\n", prog);
+  printf("       %s --generate KIND output-file [--size WxH] [--seed N]\n", prog);
+  printf("       %s --hist2store input.hist output-store\n", prog);
+  printf("       %s --store2hist input-store output.hist [--key NAME]\n", prog);
+  printf("Options:\n");
+  printf("  --threads N      worker threads (default: one per CPU)\n");
+  printf("  --out DIR        write one DIR/<image>.hist per image (default: .)\n");
+  printf("  --combined FILE  write all histograms to FILE, in input order\n");
+  printf("                   (--stream writes to stdout without it)\n");
+  printf("  --store FILE     append all histograms to the binary store FILE\n");
+  printf("  --key NAME       store2hist: write only the image NAME, as a plain .hist\n");
+  printf("  --large PIXELS   split images of at least PIXELS across workers\n");
+  printf("                   instead of giving each its own worker (default: %d)\n",
+         4 << 20);
+  printf("  --pipeline       overlap loading, counting and output in three stages\n");
+  printf("  --depth N        images in flight in the pipeline or stream (default: 8)\n");
+  printf("  --loaders N      pipeline threads per stage (default: 1 loader,\n");
+  printf("  --counters N     one counter per CPU or --threads, 1 emitter)\n");
+  printf("  --emitters N\n");
+  printf("  --io MODE        pipeline file reads: stdio (ppmb_read), pread or uring\n");
+  printf("                   (io_uring, falls back to pread; default: stdio)\n");
+  printf("  --io-buffer N    per-slot read buffer in bytes for pread/uring\n");
+  printf("                   (default: %d; larger files use a heap buffer)\n", 8 << 20);
+  printf("  --arena          single, batch, stdio pipeline: read planes into one\n");
+  printf("                   huge-page arena per worker, pre-faulted, reused\n");
+  printf("  --delta          stream: update each histogram from the previous frame,\n");
+  printf("                   touching only the pixels that changed\n");
+  printf("  --refresh N      with --delta, recount every Nth frame in full (default: 100)\n");
+  printf("  --progress MS    single image: report a partial histogram every MS ms\n");
+  printf("                   (0: snapshot back to back, to measure the cost)\n");
+  printf("  --format F       hist, csv or json; per-image files get that extension\n");
+  printf("                   (default: from the output file's extension, else hist)\n");
+  printf("  --channels LIST  histogram up to 3 of r, g, b, luma601, luma709, hue,\n");
+  printf("                   saturation, value, chroma (default: r,g,b)\n");
+  printf("  --stats          follow each histogram with '# stats' lines: count, min,\n");
+  printf("                   max, sums, mean, variance, entropy and percentiles\n");
+  printf("  --percentiles L  percentiles for --stats, comma separated\n");
+  printf("                   (default: 1,5,25,50,75,95,99)\n");
+  printf("  --luma           equalize: one curve from the luminance histogram\n");
+  printf("                   instead of one per channel\n");
+  printf("  --tile N         CLAHE tile edge in pixels (default: 64)\n");
+  printf("  --clip F         CLAHE clip limit, in multiples of the mean bin count\n");
+  printf("                   (default: 2; 0 turns clipping off)\n");
+  printf("  --radius R       median: window of (2R+1)x(2R+1) pixels, R <= 127\n");
+  printf("                   (default: 2)\n");
+  printf("  --percentile P   median: output the P-th percentile of the window\n");
+  printf("                   instead of the median (0: min, 100: max)\n");
+  printf("  --bins N         integral: bins per channel, 1..256 (default: 32)\n");
+  printf("  --queries N      integral: random rectangles to look up (default: 100000)\n");
+  printf("  --verify N       integral: compare the first N with histo_compute\n");
+  printf("                   (default: 1000)\n");
+  printf("  --seed N         integral, generate: seed for the rectangles or pixels\n");
+  printf("  --bits N         joint, quantize: bits kept per channel, 1..8 (default: 5;\n");
+  printf("                   above %d only occupied cells are stored)\n", HISTO_JOINT_DENSE_BITS);
+  printf("  --top N          joint: print the N most common cells (default: 10)\n");
+  printf("  --colors K       quantize: palette size, 1..256 (default: 256)\n");
+  printf("  --generate KIND  write a synthetic image: uniform, single (every pixel\n");
+  printf("                   128), zipf, gradient or noise (photograph-like)\n");
+  printf("  --size WxH       generate: image size (default: 4000x4000)\n");
+  exit(1);
+}
+
+struct progress {
+  int period_ms;
+  std::atomic<bool> done;
+  long long snapshots;
+  unsigned long long snapshot_ns;
+  unsigned long long max_ns;
+};
+
+// Takes histo_snapshot of the running job until it is done.  Each report
+// gives the pixels counted so far and the busiest red bin among them.
+static void* progress_thread(void *arg) {
+  struct progress *pr = (struct progress *) arg;
+  uint64_t hist_r[HISTO_BINS], hist_g[HISTO_BINS], hist_b[HISTO_BINS];
+  ggc::Timer t("snapshot");
+
+  while(!pr->done.load(std::memory_order_acquire)) {
+    if(pr->period_ms > 0)
+      usleep(pr->period_ms * 1000);
+
+    uint64_t pixels, total;
+    t.start();
+    int err = histo_snapshot(hist_r, hist_g, hist_b, &pixels, &total);
+    t.stop();
+    if(err)
+      continue;
+
+    pr->snapshots++;
+    pr->snapshot_ns += t.duration();
+    if(t.duration() > pr->max_ns)
+      pr->max_ns = t.duration();
+    if(pr->period_ms > 0) {
+      int mode = 0;
+      for(int i = 1; i < HISTO_BINS; i++) {
+        if(hist_r[i] > hist_r[mode])
+          mode = i;
+      }
+      fprintf(stderr, "Progress: %5.1f%% (%llu of %llu pixels), red mode %d\n",
+              total ? 100.0 * pixels / total : 0.0, (unsigned long long) pixels,
+              (unsigned long long) total, mode);
+    }
+  }
+  return NULL;
+}
+
+static int run_single(const char *input_file, const char *output_file,
+                      const struct options *opt) {
+  struct img input;
+  size_t capacity = 0;
+  struct arena arena;
+  memset(&input, 0, sizeof(input));
+  memset(&arena, 0, sizeof(arena));
+
+  if(opt->arena) {
+    FILE *f = open_ppm(input_file, &input);
+    if(!f || read_ppm_arena(f, input_file, &input, &arena, histo_threads())) {
+      arena_release(&arena);
+      return 1;
+    }
+  } else if(load_ppm(input_file, &input, &capacity)) {
+    return 1;
+  }
+
+  uint64_t hist_r[HISTO_BINS], hist_g[HISTO_BINS], hist_b[HISTO_BINS];
+  histo_image image;
+  histo_image_planar(&image, input.xsize, input.ysize,
+                     input.r, input.g, input.b, input.xsize);
+
+  ggc::Timer t("histogram");
+  struct progress pr;
+  pthread_t progress_id;
+  memset(&pr, 0, sizeof(pr));
+  pr.period_ms = opt->progress_ms;
+  pr.done.store(false);
+  bool watching = false;
+  if(opt->progress_ms >= 0) {
+    watching = pthread_create(&progress_id, NULL, progress_thread, (void *) &pr) == 0;
+    if(!watching)
+      fprintf(stderr, "Unable to start the progress thread; counting without it\n");
+  }
+
+  t.start();
+  int err = count_channels(&image, hist_r, hist_g, hist_b, watching ? HISTO_LIVE : 0, opt);
+  t.stop();
+
+  if(watching) {
+    pr.done.store(true, std::memory_order_release);
+    pthread_join(progress_id, NULL);
+  }
+
+  FILE *out = err < 0 ? NULL : fopen(output_file, "w");
+  if(err < 0) {
+    fprintf(stderr, "Unable to count %s: %s\n", input_file, histo_strerror(err));
+  } else if(out) {
+    write_histograms(out, hist_r, hist_g, hist_b, input.maxrgb, opt);
+    write_stats(out, hist_r, hist_g, hist_b, opt);
+    fclose(out);
+  } else {
+    fprintf(stderr, "Unable to output!\n");
+  }
+  printf("Time: %llu ns\n", t.duration());
+  if(pr.snapshots > 0)
+    printf("Snapshots: %lld, mean %.1f us, max %.1f us\n", pr.snapshots,
+           pr.snapshot_ns / 1e3 / pr.snapshots, pr.max_ns / 1e3);
+  if(opt->arena) {
+    report_arenas(&arena, 1);
+    arena_release(&arena);
+  } else {
+    free_img(&input);
+  }
+  return err < 0 ? 1 : 0;
+}
+
+// --generate: write one synthetic image of --size
+static int run_generate(const char *output_file, const struct options *opt) {
+  struct img image;
+  ggc::Timer t("generate"), write("write");
+
+  t.start();
+  if(synth_image(&image, opt->generate, opt->width, opt->height, opt->seed)) {
+    fprintf(stderr, "Unable to allocate a %dx%d image.\n", opt->width, opt->height);
+    return 1;
+  }
+  t.stop();
+
+  size_t pixels = (size_t) image.xsize * image.ysize;
+  unsigned char *data = (unsigned char *) malloc(pixels * 3);
+  bool failed = !data;
+  if(failed) {
+    fprintf(stderr, "Unable to allocate memory for %s.\n", output_file);
+  } else {
+    for(size_t i = 0; i < pixels; i++) {
+      data[3 * i] = image.r[i];
+      data[3 * i + 1] = image.g[i];
+      data[3 * i + 2] = image.b[i];
+    }
+    write.start();
+    failed = write_ppm(output_file, image.xsize, image.ysize, image.maxrgb, data);
+    write.stop();
+  }
+
+  if(!failed) {
+    printf("Generated: %s (%dx%d, %s, seed %llu)\n", output_file, image.xsize, image.ysize,
+           synth_name(opt->generate), opt->seed);
+    printf("  generate  %10.3f ms\n", t.duration() / 1e6);
+    printf("  write     %10.3f ms\n", write.duration() / 1e6);
+  }
+  free(data);
+  free_img(&image);
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct options opt;
+  const char *batch = NULL;
+  const char *stream = NULL;
+  bool hist2store = false, store2hist = false;
+  const char *positional[3];
+  int npositional = 0;
+
+  opt.threads = 0;
+  opt.out_dir = ".";
+  opt.combined = NULL;
+  opt.store = NULL;
+  opt.key = NULL;
+  opt.large_pixels = 4 << 20;
+  opt.pipeline = false;
+  opt.depth = 8;
+  opt.loaders = 1;
+  opt.counters = 0;
+  opt.emitters = 1;
+  opt.io = IO_STDIO;
+  opt.io_buffer = 8 << 20;
+  opt.arena = false;
+  opt.delta = false;
+  opt.refresh = 100;
+  opt.progress_ms = -1;
+  opt.format = -1;
+  parse_channels("r,g,b", &opt);
+  opt.stats = false;
+  parse_percentiles("1,5,25,50,75,95,99", &opt);
+  opt.equalize = false;
+  opt.luma = false;
+  opt.clahe = false;
+  opt.tile = 64;
+  opt.clip = 2.0;
+  opt.median = false;
+  opt.radius = 2;
+  opt.percentile = 50;
+  opt.integral = false;
+  opt.bins = 32;
+  opt.queries = 100000;
+  opt.verify = 1000;
+  opt.seed = 1;
+  opt.joint = false;
+  opt.joint_bits = 5;
+  opt.top = 10;
+  opt.quantize = false;
+  opt.colors = 256;
+  opt.generate = -1;
+  opt.width = 4000;
+  opt.height = 4000;
+
+  for(int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool has_value = i + 1 < argc;
+
+    if(strcmp(arg, "--batch") == 0 && has_value) {
+      batch = argv[++i];
+    } else if(strcmp(arg, "--stream") == 0 && has_value) {
+      stream = argv[++i];
+    } else if(strcmp(arg, "--threads") == 0 && has_value) {
+      opt.threads = atoi(argv[++i]);
+    } else if(strcmp(arg, "--out") == 0 && has_value) {
+      opt.out_dir = argv[++i];
+    } else if(strcmp(arg, "--combined") == 0 && has_value) {
+      opt.combined = argv[++i];
+    } else if(strcmp(arg, "--store") == 0 && has_value) {
+      opt.store = argv[++i];
+    } else if(strcmp(arg, "--hist2store") == 0) {
+      hist2store = true;
+    } else if(strcmp(arg, "--store2hist") == 0) {
+      store2hist = true;
+    } else if(strcmp(arg, "--key") == 0 && has_value) {
+      opt.key = argv[++i];
+    } else if(strcmp(arg, "--large") == 0 && has_value) {
+      opt.large_pixels = atoll(argv[++i]);
+    } else if(strcmp(arg, "--pipeline") == 0) {
+      opt.pipeline = true;
+    } else if(strcmp(arg, "--depth") == 0 && has_value) {
+      opt.depth = atoi(argv[++i]);
+    } else if(strcmp(arg, "--loaders") == 0 && has_value) {
+      opt.loaders = atoi(argv[++i]);
+    } else if(strcmp(arg, "--counters") == 0 && has_value) {
+      opt.counters = atoi(argv[++i]);
+    } else if(strcmp(arg, "--emitters") == 0 && has_value) {
+      opt.emitters = atoi(argv[++i]);
+    } else if(strcmp(arg, "--io") == 0 && has_value) {
+      const char *mode = argv[++i];
+      if(strcmp(mode, "stdio") == 0)
+        opt.io = IO_STDIO;
+      else if(strcmp(mode, "pread") == 0)
+        opt.io = IO_PREAD;
+      else if(strcmp(mode, "uring") == 0)
+        opt.io = IO_URING;
+      else
+        usage(argv[0]);
+      opt.pipeline = true;
+    } else if(strcmp(arg, "--io-buffer") == 0 && has_value) {
+      opt.io_buffer = (size_t) atoll(argv[++i]);
+    } else if(strcmp(arg, "--arena") == 0) {
+      opt.arena = true;
+    } else if(strcmp(arg, "--delta") == 0) {
+      opt.delta = true;
+    } else if(strcmp(arg, "--refresh") == 0 && has_value) {
+      opt.refresh = atoi(argv[++i]);
+    } else if(strcmp(arg, "--progress") == 0 && has_value) {
+      opt.progress_ms = atoi(argv[++i]);
+      if(opt.progress_ms < 0)
+        usage(argv[0]);
+    } else if(strcmp(arg, "--format") == 0 && has_value) {
+      i++;
+      if(strcmp(argv[i], "hist") == 0)
+        opt.format = ggc::EMIT_HIST;
+      else if(strcmp(argv[i], "csv") == 0)
+        opt.format = ggc::EMIT_CSV;
+      else if(strcmp(argv[i], "json") == 0)
+        opt.format = ggc::EMIT_JSON;
+      else
+        usage(argv[0]);
+    } else if(strcmp(arg, "--channels") == 0 && has_value) {
+      if(parse_channels(argv[++i], &opt))
+        usage(argv[0]);
+    } else if(strcmp(arg, "--stats") == 0) {
+      opt.stats = true;
+    } else if(strcmp(arg, "--percentiles") == 0 && has_value) {
+      if(parse_percentiles(argv[++i], &opt))
+        usage(argv[0]);
+      opt.stats = true;
+    } else if(strcmp(arg, "--equalize") == 0) {
+      opt.equalize = true;
+    } else if(strcmp(arg, "--luma") == 0) {
+      opt.luma = true;
+    } else if(strcmp(arg, "--clahe") == 0) {
+      opt.equalize = true;
+      opt.clahe = true;
+    } else if(strcmp(arg, "--median") == 0) {
+      opt.median = true;
+    } else if(strcmp(arg, "--radius") == 0 && has_value) {
+      opt.radius = atoi(argv[++i]);
+    } else if(strcmp(arg, "--percentile") == 0 && has_value) {
+      opt.percentile = atoi(argv[++i]);
+    } else if(strcmp(arg, "--integral") == 0) {
+      opt.integral = true;
+    } else if(strcmp(arg, "--bins") == 0 && has_value) {
+      opt.bins = atoi(argv[++i]);
+    } else if(strcmp(arg, "--queries") == 0 && has_value) {
+      opt.queries = atoi(argv[++i]);
+    } else if(strcmp(arg, "--verify") == 0 && has_value) {
+      opt.verify = atoi(argv[++i]);
+    } else if(strcmp(arg, "--seed") == 0 && has_value) {
+      opt.seed = strtoull(argv[++i], NULL, 10);
+    } else if(strcmp(arg, "--joint") == 0) {
+      opt.joint = true;
+    } else if(strcmp(arg, "--bits") == 0 && has_value) {
+      opt.joint_bits = atoi(argv[++i]);
+    } else if(strcmp(arg, "--top") == 0 && has_value) {
+      opt.top = atoi(argv[++i]);
+    } else if(strcmp(arg, "--quantize") == 0) {
+      opt.quantize = true;
+    } else if(strcmp(arg, "--colors") == 0 && has_value) {
+      opt.colors = atoi(argv[++i]);
+    } else if(strcmp(arg, "--generate") == 0 && has_value) {
+      opt.generate = synth_kind(argv[++i]);
+      if(opt.generate < 0)
+        usage(argv[0]);
+    } else if(strcmp(arg, "--size") == 0 && has_value) {
+      char x;
+      if(sscanf(argv[++i], "%d%c%d", &opt.width, &x, &opt.height) != 3 || x != 'x')
+        usage(argv[0]);
+    } else if(strcmp(arg, "--tile") == 0 && has_value) {
+      opt.tile = atoi(argv[++i]);
+    } else if(strcmp(arg, "--clip") == 0 && has_value) {
+      opt.clip = atof(argv[++i]);
+    } else if(arg[0] == '-' && arg[1] == '-') {
+      usage(argv[0]);
+    } else if(npositional < 3) {
+      positional[npositional++] = arg;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  /* Histogram layout: --format, else the extension of the single image's
+     or --combined output.  Streams, stores and --stats stay .hist. */
+  if(opt.format < 0) {
+    const char *target = batch ? opt.combined : npositional == 3 ? positional[1] : NULL;
+    opt.format = target && !stream ? ggc::emit_format(target) : ggc::EMIT_HIST;
+  }
+  if(opt.format != ggc::EMIT_HIST && (stream || hist2store || store2hist || opt.stats))
+    usage(argv[0]);
+
+  if(hist2store || store2hist) {
+    if(npositional != 2 || batch || stream || (hist2store && store2hist))
+      usage(argv[0]);
+    if(hist2store)
+      return run_hist2store(positional[0], positional[1]);
+    return run_store2hist(positional[0], positional[1], opt.key, &opt);
+  }
+
+  if(opt.generate >= 0) {
+    if(npositional != 1 || batch || stream || opt.width < 1 || opt.height < 1)
+      usage(argv[0]);
+    return run_generate(positional[0], &opt);
+  }
+
+  if(stream) {
+    if(npositional != 0 || batch || opt.depth < 1 || opt.refresh < 0)
+      usage(argv[0]);
+    if(opt.threads <= 0)
+      opt.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(!opt.delta)
+      return run_stream(stream, &opt);
+    // one delta worker, each frame split across the pool
+    if(histo_init(opt.threads)) {
+      fprintf(stderr, "Unable to start worker pool\n");
+      return 1;
+    }
+    int rv = run_stream(stream, &opt);
+    histo_shutdown();
+    return rv;
+  }
+
+  if(opt.joint) {
+    if(npositional > 2 || npositional < 1 || batch || opt.joint_bits < 1 ||
+       opt.joint_bits > 8 || opt.top < 0)
+      usage(argv[0]);
+    if(histo_init(opt.threads)) {
+      fprintf(stderr, "Unable to start worker pool\n");
+      return 1;
+    }
+    int rv = run_joint(positional[0], npositional == 2 ? positional[1] : NULL, &opt);
+    histo_shutdown();
+    return rv;
+  }
+
+  if(opt.quantize) {
+    if(npositional != 2 || batch || opt.joint_bits < 1 || opt.joint_bits > 8 ||
+       opt.colors < 1 || opt.colors > HISTO_BINS)
+      usage(argv[0]);
+    if(histo_init(opt.threads)) {
+      fprintf(stderr, "Unable to start worker pool\n");
+      return 1;
+    }
+    int rv = run_quantize(positional[0], positional[1], &opt);
+    histo_shutdown();
+    return rv;
+  }
+
+  if(opt.integral) {
+    if(npositional != 1 || batch || opt.bins < 1 || opt.bins > HISTO_BINS ||
+       opt.queries < 0 || opt.verify < 0)
+      usage(argv[0]);
+    if(histo_init(opt.threads)) {
+      fprintf(stderr, "Unable to start worker pool\n");
+      return 1;
+    }
+    int rv = run_integral(positional[0], &opt);
+    histo_shutdown();
+    return rv;
+  }
+
+  if(opt.median) {
+    // 16-bit window counts limit the radius
+    if(npositional != 2 || batch || opt.radius < 0 || opt.radius > 127 ||
+       opt.percentile < 0 || opt.percentile > 100)
+      usage(argv[0]);
+    if(histo_init(opt.threads)) {
+      fprintf(stderr, "Unable to start worker pool\n");
+      return 1;
+    }
+    int rv = run_median(positional[0], positional[1], &opt);
+    histo_shutdown();
+    return rv;
+  }
+
+  if(opt.equalize) {
+    if(npositional != 2 || batch || opt.tile < 1 || opt.clip < 0)
+      usage(argv[0]);
+    if(histo_init(opt.threads)) {
+      fprintf(stderr, "Unable to start worker pool\n");
+      return 1;
+    }
+    int rv = run_equalize(positional[0], positional[1], &opt);
+    histo_shutdown();
+    return rv;
+  }
+
+  if(batch) {
+    if(npositional != 0)
+      usage(argv[0]);
+    if(opt.pipeline) {
+      if(opt.counters <= 0)
+        opt.counters = opt.threads > 0 ? opt.threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+      if(opt.depth < 1 || opt.loaders < 1 || opt.counters < 1 || opt.emitters < 1 ||
+         opt.io_buffer < 4096)
+        usage(argv[0]);
+      return run_pipeline(batch, &opt);
+    }
+    if(histo_init(opt.threads)) {
+      fprintf(stderr, "Unable to start worker pool\n");
+      return 1;
+    }
+    int rv = run_batch(batch, &opt);
+    histo_shutdown();
+    return rv;
+  }
+
+  if(npositional != 3)
+    usage(argv[0]);
+
+  int threads = atoi(positional[2]);
+  if(opt.threads > 0)
+    threads = opt.threads;
+  if(histo_init(threads)) {
+    fprintf(stderr, "Unable to start worker pool\n");
+    return 1;
+  }
+  int rv = run_single(positional[0], positional[1], &opt);
+  histo_shutdown();
+  return rv;
+}
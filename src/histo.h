@@ -0,0 +1,171 @@
+#pragma once
+
+/* Shared pieces of the histo driver (histo.cpp and its modes). */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "libhisto.h"
+#include "histo_arena.h"
+#include "histo_emit.h"
+
+struct img {
+  int xsize;
+  int ysize;
+  int maxrgb;
+  unsigned char *r;
+  unsigned char *g;
+  unsigned char *b;
+};
+
+enum { IO_STDIO, IO_PREAD, IO_URING };
+
+#define MAX_STAT_PERCENTILES 16
+
+struct options {
+  int threads;
+  const char *out_dir;        // per-image .hist files go here
+  const char *combined;       // or all of them into this one file
+  const char *store;          // or append them to this binary store (histo_store.h)
+  const char *key;            // --store2hist: just this image
+  long long large_pixels;     // images at least this big are split across workers
+
+  bool pipeline;              // overlap load, count and emit (--pipeline)
+  int depth;                  // images in flight between the stages
+  int loaders;
+  int counters;
+  int emitters;
+  int io;                     // how the pipeline loaders read files
+  size_t io_buffer;           // per-slot read buffer (registered with io_uring)
+  bool arena;                 // planes in a reused huge-page arena (--arena)
+
+  bool delta;                 // --stream: update from the previous frame
+  int refresh;                // full recount every N delta frames (0: never)
+
+  int progress_ms;            // single image: snapshot period (-1: off)
+
+  int format;                 // ggc::EMIT_* layout of the histograms (--format)
+
+  int channels[3];            // HISTO_CHANNEL_* histogrammed, R, G, B by default
+  int nchannels;
+
+  bool stats;                 // follow each histogram with its statistics
+  int nstat_percentiles;
+  double stat_percentiles[MAX_STAT_PERCENTILES];
+
+  bool equalize;              // write an equalized copy instead of a histogram
+  bool luma;                  // --equalize on the luminance CDF
+  bool clahe;                 // --equalize per tile, contrast limited
+  int tile;                   // CLAHE tile edge in pixels
+  double clip;                // CLAHE clip limit in multiples of the mean bin
+
+  bool median;                // write a rank-filtered copy
+  int radius;                 // filter window is (2 * radius + 1) squared
+  int percentile;             // rank within the window, 50 for the median
+
+  bool integral;              // time rectangle queries on an integral histogram
+  int bins;                   // its quantization
+  int queries;
+  int verify;                 // how many of them to check with histo_compute
+  unsigned long long seed;
+
+  bool joint;                 // joint RGB histogram instead of marginals
+  int joint_bits;             // bits kept per channel
+  int top;                    // most common cells to print
+
+  bool quantize;              // write a copy reduced to a palette
+  int colors;                 // palette size
+
+  int generate;               // SYNTH_* image to write (--generate), -1: off
+  int width;                  // its size (--size WxH)
+  int height;
+};
+
+struct batch_result {
+  uint64_t hist_r[HISTO_BINS];
+  uint64_t hist_g[HISTO_BINS];
+  uint64_t hist_b[HISTO_BINS];
+  int maxrgb;
+  bool ok;
+};
+
+/* Read a binary PPM into input, reusing its planes when *capacity (in pixels
+   per plane) is large enough.  Returns true on failure, like ppmb_read.
+   open_ppm/read_ppm are the two halves, for callers that want to look at
+   the header first; read_ppm always closes f. */
+bool load_ppm(const char *file_name, struct img *input, size_t *capacity);
+FILE *open_ppm(const char *file_name, struct img *input);
+bool read_ppm(FILE *f, const char *file_name, struct img *input, size_t *capacity);
+void free_img(struct img *input);
+
+/* read_ppm into planes carved from a, which is first reserved for this
+   image; if it has to grow, threads threads pre-fault the new mapping.
+   The planes belong to the arena, so input must not go to free_img. */
+bool read_ppm_arena(FILE *f, const char *file_name, struct img *input, struct arena *a,
+                    int threads);
+
+// One "Arena:" line for n arenas: size, backing, mappings, pre-fault time.
+void report_arenas(const struct arena *arenas, int n);
+
+/* Write xsize*ysize interleaved RGB pixels as a binary PPM with the same
+   header as ppmb_write, in one fwrite.  Returns true on failure. */
+bool write_ppm(const char *file_name, int xsize, int ysize, int maxrgb,
+               const unsigned char *data);
+
+/* Parse a P6 header at the start of data.  On success *offset is where the
+   xsize*ysize*3 bytes of interleaved pixels begin.  Returns true on failure. */
+bool parse_ppm_header(const unsigned char *data, size_t size, struct img *input,
+                      size_t *offset);
+
+/* The opt->nchannels histograms of one image in opt->format, in one
+   fwrite.  Hue and saturation always span 0..255; the other channels stop
+   at maxrgb. */
+void write_histograms(FILE *f, const uint64_t *hist_r, const uint64_t *hist_g,
+                      const uint64_t *hist_b, int maxrgb, const struct options *opt);
+
+/* The same into e, as the image called name when e is combined. */
+void emit_histograms(ggc::Emitter &e, const char *name, const uint64_t *hist_r,
+                     const uint64_t *hist_g, const uint64_t *hist_b, int maxrgb,
+                     const struct options *opt);
+
+/* histo_compute_channels for opt->channels into the first opt->nchannels
+   of hist_r, hist_g and hist_b. */
+int count_channels(const histo_image *img, uint64_t *hist_r, uint64_t *hist_g,
+                   uint64_t *hist_b, unsigned flags, const struct options *opt);
+
+/* With --stats, one "# stats" line per channel after the histograms:
+   key=value pairs from histo_stats_compute and the --percentiles asked for.
+   The '#' keeps readers that skip comment lines working.  No-op otherwise. */
+void write_stats(FILE *f, const uint64_t *hist_r, const uint64_t *hist_g,
+                 const uint64_t *hist_b, const struct options *opt);
+
+/* Output path for input_file: out_dir/<basename without .ppm>.hist, or
+   .csv/.json for those formats */
+void hist_path(char *buf, size_t len, const char *out_dir, const char *input_file,
+               int format);
+
+/* Input list for --batch: the *.ppm files of a directory in name order, or
+   the lines of a list file.  An empty source gives an empty list.  Returns
+   NULL, with errno set, if source cannot be read or the list allocated. */
+char **collect_files(const char *source, int *nfiles);
+void free_files(char **files, int nfiles);
+
+void write_hist_file(const struct options *opt, const char *input_file, const uint64_t *hist_r,
+                     const uint64_t *hist_g, const uint64_t *hist_b, int maxrgb);
+void write_combined(const struct options *opt, char *const *files,
+                    const struct batch_result *results, int nfiles);
+
+int run_batch(const char *source, const struct options *opt);
+int run_pipeline(const char *source, const struct options *opt);
+int run_stream(const char *source, const struct options *opt);
+int run_equalize(const char *input_file, const char *output_file,
+                 const struct options *opt);
+int run_median(const char *input_file, const char *output_file,
+               const struct options *opt);
+int run_integral(const char *input_file, const struct options *opt);
+int run_joint(const char *input_file, const char *output_file, const struct options *opt);
+int run_quantize(const char *input_file, const char *output_file,
+                 const struct options *opt);
+int run_hist2store(const char *text_file, const char *store_file);
+int run_store2hist(const char *store_file, const char *text_file, const char *key,
+                   const struct options *opt);
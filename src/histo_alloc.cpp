@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "histo_alloc.h"
+
+/* The counting allocator.  Process totals are relaxed atomics; the
+   thread's own live in the executable's TLS block, which exists before
+   the thread runs, so counting never allocates.  The blocks counted are
+   kept in an open-addressing set of addresses, in mmap'ed memory behind
+   a spin lock, so that a free only counts when its block did. */
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+}
+
+namespace ggc {
+
+static std::atomic<unsigned long long> process_allocs(0);
+static std::atomic<unsigned long long> process_frees(0);
+static std::atomic<unsigned long long> process_bytes(0);
+static std::atomic<long long> live(0);
+static std::atomic<long long> peak(0);
+static __thread AllocCounts this_thread;
+static std::atomic<bool> enabled(false);
+
+static std::atomic_flag table_lock = ATOMIC_FLAG_INIT;
+static uintptr_t *table;        // addresses of counted blocks, 0 if empty
+static int table_bits;
+static size_t table_used;
+
+static inline size_t table_slot(uintptr_t a) {
+  return (size_t) ((a >> 4) * 0x9e3779b97f4a7c15ULL >> (64 - table_bits));
+}
+
+static void table_put(uintptr_t a) {
+  size_t mask = ((size_t) 1 << table_bits) - 1;
+  size_t i = table_slot(a);
+  while(table[i])
+    i = (i + 1) & mask;
+  table[i] = a;
+}
+
+// Doubles the set, or starts it; false if mmap fails.
+static bool table_grow() {
+  uintptr_t *old = table;
+  size_t old_size = old ? (size_t) 1 << table_bits : 0;
+  int bits = old ? table_bits + 1 : 12;
+  void *m = mmap(NULL, sizeof(uintptr_t) << bits, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(m == MAP_FAILED)
+    return false;
+  table = (uintptr_t *) m;
+  table_bits = bits;
+  for(size_t i = 0; i < old_size; i++) {
+    if(old[i])
+      table_put(old[i]);
+  }
+  if(old)
+    munmap(old, sizeof(uintptr_t) * old_size);
+  return true;
+}
+
+static inline void table_acquire() {
+  while(table_lock.test_and_set(std::memory_order_acquire))
+    ;
+}
+
+static inline void table_release() {
+  table_lock.clear(std::memory_order_release);
+}
+
+// Records p as counted; false if there is no room to.
+static bool table_insert(void *p) {
+  table_acquire();
+  bool ok = true;
+  if((!table || (table_used + 1) * 2 > (size_t) 1 << table_bits) && !table_grow())
+    ok = table && table_used + 1 < (size_t) 1 << table_bits;
+  if(ok) {
+    table_put((uintptr_t) p);
+    table_used++;
+  }
+  table_release();
+  return ok;
+}
+
+// Forgets p; false if it was not counted.
+static bool table_remove(void *p) {
+  table_acquire();
+  bool found = false;
+  if(table) {
+    size_t mask = ((size_t) 1 << table_bits) - 1;
+    size_t i = table_slot((uintptr_t) p);
+    while(table[i] && table[i] != (uintptr_t) p)
+      i = (i + 1) & mask;
+    if(table[i]) {
+      found = true;
+      table_used--;
+      // shift the rest of the run back over the hole
+      size_t hole = i;
+      for(size_t j = (i + 1) & mask; table[j]; j = (j + 1) & mask) {
+        size_t home = table_slot(table[j]);
+        if(((j - home) & mask) >= ((j - hole) & mask)) {
+          table[hole] = table[j];
+          hole = j;
+        }
+      }
+      table[hole] = 0;
+    }
+  }
+  table_release();
+  return found;
+}
+
+static inline void counted(void *p) {
+  if(!p || !enabled.load(std::memory_order_relaxed) || !table_insert(p))
+    return;
+  unsigned long long size = malloc_usable_size(p);
+  process_allocs.fetch_add(1, std::memory_order_relaxed);
+  process_bytes.fetch_add(size, std::memory_order_relaxed);
+  this_thread.allocs++;
+  this_thread.bytes += size;
+  long long now = live.fetch_add(size, std::memory_order_relaxed) + size;
+  long long high = peak.load(std::memory_order_relaxed);
+  while(now > high && !peak.compare_exchange_weak(high, now, std::memory_order_relaxed))
+    ;
+}
+
+// True if p was counted, and is now counted as freed.
+static inline bool released(void *p) {
+  if(!p || !enabled.load(std::memory_order_relaxed) || !table_remove(p))
+    return false;
+  process_frees.fetch_add(1, std::memory_order_relaxed);
+  this_thread.frees++;
+  live.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+  return true;
+}
+
+void alloc_enable() {
+  enabled.store(true, std::memory_order_relaxed);
+}
+
+void alloc_process(AllocCounts *c) {
+  c->allocs = process_allocs.load(std::memory_order_relaxed);
+  c->frees = process_frees.load(std::memory_order_relaxed);
+  c->bytes = process_bytes.load(std::memory_order_relaxed);
+}
+
+void alloc_thread(AllocCounts *c) {
+  *c = this_thread;
+}
+
+unsigned long long alloc_peak() {
+  long long p = peak.load(std::memory_order_relaxed);
+  return p > 0 ? p : 0;
+}
+
+void alloc_reset_peak() {
+  peak.store(live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void memory_usage(MemoryUsage *m) {
+  struct rusage ru;
+  memset(m, 0, sizeof(*m));
+  if(getrusage(RUSAGE_SELF, &ru) == 0) {
+    m->peak_rss = ru.ru_maxrss * 1024ULL;
+    m->minor_faults = ru.ru_minflt;
+    m->major_faults = ru.ru_majflt;
+  }
+  // VmHWM follows clear_refs; ru_maxrss never goes down
+  FILE *f = fopen("/proc/self/status", "r");
+  if(!f)
+    return;
+  char line[128];
+  unsigned long long kb;
+  while(fgets(line, sizeof(line), f)) {
+    if(sscanf(line, "VmHWM: %llu kB", &kb) == 1) {
+      m->peak_rss = kb * 1024;
+      break;
+    }
+  }
+  fclose(f);
+}
+
+bool memory_reset_peak() {
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if(!f)
+    return false;
+  bool ok = fputs("5", f) >= 0;
+  return fclose(f) == 0 && ok;
+}
+}
+
+using namespace ggc;
+
+extern "C" {
+
+void *malloc(size_t size) {
+  void *p = __libc_malloc(size);
+  counted(p);
+  return p;
+}
+
+void *calloc(size_t n, size_t size) {
+  void *p = __libc_calloc(n, size);
+  counted(p);
+  return p;
+}
+
+void *realloc(void *old, size_t size) {
+  bool was = released(old);
+  void *p = __libc_realloc(old, size);
+  if(!p && old && size) {
+    if(was)
+      counted(old);             // failed; the old block is still there
+  } else {
+    counted(p);
+  }
+  return p;
+}
+
+void free(void *p) {
+  released(p);
+  __libc_free(p);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  void *p = __libc_memalign(alignment, size);
+  counted(p);
+  return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+  if(alignment < sizeof(void *) || (alignment & (alignment - 1)))
+    return EINVAL;
+  void *p = memalign(alignment, size);
+  if(!p && size)
+    return ENOMEM;
+  *out = p;
+  return 0;
+}
+
+void *valloc(size_t size) {
+  return memalign(sysconf(_SC_PAGESIZE), size);
+}
+}
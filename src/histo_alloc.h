@@ -0,0 +1,54 @@
+#pragma once
+
+/* Allocation accounting for the standalone programs and histo_bench.
+   histo_alloc.cpp replaces malloc, calloc, realloc, free and the aligned
+   variants of the programs it is linked into; each call goes on to
+   glibc's own (__libc_malloc and friends) and is counted on the way, for
+   the process and for the calling thread.  Bytes are usable sizes
+   (malloc_usable_size), what the heap actually hands out.  Memory that
+   does not come from malloc (mmap, thread stacks) is not seen here;
+   peak RSS and page faults cover it.
+
+   Counting is off until alloc_enable(), so a program that does not ask
+   for it (--memory, histo_bench) pays one relaxed load per call.  Blocks
+   allocated before then are not counted, and neither is freeing or
+   reallocating them: each counted block's address is recorded (outside
+   the heap), and a free only counts when its block is on record.  A
+   realloc of an uncounted block counts the new block as an allocation. */
+
+namespace ggc {
+
+struct AllocCounts {
+  unsigned long long allocs;    // malloc, calloc, realloc and aligned calls
+  unsigned long long frees;
+  unsigned long long bytes;     // allocated in total
+};
+
+// Starts counting, for the rest of the process.
+void alloc_enable();
+
+// Totals for the process since counting started.
+void alloc_process(AllocCounts *c);
+
+// Totals for the calling thread since it started or counting did.
+void alloc_thread(AllocCounts *c);
+
+// Most counted heap bytes live at once, since alloc_enable() or the last
+// alloc_reset_peak().
+unsigned long long alloc_peak();
+void alloc_reset_peak();
+
+struct MemoryUsage {
+  unsigned long long peak_rss;      // bytes; VmHWM, or ru_maxrss if unreadable
+  unsigned long long minor_faults;
+  unsigned long long major_faults;
+};
+
+// Peak RSS and page faults of the process so far.
+void memory_usage(MemoryUsage *m);
+
+/* Restarts the kernel's peak RSS at the current RSS (clear_refs 5), so
+   the next memory_usage() gives the peak of what ran in between.  False
+   if the kernel does not allow it; the peak then stays the process's. */
+bool memory_reset_peak();
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "Timer.h"
+#include "histo_arena.h"
+
+#define HUGE_PAGE (2UL << 20)
+
+struct prefault {
+  unsigned char *begin;
+  unsigned char *end;
+  size_t page;
+};
+
+// Writes one byte per page, which the kernel backs with a zeroed page.
+static void *prefault_range(void *arg) {
+  struct prefault *p = (struct prefault *) arg;
+  for(unsigned char *q = p->begin; q < p->end; q += p->page)
+    *(volatile unsigned char *) q = 0;
+  return NULL;
+}
+
+static void prefault(unsigned char *base, size_t size, int threads, size_t page) {
+  size_t pages = size / page;
+  if(threads < 1)
+    threads = 1;
+  if((size_t) threads > pages)
+    threads = pages > 0 ? (int) pages : 1;
+  struct prefault parts[threads];
+  pthread_t ids[threads];
+  bool started[threads];
+  for(int i = 0; i < threads; i++) {
+    parts[i].begin = base + pages * i / threads * page;
+    parts[i].end = base + pages * (i + 1) / threads * page;
+    parts[i].page = page;
+  }
+  for(int i = 1; i < threads; i++)
+    started[i] = pthread_create(&ids[i], NULL, prefault_range, &parts[i]) == 0;
+  prefault_range(&parts[0]);
+  // ranges whose thread did not start are faulted in here
+  for(int i = 1; i < threads; i++) {
+    if(!started[i])
+      prefault_range(&parts[i]);
+  }
+  for(int i = 1; i < threads; i++) {
+    if(started[i])
+      pthread_join(ids[i], NULL);
+  }
+}
+
+// A 2 MB aligned mapping of size bytes, for transparent huge pages.
+static unsigned char *map_aligned(size_t size) {
+  size_t span = size + HUGE_PAGE;
+  unsigned char *raw = (unsigned char *) mmap(NULL, span, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(raw == MAP_FAILED)
+    return NULL;
+  unsigned char *base = (unsigned char *) (((size_t) raw + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+  if(base > raw)
+    munmap(raw, base - raw);
+  if(base + size < raw + span)
+    munmap(base + size, raw + span - (base + size));
+  return base;
+}
+
+bool arena_reserve(struct arena *a, size_t bytes, int threads) {
+  a->used = 0;
+  if(a->base && bytes <= a->size)
+    return false;
+  arena_release(a);
+
+  size_t size = (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+  if(size == 0)
+    size = HUGE_PAGE;
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if(p != MAP_FAILED) {
+    a->base = (unsigned char *) p;
+    a->backing = ARENA_HUGETLB;
+    page = HUGE_PAGE;
+  } else {
+    a->base = map_aligned(size);
+    if(!a->base)
+      return true;
+    a->backing = ARENA_PAGES;
+#ifdef MADV_HUGEPAGE
+    if(madvise(a->base, size, MADV_HUGEPAGE) == 0)
+      a->backing = ARENA_THP;
+#endif
+  }
+  a->size = size;
+  a->maps++;
+
+  struct timespec begin, end;
+  clock_gettime(CLOCKTYPE, &begin);
+  prefault(a->base, size, threads, page);
+  clock_gettime(CLOCKTYPE, &end);
+  a->fault_ns += (end.tv_sec - begin.tv_sec) * NANOSEC + end.tv_nsec - begin.tv_nsec;
+  return false;
+}
+
+void *arena_alloc(struct arena *a, size_t bytes) {
+  size_t need = arena_size(bytes);
+  if(!a->base || need > a->size - a->used)
+    return NULL;
+  void *p = a->base + a->used;
+  a->used += need;
+  return p;
+}
+
+void *arena_zalloc(struct arena *a, size_t bytes) {
+  void *p = arena_alloc(a, bytes);
+  if(p)
+    memset(p, 0, bytes);
+  return p;
+}
+
+void arena_reset(struct arena *a) {
+  a->used = 0;
+}
+
+void arena_rewind(struct arena *a, size_t mark) {
+  if(mark < a->used)
+    a->used = mark;
+}
+
+void arena_release(struct arena *a) {
+  if(a->base)
+    munmap(a->base, a->size);
+  a->base = NULL;
+  a->size = 0;
+  a->used = 0;
+  a->backing = ARENA_NONE;
+}
+
+const char *arena_backing(const struct arena *a) {
+  switch(a->backing) {
+  case ARENA_HUGETLB:
+    return "hugetlb";
+  case ARENA_THP:
+    return "thp";
+  case ARENA_PAGES:
+    return "small pages";
+  default:
+    return "none";
+  }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+/* One mapping per job for everything a histogram of one image needs: the
+   three planes, the per-thread tables and the lock arrays.  Each
+   arena_alloc is a 64-byte aligned bump of a pointer, so nothing shares
+   a cache line by accident and nothing is freed piecemeal.
+
+   The mapping asks for huge pages: MAP_HUGETLB from the reserved pool
+   first, then transparent huge pages through madvise(MADV_HUGEPAGE), then
+   plain pages.  It is pre-faulted by several threads before it is handed
+   out, so neither reading the image nor the counting loop take page
+   faults, and it is kept between jobs: arena_reserve only maps again when
+   a job needs more than the arena holds. */
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 64
+
+enum { ARENA_NONE, ARENA_HUGETLB, ARENA_THP, ARENA_PAGES };
+
+struct arena {
+  unsigned char *base;
+  size_t size;                  // bytes mapped
+  size_t used;
+  int backing;                  // ARENA_*
+  int maps;                     // times it was (re)mapped
+  unsigned long long fault_ns;  // spent pre-faulting, in total
+};
+
+/* Makes room for at least bytes and empties the arena.  A new mapping is
+   pre-faulted by threads threads.  Returns true on failure, leaving the
+   arena empty and unmapped. */
+bool arena_reserve(struct arena *a, size_t bytes, int threads);
+
+/* bytes from the arena, ARENA_ALIGN aligned, or NULL if it is full.  The
+   memory holds whatever the previous job left; arena_zalloc clears it. */
+void *arena_alloc(struct arena *a, size_t bytes);
+void *arena_zalloc(struct arena *a, size_t bytes);
+
+// Space taken by n bytes once aligned, for sizing arena_reserve.
+static inline size_t arena_size(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+// Forgets every allocation; the mapping stays.
+void arena_reset(struct arena *a);
+
+// Forgets the allocations made since a->used was mark.
+void arena_rewind(struct arena *a, size_t mark);
+
+void arena_release(struct arena *a);
+
+// "hugetlb", "thp", "small pages" or "none".
+const char *arena_backing(const struct arena *a);
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_pool.h"
+#include "histo_store.h"
+
+// Large images are split in up to this many bands per worker.
+#define BANDS_PER_WORKER 4
+
+/* A large image being counted in bands by whichever workers are free.
+   Its loader's buffer holds the planes until the last band is done. */
+struct large_job {
+  int index;                      // file, or -1 when idle
+  struct img *input;
+  int nbands;
+  int next_band;
+  int bands_left;
+  int error;                      // HISTO_E* of a failed band, or 0
+  uint64_t hist[3][HISTO_BINS];
+};
+
+/* Everything below the lock is shared by the workers: the next file, the
+   files not yet done and the large jobs, one slot per worker. */
+struct batch {
+  const struct options *opt;
+  char **files;
+  int nfiles;
+  int workers;
+  struct batch_result *results;   // only kept for --combined
+  int store;                      // --store descriptor, or -1
+  struct img *buffers;            // one reusable image per worker
+  size_t *capacity;
+  struct arena *arenas;           // --arena: one per worker, kept across images
+  long long pixels;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t work;            // a job was published or finished
+  int next_file;
+  int remaining;
+  int nlarge;
+  struct large_job *jobs;
+};
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Returns true if there is no memory for another name.
+static bool add_file(char ***files, int *n, int *cap, const char *name) {
+  if(*n == *cap) {
+    int grown = *cap * 2;
+    char **more = (char **) realloc(*files, sizeof(char *) * grown);
+    if(!more)
+      return true;
+    *files = more;
+    *cap = grown;
+  }
+  char *copy = strdup(name);
+  if(!copy)
+    return true;
+  (*files)[(*n)++] = copy;
+  return false;
+}
+
+// A directory contributes its *.ppm entries in name order; anything else is
+// read as a list with one path per line ('#' starts a comment).
+char **collect_files(const char *source, int *nfiles) {
+  int n = 0, cap = 64;
+  char **files = (char **) malloc(sizeof(char *) * cap);
+  if(!files)
+    return NULL;
+  bool failed = false;
+  struct stat st;
+
+  if(stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(source);
+    failed = !dir;
+    struct dirent *e;
+    char path[4096];
+    while(!failed && (e = readdir(dir))) {
+      size_t len = strlen(e->d_name);
+      if(len > 4 && strcmp(e->d_name + len - 4, ".ppm") == 0) {
+        snprintf(path, sizeof(path), "%s/%s", source, e->d_name);
+        failed = add_file(&files, &n, &cap, path);
+      }
+    }
+    if(dir)
+      closedir(dir);
+    qsort(files, n, sizeof(char *), compare_names);
+  } else {
+    FILE *list = fopen(source, "r");
+    failed = !list;
+    char line[4096];
+    while(!failed && fgets(line, sizeof(line), list)) {
+      size_t len = strcspn(line, "\r\n");
+      line[len] = 0;
+      if(len == 0 || line[0] == '#')
+        continue;
+      failed = add_file(&files, &n, &cap, line);
+    }
+    if(list)
+      fclose(list);
+  }
+
+  if(failed) {
+    int saved = errno;
+    free_files(files, n);
+    errno = saved;
+    return NULL;
+  }
+  *nfiles = n;
+  return files;
+}
+
+void free_files(char **files, int nfiles) {
+  for(int i = 0; i < nfiles; i++)
+    free(files[i]);
+  free(files);
+}
+
+void write_hist_file(const struct options *opt, const char *input_file, const uint64_t *hist_r,
+                     const uint64_t *hist_g, const uint64_t *hist_b, int maxrgb) {
+  char path[4096];
+  hist_path(path, sizeof(path), opt->out_dir, input_file, opt->format);
+  FILE *out = fopen(path, "w");
+  if(out) {
+    write_histograms(out, hist_r, hist_g, hist_b, maxrgb, opt);
+    write_stats(out, hist_r, hist_g, hist_b, opt);
+    fclose(out);
+  } else {
+    fprintf(stderr, "Unable to output %s!\n", path);
+  }
+}
+
+void write_combined(const struct options *opt, char *const *files,
+                    const struct batch_result *results, int nfiles) {
+  FILE *out = fopen(opt->combined, "w");
+  if(!out) {
+    fprintf(stderr, "Unable to output %s!\n", opt->combined);
+    return;
+  }
+  ggc::Emitter e(out, opt->format, true);
+  for(int i = 0; i < nfiles; i++) {
+    if(!results[i].ok)
+      continue;
+    emit_histograms(e, files[i], results[i].hist_r, results[i].hist_g,
+                    results[i].hist_b, results[i].maxrgb, opt);
+    if(opt->stats) {
+      e.flush();
+      write_stats(out, results[i].hist_r, results[i].hist_g, results[i].hist_b, opt);
+    }
+  }
+  if(e.finish() | (fclose(out) != 0))
+    fprintf(stderr, "Unable to output %s!\n", opt->combined);
+}
+
+static void fail(struct batch *b) {
+  pthread_mutex_lock(&b->lock);
+  b->failed++;
+  pthread_mutex_unlock(&b->lock);
+}
+
+static void emit(struct batch *b, int i, struct img *input, const uint64_t *hist_r,
+                 const uint64_t *hist_g, const uint64_t *hist_b) {
+  if(b->store >= 0) {
+    const uint64_t *hists[3] = { hist_r, hist_g, hist_b };
+    if(store_append(b->store, b->files[i], hists, b->opt->channels, b->opt->nchannels,
+                    input->maxrgb)) {
+      fprintf(stderr, "Failed appending %s to %s\n", b->files[i], b->opt->store);
+      fail(b);
+    }
+    return;
+  }
+  if(b->results) {
+    struct batch_result *res = &b->results[i];
+    memcpy(res->hist_r, hist_r, sizeof(res->hist_r));
+    memcpy(res->hist_g, hist_g, sizeof(res->hist_g));
+    memcpy(res->hist_b, hist_b, sizeof(res->hist_b));
+    res->maxrgb = input->maxrgb;
+    res->ok = true;
+    return;
+  }
+
+  write_hist_file(b->opt, b->files[i], hist_r, hist_g, hist_b, input->maxrgb);
+}
+
+static void file_done(struct batch *b) {
+  pthread_mutex_lock(&b->lock);
+  if(--b->remaining == 0)
+    pthread_cond_broadcast(&b->work);
+  pthread_mutex_unlock(&b->lock);
+}
+
+static void count(struct batch *b, int i, struct img *input) {
+  uint64_t hist_r[HISTO_BINS], hist_g[HISTO_BINS], hist_b[HISTO_BINS];
+  histo_image image;
+  histo_image_planar(&image, input->xsize, input->ysize,
+                     input->r, input->g, input->b, input->xsize);
+  int err = count_channels(&image, hist_r, hist_g, hist_b, HISTO_SINGLE_THREAD, b->opt);
+  if(err < 0) {
+    fprintf(stderr, "Unable to count %s: %s\n", b->files[i], histo_strerror(err));
+    fail(b);
+    return;
+  }
+  emit(b, i, input, hist_r, hist_g, hist_b);
+
+  pthread_mutex_lock(&b->lock);
+  b->pixels += (long long) input->xsize * input->ysize;
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Offers the image its worker just loaded to every worker, band by band.
+static void publish(struct batch *b, int i, int worker) {
+  struct large_job *job = &b->jobs[worker];
+  struct img *input = &b->buffers[worker];
+  pthread_mutex_lock(&b->lock);
+  job->index = i;
+  job->input = input;
+  job->nbands = input->ysize < BANDS_PER_WORKER * b->workers ? input->ysize
+                                                               : BANDS_PER_WORKER * b->workers;
+  job->next_band = 0;
+  job->bands_left = job->nbands;
+  job->error = 0;
+  memset(job->hist, 0, sizeof(job->hist));
+  b->nlarge++;
+  pthread_cond_broadcast(&b->work);
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Counts one band of job into its totals; the last band out emits the image.
+static void count_band(struct batch *b, struct large_job *job, int band) {
+  struct img *input = job->input;
+  uint64_t hist[3][HISTO_BINS];
+  uint64_t *hists[3] = { hist[0], hist[1], hist[2] };
+  histo_image image;
+  histo_image_planar(&image, input->xsize, input->ysize,
+                     input->r, input->g, input->b, input->xsize);
+  histo_roi roi;
+  roi.x = 0;
+  roi.y = (int) ((long long) input->ysize * band / job->nbands);
+  roi.width = input->xsize;
+  roi.height = (int) ((long long) input->ysize * (band + 1) / job->nbands) - roi.y;
+  int err = histo_compute_channels(&image, &roi, b->opt->channels, b->opt->nchannels, hists,
+                                   HISTO_SINGLE_THREAD);
+
+  pthread_mutex_lock(&b->lock);
+  if(err < 0)
+    job->error = err;
+  else {
+    for(int c = 0; c < b->opt->nchannels; c++) {
+      for(int v = 0; v < HISTO_BINS; v++)
+        job->hist[c][v] += hist[c][v];
+    }
+  }
+  bool last = --job->bands_left == 0;
+  pthread_mutex_unlock(&b->lock);
+  if(!last)
+    return;
+
+  if(job->error < 0) {
+    fprintf(stderr, "Unable to count %s: %s\n", b->files[job->index], histo_strerror(job->error));
+    fail(b);
+  } else {
+    emit(b, job->index, input, job->hist[0], job->hist[1], job->hist[2]);
+  }
+  pthread_mutex_lock(&b->lock);
+  if(job->error == 0)
+    b->pixels += (long long) input->xsize * input->ysize;
+  job->index = -1;
+  b->remaining--;
+  pthread_cond_broadcast(&b->work);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Reads file i into the worker's buffer.  A small image is counted right
+   here; a large one is published for all workers to count in bands. */
+static void load_file(struct batch *b, int i, int worker) {
+  struct img *input = &b->buffers[worker];
+  FILE *f = open_ppm(b->files[i], input);
+  if(!f || (b->arenas ? read_ppm_arena(f, b->files[i], input, &b->arenas[worker], 1)
+                      : read_ppm(f, b->files[i], input, &b->capacity[worker]))) {
+    fail(b);
+    file_done(b);
+    return;
+  }
+  if((long long) input->xsize * input->ysize >= b->opt->large_pixels) {
+    publish(b, i, worker);
+    return;
+  }
+  count(b, i, input);
+  file_done(b);
+}
+
+/* Every worker runs this one loop until all files are done: bands of
+   large images first, so their planes are freed soon, then the next
+   file.  A worker whose large image is still being counted helps with
+   bands or waits, as its buffer is in use. */
+static void batch_worker(void *arg, int task, int worker) {
+  struct batch *b = (struct batch *) arg;
+  pthread_mutex_lock(&b->lock);
+  while(b->remaining > 0) {
+    struct large_job *job = NULL;
+    for(int w = 0; w < b->workers && !job; w++) {
+      if(b->jobs[w].index >= 0 && b->jobs[w].next_band < b->jobs[w].nbands)
+        job = &b->jobs[w];
+    }
+    if(job) {
+      int band = job->next_band++;
+      pthread_mutex_unlock(&b->lock);
+      count_band(b, job, band);
+      pthread_mutex_lock(&b->lock);
+    } else if(b->jobs[worker].index < 0 && b->next_file < b->nfiles) {
+      int i = b->next_file++;
+      pthread_mutex_unlock(&b->lock);
+      load_file(b, i, worker);
+      pthread_mutex_lock(&b->lock);
+    } else {
+      pthread_cond_wait(&b->work, &b->lock);
+    }
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+int run_batch(const char *source, const struct options *opt) {
+  struct batch b;
+  memset(&b, 0, sizeof(b));
+  b.opt = opt;
+  b.store = -1;
+  b.files = collect_files(source, &b.nfiles);
+  if(!b.files || b.nfiles == 0) {
+    if(b.files)
+      fprintf(stderr, "No images in batch source %s\n", source);
+    else
+      fprintf(stderr, "Unable to read batch source %s: %s\n", source, strerror(errno));
+    free_files(b.files, b.nfiles);
+    return 1;
+  }
+  if(opt->store && (b.store = store_open_append(opt->store)) < 0) {
+    free_files(b.files, b.nfiles);
+    return 1;
+  }
+
+  struct pool *p = histo_shared_pool();
+  int workers = pool_size(p);
+  b.workers = workers;
+
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.work, NULL);
+  b.remaining = b.nfiles;
+  b.jobs = (struct large_job *) calloc(workers, sizeof(struct large_job));
+  b.buffers = (struct img *) calloc(workers, sizeof(struct img));
+  b.capacity = (size_t *) calloc(workers, sizeof(size_t));
+  if(opt->arena)
+    b.arenas = (struct arena *) calloc(workers, sizeof(struct arena));
+  if(opt->combined && b.store < 0)
+    b.results = (struct batch_result *) calloc(b.nfiles, sizeof(struct batch_result));
+  if(!b.jobs || !b.buffers || !b.capacity || (opt->arena && !b.arenas) ||
+     (opt->combined && b.store < 0 && !b.results)) {
+    fprintf(stderr, "Unable to allocate batch state for %d files\n", b.nfiles);
+    b.failed = b.nfiles;
+    workers = 0;
+  }
+  for(int w = 0; w < workers; w++)
+    b.jobs[w].index = -1;
+
+  ggc::Timer t("batch");
+
+  t.start();
+  if(workers > 0)
+    pool_run(p, batch_worker, &b, workers);
+
+  if(b.results)
+    write_combined(opt, b.files, b.results, b.nfiles);
+  t.stop();
+
+  int done = b.nfiles - b.failed;
+  double seconds = (double) t.duration() / NANOSEC;
+  printf("Images: %d (%d large, %d failed)\n", done, b.nlarge, b.failed);
+  printf("Threads: %d\n", b.workers);
+  printf("Time: %llu ns\n", t.duration());
+  printf("Throughput: %.1f images/s, %.1f Mpixels/s\n",
+         seconds > 0 ? done / seconds : 0.0,
+         seconds > 0 ? b.pixels / seconds / 1e6 : 0.0);
+  if(b.arenas && workers > 0)
+    report_arenas(b.arenas, workers);
+
+  for(int i = 0; i < workers; i++) {
+    if(b.arenas)
+      arena_release(&b.arenas[i]);
+    else
+      free_img(&b.buffers[i]);
+  }
+  free_files(b.files, b.nfiles);
+  free(b.jobs);
+  free(b.buffers);
+  free(b.capacity);
+  free(b.arenas);
+  free(b.results);
+  if(b.store >= 0)
+    close(b.store);
+  pthread_cond_destroy(&b.work);
+  pthread_mutex_destroy(&b.lock);
+  return b.failed ? 1 : 0;
+}
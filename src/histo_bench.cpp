@@ -0,0 +1,888 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "Timer.h"
+#include "histo_alloc.h"
+#include "histo_arena.h"
+#include "histo.h"
+#include "histo_synth.h"
+#include "histo_locks.h"
+
+extern "C" {
+#include "ppmb_io.h"
+}
+
+/* histo_bench: every counting strategy of the lab, timed in one process.
+   Each image is read once; each strategy and thread count then gets
+   --warmup untimed runs and --iterations timed ones, whose distribution
+   (median, p90, p99, min, MAD) and throughput are reported as a table on
+   stdout and optionally as JSON and CSV.  The timed region of each
+   strategy is the one its standalone program times, thread creation
+   included; "pool" is libhisto's histo_compute on its persistent pool.
+   Every run is checked against the serial histogram.
+
+   Inputs named synth:KIND:WxH are generated (histo_synth.h) instead of
+   read.  With --weak their height is multiplied by the thread count, so
+   every thread has the same share of pixels at each count (weak scaling);
+   otherwise the image is the same for every count (strong scaling).
+
+   --roofline also measures, STREAM style, how fast the same number of
+   threads can just read a buffer as large as the image's three planes,
+   and gives each strategy's GB/s as a share of that roof.  Near 100% a
+   strategy is bound by memory bandwidth; well below it, by its own
+   instructions or contention.  The probe buffer matches the image, so an
+   image that fits in the last level cache is held to the cache's bandwidth
+   and a larger one to DRAM's.
+
+   Every row also gives the allocator calls and bytes per timed run
+   (histo_alloc.h), minor page faults per run and the peak RSS while that
+   row ran.  Each strategy has an allocation budget, the tables it is
+   built around; if even its leanest timed run allocates more, the row is
+   flagged, like a wrong histogram, and the benchmark fails.
+
+   With --arena each image is copied into one huge-page arena, pre-faulted
+   and kept from image to image (histo_arena.h), which also holds the lock
+   arrays; private and lockfree take their tables from it on every run
+   instead of calloc. */
+
+struct strategy {
+  const char *name;
+  void (*run)(const struct img *in, int threads, int *hist_r, int *hist_g, int *hist_b);
+  bool threaded;
+  int allocs;                   // allocation budget per run: allocs + per_thread * threads,
+  int per_thread;               // plus what pthread_create itself takes if it spawns
+  bool spawns;
+};
+
+struct range {
+  const struct img *input;
+  int *hist_r;
+  int *hist_g;
+  int *hist_b;
+  std::atomic<int> *atomic_r;
+  std::atomic<int> *atomic_g;
+  std::atomic<int> *atomic_b;
+  int start;
+  int end;
+};
+
+static void split(struct range *idx, const struct img *in, int threads) {
+  long long N = (long long) in->xsize * in->ysize;
+  for(int i = 0; i < threads; i++) {
+    idx[i].input = in;
+    idx[i].start = (int) ((long long) N * i / threads);
+    idx[i].end = (int) ((long long) N * (i + 1) / threads);
+  }
+}
+
+static void spawn(struct range *idx, int threads, void *(*fn)(void *)) {
+  pthread_t ids[threads];
+  for(int i = 0; i < threads; i++)
+    pthread_create(&ids[i], NULL, fn, (void *) (idx + i));
+  for(int i = 0; i < threads; i++)
+    pthread_join(ids[i], NULL);
+}
+
+// --arena: planes and locks, then from tables_mark on the tables of one run
+static struct arena *bench_arena;
+static size_t tables_mark;
+
+static void *table(size_t bytes) {
+  return bench_arena ? arena_zalloc(bench_arena, bytes) : calloc(1, bytes);
+}
+
+static void release_table(void *p) {
+  if(!bench_arena)
+    free(p);
+}
+
+// histogram
+static void run_serial(const struct img *in, int threads, int *hist_r, int *hist_g,
+                       int *hist_b) {
+  (void) threads;
+  long long N = (long long) in->xsize * in->ysize;
+  for(long long pix = 0; pix < N; pix++) {
+    hist_r[in->r[pix]] += 1;
+    hist_g[in->g[pix]] += 1;
+    hist_b[in->b[pix]] += 1;
+  }
+}
+
+// histo_private
+static void* private_worker(void *thread) {
+  struct range *idx = (struct range *) thread;
+  const struct img *in = idx->input;
+  for(int pix = idx->start; pix < idx->end; pix++) {
+    idx->hist_r[in->r[pix]] += 1;
+    idx->hist_g[in->g[pix]] += 1;
+    idx->hist_b[in->b[pix]] += 1;
+  }
+  return NULL;
+}
+
+static void run_private(const struct img *in, int threads, int *hist_r, int *hist_g,
+                        int *hist_b) {
+  struct range idx[threads];
+  split(idx, in, threads);
+  if(bench_arena)
+    arena_rewind(bench_arena, tables_mark);
+  for(int i = 0; i < threads; i++) {
+    idx[i].hist_r = (int *) table(HISTO_BINS * sizeof(int));
+    idx[i].hist_g = (int *) table(HISTO_BINS * sizeof(int));
+    idx[i].hist_b = (int *) table(HISTO_BINS * sizeof(int));
+  }
+  spawn(idx, threads, private_worker);
+  for(int i = 0; i < threads; i++) {
+    for(int j = 0; j < HISTO_BINS; j++) {
+      hist_r[j] += idx[i].hist_r[j];
+      hist_g[j] += idx[i].hist_g[j];
+      hist_b[j] += idx[i].hist_b[j];
+    }
+    release_table(idx[i].hist_r);
+    release_table(idx[i].hist_g);
+    release_table(idx[i].hist_b);
+  }
+}
+
+// histo_lockfree
+static void* lockfree_worker(void *thread) {
+  struct range *idx = (struct range *) thread;
+  const struct img *in = idx->input;
+  for(int pix = idx->start; pix < idx->end; pix++) {
+    idx->atomic_r[in->r[pix]].fetch_add(1, std::memory_order_relaxed);
+    idx->atomic_g[in->g[pix]].fetch_add(1, std::memory_order_relaxed);
+    idx->atomic_b[in->b[pix]].fetch_add(1, std::memory_order_relaxed);
+  }
+  return NULL;
+}
+
+static void run_lockfree(const struct img *in, int threads, int *hist_r, int *hist_g,
+                         int *hist_b) {
+  if(bench_arena)
+    arena_rewind(bench_arena, tables_mark);
+  std::atomic<int> *atomic_r = (std::atomic<int> *) table(HISTO_BINS * sizeof(std::atomic<int>));
+  std::atomic<int> *atomic_g = (std::atomic<int> *) table(HISTO_BINS * sizeof(std::atomic<int>));
+  std::atomic<int> *atomic_b = (std::atomic<int> *) table(HISTO_BINS * sizeof(std::atomic<int>));
+  for(int i = 0; i < HISTO_BINS; i++) {
+    new (&atomic_r[i]) std::atomic<int>(0);
+    new (&atomic_g[i]) std::atomic<int>(0);
+    new (&atomic_b[i]) std::atomic<int>(0);
+  }
+
+  struct range idx[threads];
+  split(idx, in, threads);
+  for(int i = 0; i < threads; i++) {
+    idx[i].atomic_r = atomic_r;
+    idx[i].atomic_g = atomic_g;
+    idx[i].atomic_b = atomic_b;
+  }
+  spawn(idx, threads, lockfree_worker);
+
+  for(int i = 0; i < HISTO_BINS; i++) {
+    hist_r[i] = atomic_r[i].load(std::memory_order_relaxed);
+    hist_g[i] = atomic_g[i].load(std::memory_order_relaxed);
+    hist_b[i] = atomic_b[i].load(std::memory_order_relaxed);
+  }
+  release_table(atomic_r);
+  release_table(atomic_g);
+  release_table(atomic_b);
+}
+
+// histo_lock1 and histo_lock2: local tables, merged bin by bin under a lock
+template <class Lock>
+static void merge_locked(Lock *locks, int *hist, const int *local) {
+  for(int i = 0; i < HISTO_BINS; i++) {
+    if(local[i] > 0) {
+      locks[i].lock();
+      hist[i] += local[i];
+      locks[i].unlock();
+    }
+  }
+}
+
+template <class Lock>
+static void* lock_worker(void *thread) {
+  struct range *idx = (struct range *) thread;
+  const struct img *in = idx->input;
+  int local_r[HISTO_BINS] = {0};
+  int local_g[HISTO_BINS] = {0};
+  int local_b[HISTO_BINS] = {0};
+
+  for(int pix = idx->start; pix < idx->end; pix++) {
+    local_r[in->r[pix]]++;
+    local_g[in->g[pix]]++;
+    local_b[in->b[pix]]++;
+  }
+  merge_locked(BinLocks<Lock>::r, idx->hist_r, local_r);
+  merge_locked(BinLocks<Lock>::g, idx->hist_g, local_g);
+  merge_locked(BinLocks<Lock>::b, idx->hist_b, local_b);
+  return NULL;
+}
+
+template <class Lock>
+static void run_locked(const struct img *in, int threads, int *hist_r, int *hist_g,
+                       int *hist_b) {
+  struct range idx[threads];
+  split(idx, in, threads);
+  for(int i = 0; i < threads; i++) {
+    idx[i].hist_r = hist_r;
+    idx[i].hist_g = hist_g;
+    idx[i].hist_b = hist_b;
+  }
+  spawn(idx, threads, lock_worker<Lock>);
+}
+
+// libhisto; the pool is started outside the timed runs
+static void run_pool(const struct img *in, int threads, int *hist_r, int *hist_g,
+                     int *hist_b) {
+  (void) threads;
+  uint64_t r[HISTO_BINS], g[HISTO_BINS], b[HISTO_BINS];
+  histo_image image;
+  histo_image_planar(&image, in->xsize, in->ysize, in->r, in->g, in->b, in->xsize);
+  histo_compute(&image, NULL, r, g, b, 0);
+  for(int i = 0; i < HISTO_BINS; i++) {
+    hist_r[i] = (int) r[i];
+    hist_g[i] = (int) g[i];
+    hist_b[i] = (int) b[i];
+  }
+}
+
+/* Read bandwidth probe: after a barrier each thread sums its slice of the
+   buffer as 64-bit words, which the compiler vectorizes; the span from the
+   first start to the last finish is one run, and the fastest of
+   PROBE_RUNS is the roof. */
+#define PROBE_RUNS 10
+#define PROBE_ROOFS 256
+
+struct probe {
+  const uint64_t *words;
+  size_t start;
+  size_t end;
+  pthread_barrier_t *barrier;
+  unsigned long long begin;
+  unsigned long long finish;
+  uint64_t sum;                 // kept so the loads are not optimized away
+};
+
+struct roof {
+  size_t bytes;
+  int threads;
+  double gbps;
+};
+
+static unsigned long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCKTYPE, &ts);
+  return ts.tv_sec * NANOSEC + ts.tv_nsec;
+}
+
+static void* probe_worker(void *arg) {
+  struct probe *p = (struct probe *) arg;
+  const uint64_t *words = p->words;
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  pthread_barrier_wait(p->barrier);
+  p->begin = now_ns();
+  size_t i = p->start;
+  for(; i + 4 <= p->end; i += 4) {
+    s0 += words[i];
+    s1 += words[i + 1];
+    s2 += words[i + 2];
+    s3 += words[i + 3];
+  }
+  for(; i < p->end; i++)
+    s0 += words[i];
+  p->finish = now_ns();
+  p->sum = s0 + s1 + s2 + s3;
+  return NULL;
+}
+
+// GB/s at which threads read a buffer of bytes, or 0 if it cannot be had.
+static double read_bandwidth(size_t bytes, int threads) {
+  size_t nwords = bytes / sizeof(uint64_t);
+  uint64_t *words = (uint64_t *) malloc(nwords * sizeof(uint64_t));
+  if(nwords == 0 || !words) {
+    free(words);
+    return 0.0;
+  }
+  memset(words, 1, nwords * sizeof(uint64_t));  // fault every page in first
+
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, threads);
+  struct probe p[threads];
+  pthread_t ids[threads];
+  unsigned long long best = 0;
+  for(int run = 0; run < PROBE_RUNS; run++) {
+    for(int t = 0; t < threads; t++) {
+      p[t].words = words;
+      p[t].start = nwords * t / threads;
+      p[t].end = nwords * (t + 1) / threads;
+      p[t].barrier = &barrier;
+      pthread_create(&ids[t], NULL, probe_worker, &p[t]);
+    }
+    unsigned long long begin = 0, finish = 0;
+    for(int t = 0; t < threads; t++) {
+      pthread_join(ids[t], NULL);
+      if(t == 0 || p[t].begin < begin)
+        begin = p[t].begin;
+      if(p[t].finish > finish)
+        finish = p[t].finish;
+    }
+    if(run == 0 || finish - begin < best)
+      best = finish - begin;
+  }
+  pthread_barrier_destroy(&barrier);
+  free(words);
+  return best ? (double) (nwords * sizeof(uint64_t)) / best : 0.0;
+}
+
+// The roof for bytes at threads, probed the first time it is asked for.
+static double roof_for(struct roof *roofs, int *nroofs, size_t bytes, int threads) {
+  for(int i = 0; i < *nroofs; i++) {
+    if(roofs[i].bytes == bytes && roofs[i].threads == threads)
+      return roofs[i].gbps;
+  }
+  double gbps = read_bandwidth(bytes, threads);
+  if(*nroofs < PROBE_ROOFS) {
+    roofs[*nroofs].bytes = bytes;
+    roofs[*nroofs].threads = threads;
+    roofs[*nroofs].gbps = gbps;
+    (*nroofs)++;
+  }
+  return gbps;
+}
+
+// Size of the highest level data or unified cache of cpu0, 0 if unknown.
+static size_t llc_bytes() {
+  size_t best = 0;
+  int best_level = 0;
+  for(int i = 0; i < 8; i++) {
+    char path[96], type[32];
+    int level = 0;
+    unsigned long size = 0;
+    char unit = 0;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+    FILE *f = fopen(path, "r");
+    if(!f)
+      continue;
+    bool ok = fscanf(f, "%d", &level) == 1;
+    fclose(f);
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+    f = fopen(path, "r");
+    ok = ok && f && fscanf(f, "%31s", type) == 1 && strcmp(type, "Instruction") != 0;
+    if(f)
+      fclose(f);
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+    f = fopen(path, "r");
+    ok = ok && f && fscanf(f, "%lu%c", &size, &unit) >= 1;
+    if(f)
+      fclose(f);
+    if(!ok || level <= best_level)
+      continue;
+    best_level = level;
+    best = size * (unit == 'K' ? 1024 : unit == 'M' ? 1024 * 1024 : 1);
+  }
+  if(best == 0) {
+    long sc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    best = sc > 0 ? (size_t) sc : 0;
+  }
+  return best;
+}
+
+/* Budgets: private has three tables per thread, lockfree one set of
+   atomic tables; the locked variants count on the stack and the pool
+   into the caller's arrays. */
+static const struct strategy strategies[] = {
+  { "serial", run_serial, false, 0, 0, false },
+  { "private", run_private, true, 0, 3, true },
+  { "lockfree", run_lockfree, true, 3, 0, true },
+  { "lock1", run_locked<Spinlock>, true, 0, 0, true },
+  { "lock2", run_locked<SequencialLock>, true, 0, 0, true },
+  { "pool", run_pool, true, 0, 0, false },
+};
+
+static void* idle_worker(void *thread) {
+  return thread;
+}
+
+/* Allocations of spawning and joining threads that do nothing: none once
+   glibc caches their stacks, a few per thread when there are more stacks
+   than its cache keeps. */
+static unsigned long long spawn_allocs(int threads) {
+  struct range idx[threads];
+  unsigned long long fewest = 0;
+  for(int i = 0; i < 3; i++) {
+    ggc::AllocCounts before, after;
+    ggc::alloc_process(&before);
+    spawn(idx, threads, idle_worker);
+    ggc::alloc_process(&after);
+    if(i == 0 || after.allocs - before.allocs < fewest)
+      fewest = after.allocs - before.allocs;
+  }
+  return fewest;
+}
+#define NSTRATEGIES ((int) (sizeof(strategies) / sizeof(strategies[0])))
+
+struct result {
+  const char *image;
+  long long pixels;
+  const char *strategy;
+  int threads;
+  unsigned long long median, p90, p99, min, mad;
+  double mean;
+  double roof;                  // probed GB/s, 0 without --roofline
+  unsigned long long allocs;    // fewest allocator calls in one timed run
+  unsigned long long alloc_bytes;   // bytes in that run
+  double faults;                // minor page faults per timed run
+  unsigned long long peak_rss;
+  bool verified;
+  bool in_budget;
+};
+
+static int compare_ull(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+// nearest rank on sorted samples
+static unsigned long long percentile(const unsigned long long *sorted, int n, int p) {
+  int rank = (int) (((long long) n * p + 99) / 100);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void summarize(struct result *res, unsigned long long *samples, int n) {
+  qsort(samples, n, sizeof(unsigned long long), compare_ull);
+  res->median = percentile(samples, n, 50);
+  res->p90 = percentile(samples, n, 90);
+  res->p99 = percentile(samples, n, 99);
+  res->min = samples[0];
+  double sum = 0;
+  for(int i = 0; i < n; i++)
+    sum += samples[i];
+  res->mean = sum / n;
+  for(int i = 0; i < n; i++)
+    samples[i] = samples[i] > res->median ? samples[i] - res->median : res->median - samples[i];
+  qsort(samples, n, sizeof(unsigned long long), compare_ull);
+  res->mad = percentile(samples, n, 50);
+}
+
+static double gbps(const struct result *res) {
+  return res->median ? res->pixels * 3.0 / res->median : 0.0;
+}
+
+static double pixels_per_ns(const struct result *res) {
+  return res->median ? (double) res->pixels / res->median : 0.0;
+}
+
+static double roof_fraction(const struct result *res) {
+  return res->roof > 0 ? gbps(res) / res->roof : 0.0;
+}
+
+static void json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for(; *s; s++) {
+    if(*s == '"' || *s == '\\')
+      fputc('\\', f);
+    fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static void write_json(FILE *f, const struct result *results, int n, int iterations,
+                       int warmup) {
+  fprintf(f, "{\n  \"iterations\": %d,\n  \"warmup\": %d,\n  \"arena\": %s,\n  \"results\": [",
+          iterations, warmup, bench_arena ? "true" : "false");
+  for(int i = 0; i < n; i++) {
+    const struct result *res = &results[i];
+    fprintf(f, "%s\n    {\"image\": ", i ? "," : "");
+    json_string(f, res->image);
+    fprintf(f, ", \"pixels\": %lld, \"strategy\": \"%s\", \"threads\": %d, "
+            "\"median_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"min_ns\": %llu, "
+            "\"mad_ns\": %llu, \"mean_ns\": %.1f, \"gb_per_s\": %.3f, \"pixels_per_ns\": %.4f, "
+            "\"roof_gb_per_s\": %.3f, \"roof_fraction\": %.4f, \"allocs\": %llu, "
+            "\"alloc_bytes\": %llu, \"faults\": %.1f, \"peak_rss\": %llu, \"verified\": %s, "
+            "\"in_budget\": %s}", res->pixels, res->strategy, res->threads, res->median, res->p90,
+            res->p99, res->min, res->mad, res->mean, gbps(res), pixels_per_ns(res), res->roof,
+            roof_fraction(res), res->allocs, res->alloc_bytes, res->faults, res->peak_rss,
+            res->verified ? "true" : "false", res->in_budget ? "true" : "false");
+  }
+  fprintf(f, "\n  ]\n}\n");
+}
+
+static void write_csv(FILE *f, const struct result *results, int n) {
+  fprintf(f, "image,pixels,strategy,threads,median_ns,p90_ns,p99_ns,min_ns,mad_ns,mean_ns,"
+          "gb_per_s,pixels_per_ns,roof_gb_per_s,roof_fraction,allocs,alloc_bytes,faults,peak_rss,"
+          "verified,in_budget\n");
+  for(int i = 0; i < n; i++) {
+    const struct result *res = &results[i];
+    fprintf(f, "%s,%lld,%s,%d,%llu,%llu,%llu,%llu,%llu,%.1f,%.3f,%.4f,%.3f,%.4f,%llu,%llu,"
+            "%.1f,%llu,%d,%d\n", res->image, res->pixels, res->strategy, res->threads,
+            res->median, res->p90, res->p99, res->min, res->mad, res->mean, gbps(res),
+            pixels_per_ns(res), res->roof, roof_fraction(res), res->allocs, res->alloc_bytes,
+            res->faults, res->peak_rss, res->verified, res->in_budget);
+  }
+}
+
+static bool write_file(const char *path, const struct result *results, int n,
+                       int iterations, int warmup, bool json) {
+  FILE *f = fopen(path, "w");
+  if(!f) {
+    fprintf(stderr, "Unable to output %s!\n", path);
+    return true;
+  }
+  if(json)
+    write_json(f, results, n, iterations, warmup);
+  else
+    write_csv(f, results, n);
+  fclose(f);
+  return false;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [options] image.ppm|synth:KIND:WxH...\n", prog);
+  printf("       KIND is uniform, single, zipf, gradient or noise\n");
+  printf("Options:\n");
+  printf("  --iterations N   timed runs per strategy and thread count (default: 100)\n");
+  printf("  --warmup N       untimed runs before them (default: 5)\n");
+  printf("  --threads LIST   comma separated thread counts (default: 1,2,4,8), or\n");
+  printf("                   all: powers of two up to the CPU count, and that count\n");
+  printf("  --weak           scale synth: images with the thread count\n");
+  printf("  --seed N         seed for synth: images (default: 1)\n");
+  printf("  --strategies L   comma separated subset of serial, private, lockfree,\n");
+  printf("                   lock1, lock2, pool (default: all)\n");
+  printf("  --roofline       probe read bandwidth and report each strategy against it\n");
+  printf("  --arena          images, tables and locks in one pre-faulted huge-page arena\n");
+  printf("  --json FILE      also write the results as JSON\n");
+  printf("  --csv FILE       also write the results as CSV\n");
+  exit(1);
+}
+
+// Parses "1,2,4" into values; returns the count, or -1 if malformed.
+static int parse_ints(const char *list, int *values, int max) {
+  int n = 0;
+  const char *s = list;
+  while(*s) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if(end == s || v < 1 || v > 1024 || n == max)
+      return -1;
+    values[n++] = (int) v;
+    s = *end == ',' ? end + 1 : end;
+    if(*end && *end != ',')
+      return -1;
+  }
+  return n;
+}
+
+// 1, 2, 4, ... below the CPU count, then the CPU count itself.
+static int all_threads(int *values, int max) {
+  int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  int n = 0;
+  for(int t = 1; t < cpus && n < max - 1; t *= 2)
+    values[n++] = t;
+  values[n++] = cpus > 0 ? cpus : 1;
+  return n;
+}
+
+static void free_planes(struct img *input) {
+  free(input->r);
+  free(input->g);
+  free(input->b);
+}
+
+/* A file, or a generated image with its height multiplied by scale.  The
+   strategies index pixels and count bins in int, so an image must have
+   fewer than 2^31 pixels. */
+static bool load_input(const char *spec, int scale, unsigned long long seed, struct img *input) {
+  if(strncmp(spec, "synth:", 6) == 0) {
+    int kind, xsize, ysize;
+    if(synth_parse(spec + 6, &kind, &xsize, &ysize)) {
+      fprintf(stderr, "Skipping %s: expected synth:KIND:WxH.\n", spec);
+      return true;
+    }
+    long long pixels = (long long) xsize * ysize * scale;
+    if((long long) ysize * scale > INT_MAX || pixels > INT_MAX) {
+      fprintf(stderr, "Skipping %s x%d: %lld pixels do not fit in an int.\n", spec, scale,
+              pixels);
+      return true;
+    }
+    if(synth_image(input, kind, xsize, ysize * scale, seed)) {
+      fprintf(stderr, "Skipping %s: out of memory.\n", spec);
+      return true;
+    }
+    return false;
+  }
+  if(ppmb_read((char *) spec, &input->xsize, &input->ysize, &input->maxrgb,
+               &input->r, &input->g, &input->b)) {
+    fprintf(stderr, "Skipping %s: cannot read it.\n", spec);
+    return true;
+  }
+  if(input->maxrgb > 255) {
+    fprintf(stderr, "Skipping %s: maxrgb %d not supported.\n", spec, input->maxrgb);
+    free_planes(input);
+    return true;
+  }
+  if((long long) input->xsize * input->ysize > INT_MAX) {
+    fprintf(stderr, "Skipping %s: %lld pixels do not fit in an int.\n", spec,
+            (long long) input->xsize * input->ysize);
+    free_planes(input);
+    return true;
+  }
+  return false;
+}
+
+static unsigned long long minor_faults() {
+  struct rusage ru;
+  return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_minflt : 0;
+}
+
+/* Moves the planes of input into a (reserved for them, the locks and the
+   tables of up to max_threads) and places the lock arrays after them. */
+static bool move_to_arena(struct img *input, struct arena *a, int max_threads) {
+  size_t pixels = (size_t) input->xsize * input->ysize;
+  size_t locks = arena_size(3 * 256 * sizeof(Spinlock)) +
+                 arena_size(3 * 256 * sizeof(SequencialLock));
+  size_t tables = 3 * (size_t) max_threads * arena_size(HISTO_BINS * sizeof(int));
+  if(arena_reserve(a, 3 * arena_size(pixels) + locks + tables, max_threads)) {
+    fprintf(stderr, "Unable to map an arena of %zu bytes\n", 3 * arena_size(pixels) + locks + tables);
+    return true;
+  }
+  unsigned char **planes[3] = { &input->r, &input->g, &input->b };
+  for(int c = 0; c < 3; c++) {
+    unsigned char *p = (unsigned char *) arena_alloc(a, pixels);
+    memcpy(p, *planes[c], pixels);
+    free(*planes[c]);
+    *planes[c] = p;
+  }
+  BinLocks<Spinlock>::place(arena_alloc(a, 3 * 256 * sizeof(Spinlock)));
+  BinLocks<SequencialLock>::place(arena_alloc(a, 3 * 256 * sizeof(SequencialLock)));
+  tables_mark = a->used;
+  return false;
+}
+
+static bool strategy_selected(const char *list, const char *name) {
+  if(!list)
+    return true;
+  size_t len = strlen(name);
+  for(const char *s = list; *s; ) {
+    size_t n = strcspn(s, ",");
+    if(n == len && strncmp(s, name, n) == 0)
+      return true;
+    s += n;
+    if(*s == ',')
+      s++;
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = 100, warmup = 5;
+  int threads[64], nthreads = 4;
+  threads[0] = 1;
+  threads[1] = 2;
+  threads[2] = 4;
+  threads[3] = 8;
+  const char *selected = NULL, *json = NULL, *csv = NULL;
+  bool weak = false, roofline = false, use_arena = false;
+  unsigned long long seed = 1;
+  const char *images[256];
+  int nimages = 0;
+
+  // every row reports its allocations
+  ggc::alloc_enable();
+
+  for(int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if(strcmp(arg, "--iterations") == 0 && has_value) {
+      iterations = atoi(argv[++i]);
+    } else if(strcmp(arg, "--warmup") == 0 && has_value) {
+      warmup = atoi(argv[++i]);
+    } else if(strcmp(arg, "--threads") == 0 && has_value) {
+      const char *list = argv[++i];
+      nthreads = strcmp(list, "all") == 0 ? all_threads(threads, 64) : parse_ints(list, threads, 64);
+    } else if(strcmp(arg, "--weak") == 0) {
+      weak = true;
+    } else if(strcmp(arg, "--arena") == 0) {
+      use_arena = true;
+    } else if(strcmp(arg, "--roofline") == 0) {
+      roofline = true;
+    } else if(strcmp(arg, "--seed") == 0 && has_value) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else if(strcmp(arg, "--strategies") == 0 && has_value) {
+      selected = argv[++i];
+    } else if(strcmp(arg, "--json") == 0 && has_value) {
+      json = argv[++i];
+    } else if(strcmp(arg, "--csv") == 0 && has_value) {
+      csv = argv[++i];
+    } else if(arg[0] == '-' && arg[1] == '-') {
+      usage(argv[0]);
+    } else if(nimages < 256) {
+      images[nimages++] = arg;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if(nimages == 0 || iterations < 1 || warmup < 0 || nthreads < 1)
+    usage(argv[0]);
+
+  int cap = nimages * NSTRATEGIES * nthreads;
+  struct result *results = (struct result *) calloc(cap, sizeof(struct result));
+  unsigned long long *samples =
+    (unsigned long long *) malloc(sizeof(unsigned long long) * iterations);
+  int nresults = 0;
+  bool mismatch = false, over_budget = false;
+  struct roof *roofs = roofline ? (struct roof *) malloc(sizeof(struct roof) * PROBE_ROOFS) : NULL;
+  int nroofs = 0;
+  size_t llc = llc_bytes();
+  struct arena arena;
+  int max_threads = 1;
+  memset(&arena, 0, sizeof(arena));
+  for(int t = 0; t < nthreads; t++) {
+    if(threads[t] > max_threads)
+      max_threads = threads[t];
+  }
+  if(use_arena)
+    bench_arena = &arena;
+
+  if(roofline)
+    printf("Last level cache: %.1f MB%s\n", llc / 1048576.0, llc ? "" : " (unknown)");
+  printf("%-36s %-9s %3s %12s %12s %12s %12s %10s %7s %7s%s\n", "image", "strategy", "thr",
+         "median ns", "p90 ns", "p99 ns", "min ns", "MAD ns", "GB/s", "px/ns",
+         roofline ? "    roof   %roof allocs  KB/run faults  RSS MB" : " allocs  KB/run faults  RSS MB");
+  for(int k = 0; k < nimages; k++) {
+    struct img input;
+    int loaded = 0;             // the scale input holds, 0 for none
+    bool scaled = weak && strncmp(images[k], "synth:", 6) == 0;
+    int want_r[HISTO_BINS], want_g[HISTO_BINS], want_b[HISTO_BINS];
+    const char *base = images[k];
+    if(strncmp(base, "synth:", 6) == 0)
+      base += 6;
+    else if(strrchr(base, '/'))
+      base = strrchr(base, '/') + 1;
+
+    for(int t = 0; t < nthreads; t++) {
+      int scale = scaled ? threads[t] : 1;
+      if(loaded != scale) {
+        if(loaded && !bench_arena)
+          free_planes(&input);
+        loaded = 0;
+        if(load_input(images[k], scale, seed, &input)) {
+          // a smaller scale may still fit
+          if(scaled)
+            continue;
+          break;
+        }
+        if(bench_arena && move_to_arena(&input, bench_arena, max_threads)) {
+          free_planes(&input);
+          break;
+        }
+        loaded = scale;
+        if(roofline && llc)
+          printf("%s: %.1f MB of planes, %s the last level cache\n", base,
+                 input.xsize * (double) input.ysize * 3 / 1048576.0,
+                 (size_t) input.xsize * input.ysize * 3 <= llc ? "within" : "beyond");
+        memset(want_r, 0, sizeof(want_r));
+        memset(want_g, 0, sizeof(want_g));
+        memset(want_b, 0, sizeof(want_b));
+        run_serial(&input, 1, want_r, want_g, want_b);
+      }
+
+      for(int s = 0; s < NSTRATEGIES; s++) {
+        const struct strategy *st = &strategies[s];
+        if(!strategy_selected(selected, st->name) || (!st->threaded && threads[t] != 1))
+          continue;
+        if(st->run == run_pool && histo_init(threads[t])) {
+          fprintf(stderr, "Unable to start worker pool\n");
+          continue;
+        }
+
+        struct result *res = &results[nresults++];
+        res->image = base;
+        res->pixels = (long long) input.xsize * input.ysize;
+        res->strategy = st->name;
+        res->threads = threads[t];
+        res->verified = true;
+        res->in_budget = true;
+        res->roof = roofline ? roof_for(roofs, &nroofs, (size_t) res->pixels * 3, threads[t]) : 0;
+        ggc::Timer timer(st->name);
+        ggc::MemoryUsage usage;
+        unsigned long long budget = st->allocs + (unsigned long long) st->per_thread * threads[t] +
+                                    (st->spawns ? spawn_allocs(threads[t]) : 0);
+        unsigned long long faults = 0;
+        ggc::memory_reset_peak();
+        for(int i = -warmup; i < iterations; i++) {
+          int hist_r[HISTO_BINS] = {0}, hist_g[HISTO_BINS] = {0}, hist_b[HISTO_BINS] = {0};
+          ggc::AllocCounts before, after;
+          unsigned long long faulted = minor_faults();
+          ggc::alloc_process(&before);
+          timer.start();
+          st->run(&input, threads[t], hist_r, hist_g, hist_b);
+          timer.stop();
+          ggc::alloc_process(&after);
+          if(i >= 0) {
+            faults += minor_faults() - faulted;
+            // the first run of a thread count may set up glibc's thread caches
+            if(i == 0 || after.allocs - before.allocs < res->allocs) {
+              res->allocs = after.allocs - before.allocs;
+              res->alloc_bytes = after.bytes - before.bytes;
+            }
+          }
+          if(memcmp(hist_r, want_r, sizeof(want_r)) || memcmp(hist_g, want_g, sizeof(want_g)) ||
+             memcmp(hist_b, want_b, sizeof(want_b)))
+            res->verified = false;
+          if(i >= 0)
+            samples[i] = timer.duration();
+        }
+        if(st->run == run_pool)
+          histo_shutdown();
+
+        ggc::memory_usage(&usage);
+        res->peak_rss = usage.peak_rss;
+        res->faults = (double) faults / iterations;
+        res->in_budget = res->allocs <= budget;
+        summarize(res, samples, iterations);
+        mismatch |= !res->verified;
+        over_budget |= !res->in_budget;
+        printf("%-36s %-9s %3d %12llu %12llu %12llu %12llu %10llu %7.2f %7.3f", base,
+               res->strategy, res->threads, res->median, res->p90, res->p99, res->min,
+               res->mad, gbps(res), pixels_per_ns(res));
+        if(roofline)
+          printf(" %7.2f %6.1f%%", res->roof, 100 * roof_fraction(res));
+        printf(" %6llu %7.1f %6.0f %7.1f%s%s\n", res->allocs, res->alloc_bytes / 1024.0,
+               res->faults, res->peak_rss / 1048576.0, res->verified ? "" : "  MISMATCH",
+               res->in_budget ? "" : "  ALLOCATES");
+        fflush(stdout);
+      }
+    }
+    // results keep pointing at the name, not the pixels
+    if(loaded && !bench_arena)
+      free_planes(&input);
+  }
+  if(bench_arena) {
+    printf("Arena: up to %.1f MB, %s, mapped %d times, pre-faulted in %.3f ms\n",
+           arena.size / 1048576.0, arena_backing(&arena), arena.maps, arena.fault_ns / 1e6);
+    BinLocks<Spinlock>::place(NULL);
+    BinLocks<SequencialLock>::place(NULL);
+    arena_release(&arena);
+  }
+
+  bool failed = false;
+  if(json)
+    failed |= write_file(json, results, nresults, iterations, warmup, true);
+  if(csv)
+    failed |= write_file(csv, results, nresults, iterations, warmup, false);
+
+  free(roofs);
+  free(samples);
+  free(results);
+  if(over_budget)
+    fprintf(stderr, "Allocation inside a timed region over its strategy's budget\n");
+  return failed || mismatch || over_budget ? 1 : 0;
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+/* Histogram text output without stdio formatting.  A ggc::Emitter formats
+   the channels of one or more images into a fixed buffer, converting
+   counts two digits per table lookup, and hands the buffer to the file in
+   one write once it is done (or full, for a combined file of many
+   images).  Three layouts:
+
+     EMIT_HIST  the .hist text byte for byte: per channel "N+1", then
+                "i count" for i = 0..N; "# image" before each image of a
+                combined file
+     EMIT_CSV   a "channel,value,count" header and one row per bin, with a
+                leading image column in combined files
+     EMIT_JSON  {"maxrgb":M,"r":[counts],"g":[...],"b":[...]}, one object
+                per image, in an array for combined files
+
+   emit_format() picks the layout from a file name's extension, and
+   write_histogram_file() writes the r, g, b histograms of the standalone
+   programs with it. */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Widest CSV row of three channels of 256 bins, with room for a path.
+#define EMIT_BYTES 32768
+
+namespace ggc {
+
+enum { EMIT_HIST, EMIT_CSV, EMIT_JSON };
+
+static const char emit_digits[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+// From the extension of path: .csv, .json, anything else the .hist layout.
+static inline int emit_format(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if(dot && strchr(dot, '/') == NULL) {
+    if(strcmp(dot, ".csv") == 0)
+      return EMIT_CSV;
+    if(strcmp(dot, ".json") == 0)
+      return EMIT_JSON;
+  }
+  return EMIT_HIST;
+}
+
+static inline const char *emit_extension(int format) {
+  return format == EMIT_CSV ? ".csv" : format == EMIT_JSON ? ".json" : ".hist";
+}
+
+class Emitter {
+  char buf[EMIT_BYTES];
+  size_t len;
+  int fd;
+  FILE *file;
+  int format;
+  bool combined;
+  bool failed;
+  int images;
+  const char *image;
+  size_t image_len;
+
+  void put(char c) { buf[len++] = c; }
+
+  void put(const char *s, size_t n) {
+    memcpy(buf + len, s, n);
+    len += n;
+  }
+
+  void put(const char *s) { put(s, strlen(s)); }
+
+  void number(unsigned long long v) {
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    while(v >= 100) {
+      unsigned pair = (unsigned) (v % 100) * 2;
+      v /= 100;
+      p -= 2;
+      memcpy(p, emit_digits + pair, 2);
+    }
+    if(v >= 10) {
+      p -= 2;
+      memcpy(p, emit_digits + v * 2, 2);
+    } else {
+      *--p = (char) ('0' + v);
+    }
+    put(p, tmp + sizeof(tmp) - p);
+  }
+
+  // s as a JSON string or, if it needs it, a quoted CSV field.
+  void quoted(const char *s) {
+    if(format == EMIT_CSV && strpbrk(s, ",\"\r\n") == NULL) {
+      put(s);
+      return;
+    }
+    put('"');
+    for(; *s; s++) {
+      unsigned char c = (unsigned char) *s;
+      if(format == EMIT_CSV) {
+        if(c == '"')
+          put('"');
+        put((char) c);
+      } else if(c == '"' || c == '\\') {
+        put('\\');
+        put((char) c);
+      } else if(c < 0x20) {
+        put("\\u00", 4);
+        put("0123456789abcdef"[c >> 4]);
+        put("0123456789abcdef"[c & 15]);
+      } else {
+        put((char) c);
+      }
+    }
+    put('"');
+  }
+
+  // Makes room for n more bytes, writing out what is there if needed.
+  void room(size_t n) {
+    if(len + n > sizeof(buf))
+      flush();
+  }
+
+ public:
+  // Writes out what is buffered, before other output to the same FILE.
+  void flush() {
+    size_t done = 0;
+    while(done < len && !failed) {
+      if(file) {
+        failed = fwrite(buf + done, 1, len - done, file) != len - done;
+        done = len;
+      } else {
+        ssize_t n = ::write(fd, buf + done, len - done);
+        if(n < 0 && errno == EINTR)
+          continue;
+        if(n <= 0)
+          failed = true;
+        else
+          done += n;
+      }
+    }
+    len = 0;
+  }
+
+  /* Output goes to fd, or to f after whatever f has buffered.  A combined
+     emitter takes several images, each under its name. */
+  Emitter(int fd, int format, bool combined = false)
+    : len(0), fd(fd), file(NULL), format(format), combined(combined), failed(false),
+      images(0), image(NULL), image_len(0) {}
+
+  Emitter(FILE *f, int format, bool combined = false)
+    : len(0), fd(-1), file(f), format(format), combined(combined), failed(false),
+      images(0), image(NULL), image_len(0) {}
+
+  /* One image: begin(), a channel() per histogram, end().  name is the
+     image's name in a combined file, ignored otherwise. */
+  void begin(const char *name, int maxrgb) {
+    image = combined ? name : NULL;
+    image_len = image ? strlen(image) : 0;
+    // escaping at most sextuples a name
+    room(6 * image_len + 64);
+    if(format == EMIT_HIST) {
+      if(image) {
+        put("# ", 2);
+        put(image, image_len);
+        put('\n');
+      }
+    } else if(format == EMIT_CSV) {
+      if(images == 0)
+        put(combined ? "image,channel,value,count\n" : "channel,value,count\n");
+    } else {
+      if(combined)
+        put(images == 0 ? "[\n" : ",\n");
+      put('{');
+      if(image) {
+        put("\"image\":", 8);
+        quoted(image);
+        put(',');
+      }
+      put("\"maxrgb\":", 9);
+      number(maxrgb);
+    }
+    images++;
+  }
+
+  // Bins 0..N of hist, the channel called name.
+  template <class T>
+  void channel(const char *name, const T *hist, int N) {
+    size_t name_len = strlen(name);
+    if(format == EMIT_HIST) {
+      room(24);
+      number(N + 1);
+      put('\n');
+      for(int i = 0; i <= N; i++) {
+        room(32);
+        number(i);
+        put(' ');
+        number(hist[i]);
+        put('\n');
+      }
+    } else if(format == EMIT_CSV) {
+      for(int i = 0; i <= N; i++) {
+        room(2 * image_len + name_len + 48);
+        if(image) {
+          quoted(image);
+          put(',');
+        }
+        put(name, name_len);
+        put(',');
+        number(i);
+        put(',');
+        number(hist[i]);
+        put('\n');
+      }
+    } else {
+      room(name_len + 8);
+      put(",\"", 2);
+      put(name, name_len);
+      put("\":[", 3);
+      for(int i = 0; i <= N; i++) {
+        room(24);
+        if(i > 0)
+          put(',');
+        number(hist[i]);
+      }
+      put(']');
+    }
+  }
+
+  void end() {
+    if(format == EMIT_JSON) {
+      room(2);
+      put('}');
+      if(!combined)
+        put('\n');
+    }
+  }
+
+  // Writes what is left; true if any write failed.
+  bool finish() {
+    if(format == EMIT_JSON && combined) {
+      room(4);
+      put(images == 0 ? "[]\n" : "\n]\n");
+    }
+    flush();
+    return failed;
+  }
+};
+
+/* The r, g, b histograms (bins 0..N) in the layout of output_file's
+   extension, in one write.  Returns true on failure. */
+template <class T>
+bool write_histogram_file(const char *output_file, const T *hist_r, const T *hist_g,
+                          const T *hist_b, int N) {
+  int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return true;
+  Emitter out(fd, emit_format(output_file));
+  out.begin(NULL, N);
+  out.channel("r", hist_r, N);
+  out.channel("g", hist_g, N);
+  out.channel("b", hist_b, N);
+  out.end();
+  bool failed = out.finish();
+  return close(fd) != 0 || failed;
+}
+
+}
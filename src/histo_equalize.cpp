@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_pool.h"
+
+// the SIMD kernels are picked at run time, so they only need x86
+#if defined(__x86_64__) || defined(__i386__)
+#define EQUALIZE_X86
+#include <immintrin.h>
+#endif
+
+/* --equalize: histogram equalization in two passes over the image.  Pass one
+   is the parallel histogram through libhisto, per channel or of BT.601
+   luma; the CDFs turn into 256-entry LUTs; pass two maps each row
+   band through the LUTs on the pool and interleaves the result straight into
+   the output buffer, which is then written with one fwrite.
+
+   --clahe swaps the global curve for one per tile (contrast limited
+   adaptive histogram equalization): each pool task histograms one tile,
+   clips it and builds its LUTs, and the apply pass blends the LUTs of the
+   four nearest tile centers bilinearly. */
+
+typedef void (*lut_row_fn)(const unsigned char *lut, const unsigned char *in,
+                           unsigned char *out, int n);
+typedef void (*interleave_fn)(const unsigned char *r, const unsigned char *g,
+                              const unsigned char *b, unsigned char *out, int n);
+
+static void lut_row_scalar(const unsigned char *lut, const unsigned char *in,
+                           unsigned char *out, int n) {
+  for(int x = 0; x < n; x++)
+    out[x] = lut[in[x]];
+}
+
+#ifdef EQUALIZE_X86
+/* The LUT as sixteen 16-byte shuffle tables.  Table k serves inputs
+   16k..16k+15: after subtracting 16k those lanes are 0..15, and the
+   saturating add of 0x70 pushes every other lane to 0x80 or above, which
+   the shuffle turns into zero.  OR-ing the sixteen shuffles gives the
+   lookup for 16 (SSSE3) or 32 (AVX2) pixels at a time. */
+__attribute__((target("ssse3")))
+static void lut_row_ssse3(const unsigned char *lut, const unsigned char *in,
+                          unsigned char *out, int n) {
+  __m128i table[16];
+  for(int k = 0; k < 16; k++)
+    table[k] = _mm_loadu_si128((const __m128i *) (lut + 16 * k));
+  const __m128i bias = _mm_set1_epi8(0x70);
+  const __m128i sixteen = _mm_set1_epi8(16);
+
+  int x = 0;
+  for(; x + 16 <= n; x += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (in + x));
+    __m128i r = _mm_setzero_si128();
+    for(int k = 0; k < 16; k++) {
+      r = _mm_or_si128(r, _mm_shuffle_epi8(table[k], _mm_adds_epu8(v, bias)));
+      v = _mm_sub_epi8(v, sixteen);
+    }
+    _mm_storeu_si128((__m128i *) (out + x), r);
+  }
+  lut_row_scalar(lut, in + x, out + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static void lut_row_avx2(const unsigned char *lut, const unsigned char *in,
+                         unsigned char *out, int n) {
+  __m256i table[16];
+  for(int k = 0; k < 16; k++)
+    table[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (lut + 16 * k)));
+  const __m256i bias = _mm256_set1_epi8(0x70);
+  const __m256i sixteen = _mm256_set1_epi8(16);
+
+  int x = 0;
+  for(; x + 32 <= n; x += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (in + x));
+    __m256i r = _mm256_setzero_si256();
+    for(int k = 0; k < 16; k++) {
+      r = _mm256_or_si256(r, _mm256_shuffle_epi8(table[k], _mm256_adds_epu8(v, bias)));
+      v = _mm256_sub_epi8(v, sixteen);
+    }
+    _mm256_storeu_si256((__m256i *) (out + x), r);
+  }
+  lut_row_ssse3(lut, in + x, out + x, n - x);
+}
+
+#endif
+
+static void interleave_scalar(const unsigned char *r, const unsigned char *g,
+                              const unsigned char *b, unsigned char *out, int n) {
+  for(int x = 0; x < n; x++) {
+    out[3 * x] = r[x];
+    out[3 * x + 1] = g[x];
+    out[3 * x + 2] = b[x];
+  }
+}
+
+#ifdef EQUALIZE_X86
+// 16 pixels of each plane into 48 bytes of RGB: each output vector gathers
+// its bytes from the three planes with one shuffle per plane (-1 lanes
+// shuffle to zero).
+__attribute__((target("ssse3")))
+static void interleave_ssse3(const unsigned char *r, const unsigned char *g,
+                             const unsigned char *b, unsigned char *out, int n) {
+  const __m128i r0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i b2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+  int x = 0;
+  for(; x + 16 <= n; x += 16) {
+    __m128i vr = _mm_loadu_si128((const __m128i *) (r + x));
+    __m128i vg = _mm_loadu_si128((const __m128i *) (g + x));
+    __m128i vb = _mm_loadu_si128((const __m128i *) (b + x));
+    __m128i *o = (__m128i *) (out + 3 * x);
+    _mm_storeu_si128(o, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, r0),
+                                                  _mm_shuffle_epi8(vg, g0)),
+                                     _mm_shuffle_epi8(vb, b0)));
+    _mm_storeu_si128(o + 1, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, r1),
+                                                      _mm_shuffle_epi8(vg, g1)),
+                                         _mm_shuffle_epi8(vb, b1)));
+    _mm_storeu_si128(o + 2, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, r2),
+                                                      _mm_shuffle_epi8(vg, g2)),
+                                         _mm_shuffle_epi8(vb, b2)));
+  }
+  interleave_scalar(r + x, g + x, b + x, out + 3 * x, n - x);
+}
+#endif
+
+static const char *pick_kernels(lut_row_fn *lut_row, interleave_fn *interleave) {
+#ifdef EQUALIZE_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    *lut_row = lut_row_avx2;
+    *interleave = interleave_ssse3;
+    return "avx2";
+  }
+  if(__builtin_cpu_supports("ssse3")) {
+    *lut_row = lut_row_ssse3;
+    *interleave = interleave_ssse3;
+    return "ssse3";
+  }
+#endif
+  *lut_row = lut_row_scalar;
+  *interleave = interleave_scalar;
+  return "scalar";
+}
+
+struct equalize {
+  const struct img *input;
+  int bands;
+  lut_row_fn lut_row;
+  interleave_fn interleave;
+  const unsigned char *lut[3];
+  unsigned char *rows;        // three row buffers per worker
+  unsigned char *out;         // interleaved output pixels
+
+  // --clahe
+  bool use_luma;
+  int tile;
+  int tiles_x;
+  int tiles_y;
+  double clip;
+  unsigned char *tile_luts;   // [tiles_y][tiles_x][3][256]
+  int *col_tile;              // left tile and weight of the right one, per column
+  int *col_weight;
+};
+
+// Interpolation weights are fixed point out of 1 << WEIGHT_BITS.
+#define WEIGHT_BITS 7
+
+static void band_rows(const struct equalize *e, int task, int *y0, int *y1) {
+  int rows = e->input->ysize;
+  *y0 = (int) ((long long) rows * task / e->bands);
+  *y1 = (int) ((long long) rows * (task + 1) / e->bands);
+}
+
+// Pass two: the three LUT lookups land in row buffers that stay in L1, so
+// the interleave does not cost another pass over memory.
+static void apply_task(void *arg, int task, int worker) {
+  struct equalize *e = (struct equalize *) arg;
+  const struct img *in = e->input;
+  int w = in->xsize;
+  unsigned char *r = e->rows + (size_t) worker * w * 3;
+  unsigned char *g = r + w;
+  unsigned char *b = g + w;
+  int y0, y1;
+  band_rows(e, task, &y0, &y1);
+
+  for(int y = y0; y < y1; y++) {
+    size_t row = (size_t) y * w;
+    e->lut_row(e->lut[0], in->r + row, r, w);
+    e->lut_row(e->lut[1], in->g + row, g, w);
+    e->lut_row(e->lut[2], in->b + row, b, w);
+    e->interleave(r, g, b, e->out + row * 3, w);
+  }
+}
+
+// Map each value to its share of the pixels at or below it, stretched over
+// 0..maxrgb so the darkest occupied value becomes 0.
+static void build_lut(const uint64_t *hist, int maxrgb, unsigned char *lut) {
+  uint64_t total = 0, first = 0;
+  for(int i = 0; i < HISTO_BINS; i++) {
+    if(hist[i] && !total)
+      first = hist[i];
+    total += hist[i];
+  }
+
+  uint64_t cdf = 0, range = total - first;
+  for(int i = 0; i < HISTO_BINS; i++) {
+    cdf += hist[i];
+    if(range == 0)
+      lut[i] = (unsigned char) i;           // a single value: leave it be
+    else if(cdf <= first)
+      lut[i] = 0;
+    else
+      lut[i] = (unsigned char) (((cdf - first) * maxrgb + range / 2) / range);
+  }
+}
+
+// Clip every bin at limit and spread what was cut off evenly over all bins,
+// the remainder one count at a time across the range.
+static void clip_histogram(uint32_t *hist, uint32_t limit) {
+  uint32_t excess = 0;
+  for(int i = 0; i < HISTO_BINS; i++) {
+    if(hist[i] > limit) {
+      excess += hist[i] - limit;
+      hist[i] = limit;
+    }
+  }
+  uint32_t each = excess / HISTO_BINS, rest = excess % HISTO_BINS;
+  for(int i = 0; i < HISTO_BINS; i++)
+    hist[i] += each;
+  if(rest) {
+    int step = HISTO_BINS / rest;
+    for(int i = 0; i < HISTO_BINS && rest; i += step, rest--)
+      hist[i] += 1;
+  }
+}
+
+// One task per tile: histogram it (only the tile's own rows and columns, so
+// the working set is the tile), clip, and turn the CDFs into LUTs.
+static void tile_task(void *arg, int task, int worker) {
+  struct equalize *e = (struct equalize *) arg;
+  const struct img *in = e->input;
+  int tx = task % e->tiles_x, ty = task / e->tiles_x;
+  int x0 = tx * e->tile, y0 = ty * e->tile;
+  int x1 = x0 + e->tile < in->xsize ? x0 + e->tile : in->xsize;
+  int y1 = y0 + e->tile < in->ysize ? y0 + e->tile : in->ysize;
+  uint32_t hist[3][HISTO_BINS];
+  memset(hist, 0, sizeof(hist));
+  (void) worker;
+
+  for(int y = y0; y < y1; y++) {
+    size_t row = (size_t) y * in->xsize;
+    const unsigned char *r = in->r + row, *g = in->g + row, *b = in->b + row;
+    if(e->use_luma) {
+      for(int x = x0; x < x1; x++)
+        hist[0][(77 * r[x] + 150 * g[x] + 29 * b[x] + 128) >> 8] += 1;
+    } else {
+      for(int x = x0; x < x1; x++) {
+        hist[0][r[x]] += 1;
+        hist[1][g[x]] += 1;
+        hist[2][b[x]] += 1;
+      }
+    }
+  }
+
+  uint32_t pixels = (uint32_t) (x1 - x0) * (y1 - y0);
+  uint32_t limit = (uint32_t) (e->clip * pixels / HISTO_BINS);
+  if(limit < 1)
+    limit = 1;
+  unsigned char *luts = e->tile_luts + (size_t) task * 3 * HISTO_BINS;
+  int channels = e->use_luma ? 1 : 3;
+  for(int c = 0; c < channels; c++) {
+    if(e->clip > 0)
+      clip_histogram(hist[c], limit);
+    uint64_t cdf = 0;
+    for(int i = 0; i < HISTO_BINS; i++) {
+      cdf += hist[c][i];
+      luts[c * HISTO_BINS + i] =
+        (unsigned char) ((cdf * e->input->maxrgb + pixels / 2) / pixels);
+    }
+  }
+  if(e->use_luma) {
+    memcpy(luts + HISTO_BINS, luts, HISTO_BINS);
+    memcpy(luts + 2 * HISTO_BINS, luts, HISTO_BINS);
+  }
+}
+
+// Tile centers sit at (i + 0.5) * tile; a coordinate between two centers
+// blends their LUTs, and past the outer centers it uses the last one.
+static void tile_position(int pos, int tile, int tiles, int *first, int *weight) {
+  int scaled = ((2 * pos + 1 - tile) << WEIGHT_BITS) / (2 * tile);
+  if(2 * pos + 1 < tile)
+    scaled = 0;
+  int t = scaled >> WEIGHT_BITS;
+  if(t >= tiles - 1) {
+    *first = tiles - 1;
+    *weight = 0;
+  } else {
+    *first = t;
+    *weight = scaled & ((1 << WEIGHT_BITS) - 1);
+  }
+}
+
+static void clahe_task(void *arg, int task, int worker) {
+  struct equalize *e = (struct equalize *) arg;
+  const struct img *in = e->input;
+  int w = in->xsize;
+  unsigned char *rows = e->rows + (size_t) worker * w * 3;
+  int y0, y1;
+  band_rows(e, task, &y0, &y1);
+  const int one = 1 << WEIGHT_BITS;
+  size_t lut_row = (size_t) e->tiles_x * 3 * HISTO_BINS;
+
+  for(int y = y0; y < y1; y++) {
+    int ty, wy;
+    tile_position(y, e->tile, e->tiles_y, &ty, &wy);
+    const unsigned char *top = e->tile_luts + ty * lut_row;
+    const unsigned char *bottom = wy ? top + lut_row : top;
+    size_t row = (size_t) y * w;
+    const unsigned char *planes[3] = { in->r + row, in->g + row, in->b + row };
+
+    for(int c = 0; c < 3; c++) {
+      const unsigned char *src = planes[c];
+      unsigned char *dst = rows + c * w;
+      for(int x = 0; x < w; x++) {
+        size_t left = ((size_t) e->col_tile[x] * 3 + c) * HISTO_BINS + src[x];
+        int wx = e->col_weight[x];
+        size_t right = wx ? left + 3 * HISTO_BINS : left;
+        int upper = top[left] * (one - wx) + top[right] * wx;
+        int lower = bottom[left] * (one - wx) + bottom[right] * wx;
+        dst[x] = (unsigned char) ((upper * (one - wy) + lower * wy +
+                                   (1 << (2 * WEIGHT_BITS - 1))) >> (2 * WEIGHT_BITS));
+      }
+    }
+    e->interleave(rows, rows + w, rows + 2 * w, e->out + row * 3, w);
+  }
+}
+
+static bool run_clahe(struct equalize *e, struct pool *p, ggc::Timer &tiles,
+                      ggc::Timer &apply) {
+  const struct img *in = e->input;
+  e->tiles_x = (in->xsize + e->tile - 1) / e->tile;
+  e->tiles_y = (in->ysize + e->tile - 1) / e->tile;
+  int ntiles = e->tiles_x * e->tiles_y;
+  e->tile_luts = (unsigned char *) malloc((size_t) ntiles * 3 * HISTO_BINS);
+  e->col_tile = (int *) malloc(sizeof(int) * in->xsize);
+  e->col_weight = (int *) malloc(sizeof(int) * in->xsize);
+  if(!e->tile_luts || !e->col_tile || !e->col_weight)
+    return true;
+  for(int x = 0; x < in->xsize; x++)
+    tile_position(x, e->tile, e->tiles_x, &e->col_tile[x], &e->col_weight[x]);
+
+  tiles.start();
+  pool_run(p, tile_task, e, ntiles);
+  tiles.stop();
+
+  apply.start();
+  pool_run(p, clahe_task, e, e->bands);
+  apply.stop();
+  return false;
+}
+
+int run_equalize(const char *input_file, const char *output_file,
+                 const struct options *opt) {
+  struct img input;
+  size_t capacity = 0;
+  memset(&input, 0, sizeof(input));
+
+  ggc::Timer t("equalize"), load("load"), hist("histogram"), cdf("cdf"),
+    apply("apply"), write("write");
+
+  t.start();
+  load.start();
+  if(load_ppm(input_file, &input, &capacity))
+    return 1;
+  load.stop();
+
+  struct pool *p = histo_shared_pool();
+  int workers = pool_size(p);
+  size_t pixels = (size_t) input.xsize * input.ysize;
+
+  struct equalize e;
+  memset(&e, 0, sizeof(e));
+  e.input = &input;
+  e.bands = workers * 4 < input.ysize ? workers * 4 : input.ysize;
+  const char *kernel = pick_kernels(&e.lut_row, &e.interleave);
+  e.rows = (unsigned char *) malloc((size_t) workers * input.xsize * 3);
+  e.out = (unsigned char *) malloc(pixels * 3);
+  if(!e.rows || !e.out) {
+    fprintf(stderr, "Unable to allocate memory for %s.\n", output_file);
+    free(e.rows);
+    free(e.out);
+    free_img(&input);
+    return 1;
+  }
+
+  if(opt->clahe) {
+    e.use_luma = opt->luma;
+    e.tile = opt->tile;
+    e.clip = opt->clip;
+    bool failed = run_clahe(&e, p, hist, apply);
+    write.start();
+    if(failed)
+      fprintf(stderr, "Unable to allocate memory for %s.\n", output_file);
+    else
+      failed = write_ppm(output_file, input.xsize, input.ysize, input.maxrgb, e.out);
+    write.stop();
+    t.stop();
+
+    if(!failed) {
+      printf("CLAHE: %s (%dx%d, %s, %dx%d tiles of %d, clip %g)\n", output_file,
+             input.xsize, input.ysize, opt->luma ? "luma" : "per channel",
+             e.tiles_x, e.tiles_y, e.tile, e.clip);
+      printf("Threads: %d\n", workers);
+      printf("Time: %llu ns\n", t.duration());
+      printf("  load      %10.3f ms\n", load.duration() / 1e6);
+      printf("  tiles     %10.3f ms\n", hist.duration() / 1e6);
+      printf("  apply     %10.3f ms (%.2f GB/s)\n", apply.duration() / 1e6,
+             apply.duration() ? pixels * 6.0 / apply.duration() : 0.0);
+      printf("  write     %10.3f ms\n", write.duration() / 1e6);
+    }
+    free(e.tile_luts);
+    free(e.col_tile);
+    free(e.col_weight);
+    free(e.rows);
+    free(e.out);
+    free_img(&input);
+    return failed ? 1 : 0;
+  }
+
+  uint64_t hist_r[HISTO_BINS], hist_g[HISTO_BINS], hist_b[HISTO_BINS];
+  histo_image image;
+  histo_image_planar(&image, input.xsize, input.ysize,
+                     input.r, input.g, input.b, input.xsize);
+  hist.start();
+  int err;
+  if(opt->luma) {
+    int luma = HISTO_CHANNEL_LUMA601;
+    uint64_t *hists[1] = { hist_r };
+    err = histo_compute_channels(&image, NULL, &luma, 1, hists, 0);
+  } else {
+    err = histo_compute(&image, NULL, hist_r, hist_g, hist_b, 0);
+  }
+  hist.stop();
+  if(err < 0) {
+    fprintf(stderr, "Unable to count %s: %s\n", input_file, histo_strerror(err));
+    free(e.rows);
+    free(e.out);
+    free_img(&input);
+    return 1;
+  }
+
+  // 256 bins per channel: cheaper in line than waking the pool
+  unsigned char lut[3][HISTO_BINS];
+  cdf.start();
+  if(opt->luma) {
+    // one curve for all three planes keeps the hues
+    build_lut(hist_r, input.maxrgb, lut[0]);
+    memcpy(lut[1], lut[0], HISTO_BINS);
+    memcpy(lut[2], lut[0], HISTO_BINS);
+  } else {
+    build_lut(hist_r, input.maxrgb, lut[0]);
+    build_lut(hist_g, input.maxrgb, lut[1]);
+    build_lut(hist_b, input.maxrgb, lut[2]);
+  }
+  cdf.stop();
+
+  e.lut[0] = lut[0];
+  e.lut[1] = lut[1];
+  e.lut[2] = lut[2];
+  apply.start();
+  pool_run(p, apply_task, &e, e.bands);
+  apply.stop();
+
+  write.start();
+  bool failed = write_ppm(output_file, input.xsize, input.ysize, input.maxrgb, e.out);
+  write.stop();
+  t.stop();
+
+  if(!failed) {
+    printf("Equalized: %s (%dx%d, %s, %s LUT)\n", output_file, input.xsize, input.ysize,
+           opt->luma ? "luma" : "per channel", kernel);
+    printf("Threads: %d\n", workers);
+    printf("Time: %llu ns\n", t.duration());
+    printf("  load      %10.3f ms\n", load.duration() / 1e6);
+    printf("  histogram %10.3f ms\n", hist.duration() / 1e6);
+    printf("  cdf       %10.3f ms\n", cdf.duration() / 1e6);
+    printf("  apply     %10.3f ms (%.2f GB/s)\n", apply.duration() / 1e6,
+           apply.duration() ? pixels * 6.0 / apply.duration() : 0.0);
+    printf("  write     %10.3f ms\n", write.duration() / 1e6);
+  }
+
+  free(e.rows);
+  free(e.out);
+  free_img(&input);
+  return failed ? 1 : 0;
+}
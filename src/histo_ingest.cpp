@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "histo_pipeline.h"
+#include "histo_uring.h"
+
+/* Whole-file loaders for the pipeline.  Each slot receives the raw file in
+   its slice of the fixed buffer (or a heap buffer when the file is larger);
+   the pixels are then counted in place as interleaved RGB, so there is no
+   per-byte decode at all. */
+
+#define MAX_READ (1 << 30)
+
+static unsigned char *file_buffer(struct pipeline *p, struct slot *s, size_t size) {
+  if(size <= p->opt->io_buffer) {
+    s->file = p->fixed + (size_t) s->id * p->opt->io_buffer;
+    return s->file;
+  }
+  if(size > s->file_heap_capacity) {
+    free(s->file_heap);
+    s->file_heap = (unsigned char *) malloc(size);
+    s->file_heap_capacity = s->file_heap ? size : 0;
+  }
+  s->file = s->file_heap;
+  return s->file;
+}
+
+// Open the file and pick a buffer for it.  Returns the descriptor or -1.
+static int open_file(struct pipeline *p, struct slot *s, const char *file_name) {
+  int fd = open(file_name, O_RDONLY);
+  if(fd < 0) {
+    fprintf(stderr, "Cannot open the input file %s.\n", file_name);
+    return -1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) || !file_buffer(p, s, st.st_size)) {
+    fprintf(stderr, "Unable to allocate memory for %s.\n", file_name);
+    close(fd);
+    return -1;
+  }
+  s->raw = true;
+  s->file_size = st.st_size;
+  s->read_done = 0;
+  return fd;
+}
+
+static bool parse_file(struct slot *s, const char *file_name) {
+  if(s->read_done < s->file_size) {
+    fprintf(stderr, "Short read from %s.\n", file_name);
+    return true;
+  }
+  if(parse_ppm_header(s->file, s->file_size, &s->input, &s->data_offset)) {
+    fprintf(stderr, "Bad PPM header in %s.\n", file_name);
+    return true;
+  }
+  size_t pixels = (size_t) s->input.xsize * s->input.ysize;
+  if(s->data_offset + pixels * 3 > s->file_size) {
+    fprintf(stderr, "Failed reading data from %s.\n", file_name);
+    return true;
+  }
+  return false;
+}
+
+// Reads whatever of the file is still missing.
+static void pread_rest(int fd, struct slot *s) {
+  while(s->read_done < s->file_size) {
+    size_t len = s->file_size - s->read_done;
+    ssize_t n = pread(fd, s->file + s->read_done, len < MAX_READ ? len : MAX_READ,
+                      s->read_done);
+    if(n <= 0)
+      break;
+    s->read_done += n;
+  }
+}
+
+static bool pread_file(struct pipeline *p, struct slot *s, const char *file_name) {
+  int fd = open_file(p, s, file_name);
+  if(fd < 0)
+    return true;
+
+  pread_rest(fd, s);
+  close(fd);
+  return parse_file(s, file_name);
+}
+
+void load_stage_pread(struct pipeline *p, long long *items,
+                      ggc::Timer &wait_in, ggc::Timer &wait_out) {
+  for(;;) {
+    int i = p->next_file.fetch_add(1);
+    if(i >= p->nfiles)
+      break;
+    struct slot *s = (struct slot *) p->free_q->pop(wait_in);
+    s->index = i;
+    s->ok = !pread_file(p, s, p->files[i]);
+    p->load_q->push(s, wait_out);
+    (*items)++;
+  }
+}
+
+/* Queues the next read of s.  Returns true if the submission ring is full;
+   the caller then finishes the file with pread instead. */
+static bool queue_read(struct uring *u, struct slot *s, bool fixed) {
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  if(!sqe)
+    return true;
+  size_t len = s->file_size - s->read_done;
+  bool in_fixed = s->file != s->file_heap;
+
+  sqe->opcode = fixed && in_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = s->fd;
+  sqe->off = s->read_done;
+  sqe->addr = (unsigned long) (s->file + s->read_done);
+  sqe->len = len < MAX_READ ? len : MAX_READ;
+  sqe->buf_index = 0;
+  sqe->user_data = (unsigned long) s;
+  return false;
+}
+
+static void finish_file(struct pipeline *p, struct slot *s, long long *items,
+                        ggc::Timer &wait_out) {
+  close(s->fd);
+  s->ok = !parse_file(s, p->files[s->index]);
+  p->load_q->push(s, wait_out);
+  (*items)++;
+}
+
+// One ring per loader thread keeps up to opt->depth reads in flight.  Free
+// slots are only waited for when nothing is outstanding; otherwise the loader
+// goes back to reaping completions.  If the ring fails, the files it held
+// are finished with pread, and so is the rest of the batch.
+bool load_stage_uring(struct pipeline *p, long long *items,
+                      ggc::Timer &wait_in, ggc::Timer &wait_out) {
+  struct uring u;
+  int depth = p->opt->depth;
+  if(uring_init(&u, depth))
+    return true;
+
+  struct iovec iov;
+  iov.iov_base = p->fixed;
+  iov.iov_len = (size_t) depth * p->opt->io_buffer;
+  bool fixed = !uring_register_buffers(&u, &iov, 1);
+
+  int inflight = 0;
+  bool files_left = true;
+  struct slot *queued[depth];   // by slot id: the loader's slots in the ring
+  memset(queued, 0, sizeof(queued));
+
+  while(files_left || inflight > 0) {
+    while(files_left && inflight < depth) {
+      struct slot *s;
+      if(inflight == 0)
+        s = (struct slot *) p->free_q->pop(wait_in);
+      else if(!p->free_q->try_pop((void **) &s))
+        break;
+
+      int i = p->next_file.fetch_add(1);
+      if(i >= p->nfiles) {
+        files_left = false;
+        p->free_q->push(s, wait_out);
+        break;
+      }
+
+      s->index = i;
+      s->fd = open_file(p, s, p->files[i]);
+      if(s->fd < 0) {
+        s->ok = false;
+        p->load_q->push(s, wait_out);
+        (*items)++;
+        continue;
+      }
+      if(queue_read(&u, s, fixed)) {
+        pread_rest(s->fd, s);
+        finish_file(p, s, items, wait_out);
+        continue;
+      }
+      queued[s->id] = s;
+      inflight++;
+    }
+
+    if(inflight == 0)
+      continue;
+
+    wait_in.start();
+    int rv = uring_submit_and_wait(&u, 1);
+    wait_in.stop();
+    if(rv < 0) {
+      perror("io_uring_enter, falling back to pread");
+      break;
+    }
+
+    struct io_uring_cqe cqe;
+    while(uring_pop_cqe(&u, &cqe)) {
+      struct slot *s = (struct slot *) (unsigned long) cqe.user_data;
+      if(cqe.res > 0) {
+        s->read_done += cqe.res;
+        if(s->read_done < s->file_size) {
+          if(!queue_read(&u, s, fixed))
+            continue;
+          pread_rest(s->fd, s);
+        }
+      }
+      finish_file(p, s, items, wait_out);
+      queued[s->id] = NULL;
+      inflight--;
+    }
+  }
+
+  uring_exit(&u);
+  if(inflight > 0) {
+    for(int id = 0; id < depth; id++) {
+      if(queued[id]) {
+        pread_rest(queued[id]->fd, queued[id]);
+        finish_file(p, queued[id], items, wait_out);
+      }
+    }
+    load_stage_pread(p, items, wait_in, wait_out);
+  }
+  return false;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Timer.h"
+#include "histo.h"
+
+/* --integral: build libhisto's integral histogram for one image and time a
+   batch of random rectangle queries against histo_compute on each of the
+   same rectangles, checking that both agree. */
+
+// xorshift, so runs with the same --seed ask the same questions
+static unsigned next_random(unsigned long long *state) {
+  unsigned long long x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return (unsigned) (x >> 32);
+}
+
+static void random_rect(histo_roi *q, int w, int h, unsigned long long *state) {
+  q->width = 1 + next_random(state) % w;
+  q->height = 1 + next_random(state) % h;
+  q->x = next_random(state) % (w - q->width + 1);
+  q->y = next_random(state) % (h - q->height + 1);
+}
+
+int run_integral(const char *input_file, const struct options *opt) {
+  struct img input;
+  size_t capacity = 0;
+  memset(&input, 0, sizeof(input));
+  if(load_ppm(input_file, &input, &capacity))
+    return 1;
+
+  histo_image image;
+  histo_image_planar(&image, input.xsize, input.ysize,
+                     input.r, input.g, input.b, input.xsize);
+
+  ggc::Timer build("build"), query("query"), direct("direct");
+  histo_integral *ih;
+
+  build.start();
+  int err = histo_integral_build(&image, opt->bins, &ih);
+  build.stop();
+  if(err) {
+    fprintf(stderr, "Cannot build the integral histogram: %s\n", histo_strerror(err));
+    free_img(&input);
+    return 1;
+  }
+
+  int n = opt->queries;
+  int bins = opt->bins;
+  size_t block = 3 * (size_t) bins;
+  histo_roi *rects = (histo_roi *) malloc(sizeof(histo_roi) * (n > 0 ? n : 1));
+  uint64_t *hists = (uint64_t *) malloc(sizeof(uint64_t) * block * (n > 0 ? n : 1));
+  if(!rects || !hists) {
+    fprintf(stderr, "Unable to allocate %d queries.\n", n);
+    free(rects);
+    free(hists);
+    histo_integral_free(ih);
+    free_img(&input);
+    return 1;
+  }
+  unsigned long long state = opt->seed ? opt->seed : 1;
+  for(int i = 0; i < n; i++)
+    random_rect(&rects[i], input.xsize, input.ysize, &state);
+
+  query.start();
+  histo_integral_query(ih, rects, n, hists);
+  query.stop();
+
+  // the same rectangles the direct way, quantized like the index
+  int checked = n < opt->verify ? n : opt->verify;
+  int mismatches = 0;
+  long long direct_pixels = 0;
+  uint64_t hist_r[HISTO_BINS], hist_g[HISTO_BINS], hist_b[HISTO_BINS];
+  for(int i = 0; i < checked; i++) {
+    direct.start();
+    histo_compute(&image, &rects[i], hist_r, hist_g, hist_b, 0);
+    direct.stop();
+    direct_pixels += (long long) rects[i].width * rects[i].height;
+
+    uint64_t want[3 * HISTO_BINS];
+    memset(want, 0, sizeof(want));
+    for(int v = 0; v < HISTO_BINS; v++) {
+      want[v * bins / HISTO_BINS] += hist_r[v];
+      want[bins + v * bins / HISTO_BINS] += hist_g[v];
+      want[2 * bins + v * bins / HISTO_BINS] += hist_b[v];
+    }
+    if(memcmp(want, hists + i * block, sizeof(uint64_t) * block) != 0)
+      mismatches++;
+  }
+
+  size_t bytes = histo_integral_bytes(ih);
+  printf("Integral: %dx%d, %d bins, %.1f MB (%.0f bytes per pixel)\n",
+         input.xsize, input.ysize, bins, bytes / 1048576.0,
+         (double) bytes / ((double) input.xsize * input.ysize));
+  printf("Threads: %d\n", histo_threads());
+  printf("Build: %.3f ms\n", build.duration() / 1e6);
+  printf("Queries: %d in %.3f ms (%.1f ns each)\n", n, query.duration() / 1e6,
+         n ? (double) query.duration() / n : 0.0);
+  if(checked > 0)
+    printf("Direct: %d in %.3f ms (%.1f ns each, %.1f Mpixels/s)\n", checked,
+           direct.total_duration() / 1e6, (double) direct.total_duration() / checked,
+           direct_pixels * 1e3 / (direct.total_duration() ? direct.total_duration() : 1));
+  printf("Verified: %d of %d match\n", checked - mismatches, checked);
+
+  free(rects);
+  free(hists);
+  histo_integral_free(ih);
+  free_img(&input);
+  return mismatches ? 1 : 0;
+}
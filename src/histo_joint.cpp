@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Timer.h"
+#include "histo.h"
+
+/* --joint: the joint RGB histogram of one image at --bits per channel,
+   timed against the three marginal histograms of histo_compute.  The
+   marginals summed out of the joint histogram must match those. */
+
+int run_joint(const char *input_file, const char *output_file, const struct options *opt) {
+  struct img input;
+  size_t capacity = 0;
+  memset(&input, 0, sizeof(input));
+  if(load_ppm(input_file, &input, &capacity))
+    return 1;
+
+  histo_image image;
+  histo_image_planar(&image, input.xsize, input.ysize,
+                     input.r, input.g, input.b, input.xsize);
+
+  ggc::Timer joint("joint"), marginal("marginal");
+  uint64_t hist_r[HISTO_BINS], hist_g[HISTO_BINS], hist_b[HISTO_BINS];
+  histo_joint *h;
+
+  // the first run pays for starting the pool
+  int err = histo_compute(&image, NULL, hist_r, hist_g, hist_b, 0);
+  if(err == HISTO_OK) {
+    marginal.start();
+    err = histo_compute(&image, NULL, hist_r, hist_g, hist_b, 0);
+    marginal.stop();
+  }
+  if(err) {
+    fprintf(stderr, "Cannot compute the marginal histograms: %s\n", histo_strerror(err));
+    free_img(&input);
+    return 1;
+  }
+
+  joint.start();
+  err = histo_joint_compute(&image, NULL, opt->joint_bits, &h);
+  joint.stop();
+  if(err) {
+    fprintf(stderr, "Cannot compute the joint histogram: %s\n", histo_strerror(err));
+    free_img(&input);
+    return 1;
+  }
+
+  int bits = opt->joint_bits, levels = 1 << bits, shift = 8 - bits;
+  size_t entries = histo_joint_entries(h);
+  uint32_t *cells = (uint32_t *) malloc(sizeof(uint32_t) * (entries ? entries : 1));
+  uint64_t *counts = (uint64_t *) malloc(sizeof(uint64_t) * (entries ? entries : 1));
+  if(!cells || !counts) {
+    fprintf(stderr, "Cannot compute the joint histogram: %s\n", histo_strerror(HISTO_ENOMEM));
+    free(cells);
+    free(counts);
+    histo_joint_free(h);
+    free_img(&input);
+    return 1;
+  }
+  histo_joint_list(h, cells, counts, entries);
+
+  uint64_t sum[3][HISTO_BINS], want[3][HISTO_BINS];
+  memset(sum, 0, sizeof(sum));
+  memset(want, 0, sizeof(want));
+  for(size_t i = 0; i < entries; i++) {
+    sum[0][cells[i] >> (2 * bits)] += counts[i];
+    sum[1][(cells[i] >> bits) & (levels - 1)] += counts[i];
+    sum[2][cells[i] & (levels - 1)] += counts[i];
+  }
+  for(int v = 0; v < HISTO_BINS; v++) {
+    want[0][v >> shift] += hist_r[v];
+    want[1][v >> shift] += hist_g[v];
+    want[2][v >> shift] += hist_b[v];
+  }
+  bool match = memcmp(sum, want, sizeof(sum)) == 0;
+
+  size_t pixels = (size_t) input.xsize * input.ysize;
+  printf("Joint: %dx%dx%d cells, %zu occupied, %s, %.1f KB\n", levels, levels, levels,
+         entries, bits <= HISTO_JOINT_DENSE_BITS ? "dense" : "sparse",
+         histo_joint_bytes(h) / 1024.0);
+  printf("Threads: %d\n", histo_threads());
+  printf("Time: %llu ns (%.1f Mpixels/s)\n", joint.duration(),
+         pixels * 1e3 / (joint.duration() ? joint.duration() : 1));
+  printf("Marginal: %llu ns (%.1f Mpixels/s, joint is %.1fx slower)\n", marginal.duration(),
+         pixels * 1e3 / (marginal.duration() ? marginal.duration() : 1),
+         (double) joint.duration() / (marginal.duration() ? marginal.duration() : 1));
+  printf("Marginals: %s\n", match ? "match" : "MISMATCH");
+
+  if(opt->top > 0) {
+    // the most common cells, by repeated selection (top is small)
+    printf("Top cells (r g b in %d-bit units):\n", bits);
+    for(int k = 0; k < opt->top && (size_t) k < entries; k++) {
+      size_t best = k;
+      for(size_t i = k + 1; i < entries; i++) {
+        if(counts[i] > counts[best])
+          best = i;
+      }
+      uint32_t c = cells[best];
+      uint64_t n = counts[best];
+      cells[best] = cells[k];
+      counts[best] = counts[k];
+      cells[k] = c;
+      counts[k] = n;
+      printf("  %3u %3u %3u %10llu\n", c >> (2 * bits), (c >> bits) & (levels - 1),
+             c & (levels - 1), (unsigned long long) n);
+    }
+  }
+
+  int rv = match ? 0 : 1;
+  if(output_file) {
+    // list again: the selection above reordered the arrays
+    histo_joint_list(h, cells, counts, entries);
+    FILE *out = fopen(output_file, "w");
+    if(out) {
+      fprintf(out, "%d %zu\n", bits, entries);
+      for(size_t i = 0; i < entries; i++)
+        fprintf(out, "%u %u %u %llu\n", cells[i] >> (2 * bits), (cells[i] >> bits) & (levels - 1),
+                cells[i] & (levels - 1), (unsigned long long) counts[i]);
+      fclose(out);
+    } else {
+      fprintf(stderr, "Unable to output!\n");
+      rv = 1;
+    }
+  }
+
+  free(cells);
+  free(counts);
+  histo_joint_free(h);
+  free_img(&input);
+  return rv;
+}
@@ -5,6 +5,9 @@
 #include <atomic>
 #include <pthread.h>
 #include "Timer.h"
+#include "histo_trace.h"
+#include "histo_emit.h"
+#include "histo_locks.h"
 
 extern "C" {
 #include "ppmb_io.h"
@@ -19,40 +22,6 @@ struct img {
   unsigned char *b;
 };
 
-void print_histogram(FILE *f, int *hist, int N) {
-  fprintf(f, "%d\n", N+1);
-  for(int i = 0; i <= N; i++) {
-    fprintf(f, "%d %d\n", i, hist[i]);
-  }
-}
-
-class alignas(64) SequencialLock {
-  std::atomic<int> head;
-  std::atomic<int> tail;
-  char padding[56];
-  
-public:
-  SequencialLock() : head(0), tail(0) {}
-  
-  void lock() {
-    int current_num = tail.fetch_add(1, std::memory_order_relaxed);
-    while (head.load(std::memory_order_acquire) != current_num) {
-      #if defined(__x86_64__) || defined(__i386__)
-      __builtin_ia32_pause();
-      #elif defined(__aarch64__)
-      __asm__ __volatile__("yield");
-      #endif
-    }
-  }
-  
-  void unlock() {
-    head.fetch_add(1, std::memory_order_release);
-  }
-};
-alignas(64) SequencialLock r_lock[256];
-alignas(64) SequencialLock g_lock[256];
-alignas(64) SequencialLock b_lock[256];
-
 struct index {
   struct img *input;
   int *hist_r;
@@ -62,8 +31,12 @@ struct index {
   int end;
 };
 
+template <class Lock>
 void* lock_histogram(void *thread) {
   struct index *idx = (struct index *) thread;
+  Lock *r_lock = BinLocks<Lock>::r;
+  Lock *g_lock = BinLocks<Lock>::g;
+  Lock *b_lock = BinLocks<Lock>::b;
   struct img *input = idx->input;
   int *hist_r = idx->hist_r;
   int *hist_g = idx->hist_g;
@@ -73,12 +46,15 @@ void* lock_histogram(void *thread) {
   int local_hist_r[256] = {0};
   int local_hist_g[256] = {0};
   int local_hist_b[256] = {0};
+  ggc::Phase count("count");
   for(int pix = start; pix < end; pix++) {
     local_hist_r[input->r[pix]]++;
     local_hist_g[input->g[pix]]++;
     local_hist_b[input->b[pix]]++;
   }
+  count.end();
 
+  ggc::Phase merge("merge");
   for(int i = 0; i < 256; i++) {
     if(local_hist_r[i] > 0) {
       r_lock[i].lock();
@@ -101,13 +77,23 @@ void* lock_histogram(void *thread) {
       b_lock[i].unlock();
     }
   }
+  merge.end();
 
   return NULL;
 }
 
 int main(int argc, char *argv[]) {
-  if(argc != 4) {
-    printf("Usage: %s input-file output-file threads\n", argv[0]);
+  bool contention = false;
+  for(int i = 4; i < argc; i++) {
+    if(strcmp(argv[i], "--contention") == 0) {
+      contention = true;
+      memmove(argv + i, argv + i + 1, sizeof(char *) * (argc - i - 1));
+      argc--;
+      break;
+    }
+  }
+  if(argc < 4 || !ggc::trace.parse(argc, argv, 4)) {
+    printf("Usage: %s input-file output-file threads [--contention] [--phases] [--counters] [--memory] [--trace file.json]\n", argv[0]);
     exit(1);
   }
   
@@ -117,8 +103,11 @@ int main(int argc, char *argv[]) {
 
   struct img input;
 
+  ggc::Phase load("load");
   if(!ppmb_read(input_file, &input.xsize, &input.ysize, &input. maxrgb, 
 		&input.r, &input. g, &input.b)) {
+    load.end();
+    ggc::trace.pixels = (long long) input.xsize * input.ysize;
     if(input.maxrgb > 255) {
       printf("Maxrgb %d not supported\n", input.maxrgb);
       exit(1);
@@ -126,13 +115,17 @@ int main(int argc, char *argv[]) {
 
     int *hist_r, *hist_g, *hist_b;
 
+    ggc::Phase alloc("alloc");
     hist_r = (int *) calloc(input.maxrgb+1, sizeof(int));
     hist_g = (int *) calloc(input.maxrgb+1, sizeof(int));
     hist_b = (int *) calloc(input.maxrgb+1, sizeof(int));
+    alloc.end();
 
     ggc::Timer t("histogram");
 
+    ggc::Phase phase("histogram");
     t.start();
+    ggc::Phase spawn("spawn");
     pthread_t thread_ids[threads];
     struct index *idx = (struct index *) malloc(sizeof(struct index) * threads);
     int N = input.xsize * input.ysize;
@@ -144,26 +137,30 @@ int main(int argc, char *argv[]) {
       idx[i]. hist_b = hist_b;
       idx[i]. start = N*i/threads;
       idx[i].end = N*(i+1)/threads;
-      pthread_create(&thread_ids[i], NULL, lock_histogram, (void *) (idx+i));
+      pthread_create(&thread_ids[i], NULL,
+                     contention ? lock_histogram<ProfiledSequencialLock> : lock_histogram<SequencialLock>,
+                     (void *) (idx+i));
     }
+    spawn.end();
 
+    ggc::Phase join("join");
     for (int i = 0; i < threads; i++) {
       pthread_join(thread_ids[i], NULL);
     }
+    join.end();
 
     t.stop();
+    phase.end();
 
-    FILE *out = fopen(output_file, "w");
-    if(out) {
-      print_histogram(out, hist_r, input.maxrgb);
-      print_histogram(out, hist_g, input.maxrgb);
-      print_histogram(out, hist_b, input.maxrgb);
-      fclose(out);
-    } else {
+    ggc::Phase emit("emit");
+    if(ggc::write_histogram_file(output_file, hist_r, hist_g, hist_b, input.maxrgb))
       fprintf(stderr, "Unable to output!\n");
-    }
+    emit.end();
     
     printf("Time: %llu ns\n", t. duration());
+    ggc::trace.report(stdout);
+    if(contention)
+      contention_report<ProfiledSequencialLock>(stdout);
     free(hist_r);
     free(hist_g);
     free(hist_b);
@@ -0,0 +1,256 @@
+#pragma once
+
+/* The per-bin locks of histo_lock1 (test-and-set) and histo_lock2 (ticket),
+   shared with histo_bench.  Each sits on its own cache line.
+
+   The Profiled template flag compiles in contention accounting: acquires,
+   spin iterations, time from lock() to owning the lock (as a log2
+   distribution) and time held.  Every field is updated by the owner while
+   it holds the lock, so none of them needs to be atomic.  Spinlock and
+   SequencialLock are the unprofiled instantiations, whose hooks are empty
+   and compile away.  contention_report() prints totals, the wait
+   distribution and a heat map of one BinLocks set. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+
+#define LOCK_WAIT_BUCKETS 32    // bucket b: waits of [2^b, 2^(b+1)) ns
+
+template <bool Profiled>
+struct LockStats {
+  unsigned long long begin() const { return 0; }
+  void spin(unsigned long long &spins) {}
+  void acquired(unsigned long long start, unsigned long long spins) {}
+  void releasing() {}
+};
+
+template <>
+struct LockStats<true> {
+  unsigned long long acquires;
+  unsigned long long contended;       // acquires that had to spin
+  unsigned long long spins;
+  unsigned long long wait_total;
+  unsigned long long wait_max;
+  unsigned long long hold_total;
+  unsigned long long held_at;
+  unsigned long long wait_hist[LOCK_WAIT_BUCKETS];
+
+  LockStats() {
+    memset(this, 0, sizeof(*this));
+  }
+
+  static unsigned long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  unsigned long long begin() const { return now(); }
+
+  void spin(unsigned long long &n) { n++; }
+
+  void acquired(unsigned long long start, unsigned long long n) {
+    unsigned long long t = now(), wait = t - start;
+    int b = 0;
+    while(b < LOCK_WAIT_BUCKETS - 1 && (2ULL << b) <= wait)
+      b++;
+    acquires++;
+    contended += n > 0;
+    spins += n;
+    wait_total += wait;
+    if(wait > wait_max)
+      wait_max = wait;
+    wait_hist[b]++;
+    held_at = t;
+  }
+
+  void releasing() {
+    hold_total += now() - held_at;
+  }
+};
+
+template <bool Profiled = false>
+class alignas(64) BasicSpinlock : public LockStats<Profiled> {
+  std:: atomic_flag flag = ATOMIC_FLAG_INIT;
+public:
+  void lock() {
+    unsigned long long start = this->begin(), spins = 0;
+    while(flag.test_and_set(std::memory_order_acquire)) {
+      this->spin(spins);
+      #if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+      #elif defined(__aarch64__)
+      __asm__ __volatile__("yield");
+      #endif
+    }
+    this->acquired(start, spins);
+  }
+  void unlock() {
+    this->releasing();
+    flag.clear(std::memory_order_release);
+  }
+  const LockStats<Profiled> &stats() const {
+    return *this;
+  }
+};
+
+template <bool Profiled = false>
+class alignas(64) BasicSequencialLock : public LockStats<Profiled> {
+  std::atomic<int> head;
+  std::atomic<int> tail;
+  char padding[56];
+
+public:
+  BasicSequencialLock() : head(0), tail(0) {}
+
+  void lock() {
+    unsigned long long start = this->begin(), spins = 0;
+    int current_num = tail.fetch_add(1, std::memory_order_relaxed);
+    while (head.load(std::memory_order_acquire) != current_num) {
+      this->spin(spins);
+      #if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+      #elif defined(__aarch64__)
+      __asm__ __volatile__("yield");
+      #endif
+    }
+    this->acquired(start, spins);
+  }
+
+  void unlock() {
+    this->releasing();
+    head.fetch_add(1, std::memory_order_release);
+  }
+  const LockStats<Profiled> &stats() const {
+    return *this;
+  }
+};
+
+typedef BasicSpinlock<false> Spinlock;
+typedef BasicSpinlock<true> ProfiledSpinlock;
+typedef BasicSequencialLock<false> SequencialLock;
+typedef BasicSequencialLock<true> ProfiledSequencialLock;
+
+/* One lock per bin and channel, in static storage unless place() has
+   moved them into 3 * 256 * sizeof(Lock) bytes of other memory, such as
+   an arena (histo_arena.h); place(NULL) moves them back. */
+template <class Lock>
+struct BinLocks {
+  static Lock storage[3][256];
+  static Lock *r;
+  static Lock *g;
+  static Lock *b;
+
+  static void place(void *memory) {
+    Lock *locks = memory ? (Lock *) memory : storage[0];
+    for(int i = 0; memory && i < 3 * 256; i++)
+      new (&locks[i]) Lock();
+    r = locks;
+    g = locks + 256;
+    b = locks + 512;
+  }
+};
+template <class Lock> Lock BinLocks<Lock>::storage[3][256];
+template <class Lock> Lock *BinLocks<Lock>::r = BinLocks<Lock>::storage[0];
+template <class Lock> Lock *BinLocks<Lock>::g = BinLocks<Lock>::storage[1];
+template <class Lock> Lock *BinLocks<Lock>::b = BinLocks<Lock>::storage[2];
+
+// Upper end of the bucket holding the p-th percentile wait.
+static unsigned long long lock_wait_percentile(const unsigned long long *hist, int p) {
+  unsigned long long total = 0, seen = 0;
+  for(int b = 0; b < LOCK_WAIT_BUCKETS; b++)
+    total += hist[b];
+  for(int b = 0; b < LOCK_WAIT_BUCKETS; b++) {
+    seen += hist[b];
+    if(total && seen * 100 >= total * p)
+      return 2ULL << b;
+  }
+  return 0;
+}
+
+/* Totals, the wait distribution, a heat map of wait time over the 3 x 256
+   locks (four bins per column) and the bins that waited longest. */
+template <class Lock>
+void contention_report(FILE *f) {
+  const Lock *sets[3] = { BinLocks<Lock>::r, BinLocks<Lock>::g, BinLocks<Lock>::b };
+  const char *channels = "rgb";
+  LockStats<true> all;
+  unsigned long long most = 0;
+
+  for(int c = 0; c < 3; c++) {
+    for(int i = 0; i < 256; i++) {
+      const LockStats<true> &s = sets[c][i].stats();
+      all.acquires += s.acquires;
+      all.contended += s.contended;
+      all.spins += s.spins;
+      all.wait_total += s.wait_total;
+      all.hold_total += s.hold_total;
+      if(s.wait_max > all.wait_max)
+        all.wait_max = s.wait_max;
+      for(int b = 0; b < LOCK_WAIT_BUCKETS; b++)
+        all.wait_hist[b] += s.wait_hist[b];
+    }
+    for(int i = 0; i < 256; i += 4) {
+      unsigned long long w = 0;
+      for(int k = 0; k < 4; k++)
+        w += sets[c][i + k].stats().wait_total;
+      if(w > most)
+        most = w;
+    }
+  }
+
+  unsigned long long n = all.acquires ? all.acquires : 1;
+  fprintf(f, "Contention: %llu acquires, %llu contended (%.1f%%), %llu spins\n",
+          all.acquires, all.contended, 100.0 * all.contended / n, all.spins);
+  fprintf(f, "  wait  %10.3f ms total, %.0f ns mean, p50 < %llu ns, p99 < %llu ns, max %llu ns\n",
+          all.wait_total / 1e6, (double) all.wait_total / n,
+          lock_wait_percentile(all.wait_hist, 50), lock_wait_percentile(all.wait_hist, 99),
+          all.wait_max);
+  fprintf(f, "  hold  %10.3f ms total, %.0f ns mean\n", all.hold_total / 1e6,
+          (double) all.hold_total / n);
+  fprintf(f, "  wait distribution:\n");
+  for(int b = 0; b < LOCK_WAIT_BUCKETS; b++) {
+    if(all.wait_hist[b])
+      fprintf(f, "    < %10llu ns %10llu\n", 2ULL << b, all.wait_hist[b]);
+  }
+
+  const char *shades = " .:-=+*#%@";
+  fprintf(f, "  heat map, wait per 4 bins (' ' none, '@' %.3f ms):\n", most / 1e6);
+  for(int c = 0; c < 3; c++) {
+    fprintf(f, "    %c |", channels[c]);
+    for(int i = 0; i < 256; i += 4) {
+      unsigned long long w = 0;
+      for(int k = 0; k < 4; k++)
+        w += sets[c][i + k].stats().wait_total;
+      int level = w && most ? (int) ((w * 9 + most - 1) / most) : 0;
+      fputc(shades[level], f);
+    }
+    fprintf(f, "|\n");
+  }
+
+  // the ten bins with the most wait, by selection
+  bool shown[3][256];
+  memset(shown, 0, sizeof(shown));
+  fprintf(f, "  most contended: bin      acquires    spins    wait ns    hold ns\n");
+  for(int k = 0; k < 10; k++) {
+    int bc = -1, bi = 0;
+    for(int c = 0; c < 3; c++) {
+      for(int i = 0; i < 256; i++) {
+        if(!shown[c][i] && sets[c][i].stats().wait_total > 0 &&
+           (bc < 0 || sets[c][i].stats().wait_total > sets[bc][bi].stats().wait_total)) {
+          bc = c;
+          bi = i;
+        }
+      }
+    }
+    if(bc < 0)
+      break;
+    shown[bc][bi] = true;
+    const LockStats<true> &s = sets[bc][bi].stats();
+    fprintf(f, "                  %c %3d %12llu %8llu %10llu %10llu\n", channels[bc], bi,
+            s.acquires, s.spins, s.wait_total, s.hold_total);
+  }
+}
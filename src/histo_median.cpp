@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_pool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* --median: square median (or any rank) filter in constant time per pixel,
+   after Perreault and Hebert.  Every column keeps a histogram of the 2r+1
+   pixels above and below the current row; moving down a row costs one
+   remove and one add per column.  Across a row the kernel histogram adds
+   the column entering on the right and subtracts the one leaving on the
+   left, so the radius only changes which columns those are.
+
+   Histograms are split into 16 coarse bins of 16 fine ones.  The kernel
+   keeps its coarse bins current and brings a fine segment up to date only
+   when the rank falls into it, from the column it was last updated at.
+   Edges replicate the border pixels.  Row bands run on the shared pool. */
+
+#define COARSE 16
+#define FINE 16
+
+struct median {
+  const struct img *input;
+  unsigned char *out;         // interleaved output pixels
+  int radius;
+  int rank;                   // index into the sorted window, 0-based
+  int bands;
+  uint16_t *fine;             // per worker: [xsize][256]
+  uint16_t *coarse;           // per worker: [xsize][16]
+};
+
+// dst += add - sub over 16 counters
+static inline void slide16(uint16_t *dst, const uint16_t *add, const uint16_t *sub) {
+#ifdef __SSE2__
+  __m128i *d = (__m128i *) dst;
+  const __m128i *a = (const __m128i *) add, *s = (const __m128i *) sub;
+  _mm_storeu_si128(d, _mm_add_epi16(_mm_loadu_si128(d),
+                                    _mm_sub_epi16(_mm_loadu_si128(a), _mm_loadu_si128(s))));
+  _mm_storeu_si128(d + 1, _mm_add_epi16(_mm_loadu_si128(d + 1),
+                                        _mm_sub_epi16(_mm_loadu_si128(a + 1),
+                                                      _mm_loadu_si128(s + 1))));
+#else
+  for(int i = 0; i < 16; i++)
+    dst[i] += add[i] - sub[i];
+#endif
+}
+
+static inline void add16(uint16_t *dst, const uint16_t *add) {
+#ifdef __SSE2__
+  __m128i *d = (__m128i *) dst;
+  const __m128i *a = (const __m128i *) add;
+  _mm_storeu_si128(d, _mm_add_epi16(_mm_loadu_si128(d), _mm_loadu_si128(a)));
+  _mm_storeu_si128(d + 1, _mm_add_epi16(_mm_loadu_si128(d + 1), _mm_loadu_si128(a + 1)));
+#else
+  for(int i = 0; i < 16; i++)
+    dst[i] += add[i];
+#endif
+}
+
+static inline int clamp(int v, int hi) {
+  return v < 0 ? 0 : v > hi ? hi : v;
+}
+
+static void column_add(uint16_t *fine, uint16_t *coarse, const unsigned char *row,
+                       int w, int delta) {
+  for(int x = 0; x < w; x++) {
+    int v = row[x];
+    fine[x * HISTO_BINS + v] += delta;
+    coarse[x * COARSE + (v >> 4)] += delta;
+  }
+}
+
+// Filter rows y0..y1 of one plane into channel c of the output.
+static void filter_plane(const struct median *m, const unsigned char *plane, int c,
+                         int y0, int y1, uint16_t *fine, uint16_t *coarse) {
+  int w = m->input->xsize, h = m->input->ysize;
+  int r = m->radius;
+
+  memset(fine, 0, sizeof(uint16_t) * w * HISTO_BINS);
+  memset(coarse, 0, sizeof(uint16_t) * w * COARSE);
+  for(int dy = -r; dy <= r; dy++)
+    column_add(fine, coarse, plane + (size_t) clamp(y0 + dy, h - 1) * w, w, 1);
+
+  for(int y = y0; y < y1; y++) {
+    if(y > y0) {
+      column_add(fine, coarse, plane + (size_t) clamp(y - r - 1, h - 1) * w, w, -1);
+      column_add(fine, coarse, plane + (size_t) clamp(y + r, h - 1) * w, w, 1);
+    }
+
+    // kernel over columns -r..r of x = 0, with the left edge replicated
+    uint16_t kc[COARSE], kf[COARSE][FINE];
+    int updated[COARSE];      // kf[k] covers the window of this column
+    memset(kc, 0, sizeof(kc));
+    for(int dx = -r; dx <= r; dx++)
+      add16(kc, coarse + clamp(dx, w - 1) * COARSE);
+    for(int k = 0; k < COARSE; k++)
+      updated[k] = -2 * r - 2;
+
+    unsigned char *out = m->out + (size_t) y * w * 3 + c;
+    for(int x = 0; x < w; x++) {
+      if(x > 0)
+        slide16(kc, coarse + clamp(x + r, w - 1) * COARSE,
+                coarse + clamp(x - r - 1, w - 1) * COARSE);
+
+      int k = 0, below = 0;
+      while(below + kc[k] <= m->rank)
+        below += kc[k++];
+
+      if(updated[k] < x - 2 * r) {
+        // too far behind: sum the window afresh
+        memset(kf[k], 0, sizeof(kf[k]));
+        for(int dx = -r; dx <= r; dx++)
+          add16(kf[k], fine + clamp(x + dx, w - 1) * HISTO_BINS + k * FINE);
+      } else {
+        for(int col = updated[k] + 1; col <= x; col++)
+          slide16(kf[k], fine + clamp(col + r, w - 1) * HISTO_BINS + k * FINE,
+                  fine + clamp(col - r - 1, w - 1) * HISTO_BINS + k * FINE);
+      }
+      updated[k] = x;
+
+      int f = 0;
+      while(below + kf[k][f] <= m->rank)
+        below += kf[k][f++];
+      out[3 * x] = (unsigned char) (k * FINE + f);
+    }
+  }
+}
+
+static void median_task(void *arg, int task, int worker) {
+  struct median *m = (struct median *) arg;
+  const struct img *in = m->input;
+  int rows = in->ysize;
+  int y0 = (int) ((long long) rows * task / m->bands);
+  int y1 = (int) ((long long) rows * (task + 1) / m->bands);
+  uint16_t *fine = m->fine + (size_t) worker * in->xsize * HISTO_BINS;
+  uint16_t *coarse = m->coarse + (size_t) worker * in->xsize * COARSE;
+
+  filter_plane(m, in->r, 0, y0, y1, fine, coarse);
+  filter_plane(m, in->g, 1, y0, y1, fine, coarse);
+  filter_plane(m, in->b, 2, y0, y1, fine, coarse);
+}
+
+int run_median(const char *input_file, const char *output_file,
+               const struct options *opt) {
+  struct img input;
+  size_t capacity = 0;
+  memset(&input, 0, sizeof(input));
+
+  ggc::Timer t("median"), load("load"), filter("filter"), write("write");
+
+  t.start();
+  load.start();
+  if(load_ppm(input_file, &input, &capacity))
+    return 1;
+  load.stop();
+
+  struct pool *p = histo_shared_pool();
+  int workers = pool_size(p);
+  size_t pixels = (size_t) input.xsize * input.ysize;
+  int window = 2 * opt->radius + 1;
+
+  // Each band starts by filling its column histograms with 2r+1 rows, so
+  // bands shorter than the window would mostly repeat that work.
+  struct median m;
+  memset(&m, 0, sizeof(m));
+  m.input = &input;
+  m.radius = opt->radius;
+  m.rank = (int) ((long long) (window * window - 1) * opt->percentile / 100);
+  m.bands = input.ysize / window;
+  if(m.bands > workers * 4)
+    m.bands = workers * 4;
+  if(m.bands < 1)
+    m.bands = 1;
+  m.out = (unsigned char *) malloc(pixels * 3);
+  m.fine = (uint16_t *) malloc(sizeof(uint16_t) * workers * input.xsize * HISTO_BINS);
+  m.coarse = (uint16_t *) malloc(sizeof(uint16_t) * workers * input.xsize * COARSE);
+
+  bool failed = !m.out || !m.fine || !m.coarse;
+  if(failed) {
+    fprintf(stderr, "Unable to allocate memory for %s.\n", output_file);
+  } else {
+    filter.start();
+    pool_run(p, median_task, &m, m.bands);
+    filter.stop();
+
+    write.start();
+    failed = write_ppm(output_file, input.xsize, input.ysize, input.maxrgb, m.out);
+    write.stop();
+  }
+  t.stop();
+
+  if(!failed) {
+    printf("Filtered: %s (%dx%d, radius %d, percentile %d)\n", output_file,
+           input.xsize, input.ysize, opt->radius, opt->percentile);
+    printf("Threads: %d, %d bands\n", workers, m.bands);
+    printf("Time: %llu ns\n", t.duration());
+    printf("  load      %10.3f ms\n", load.duration() / 1e6);
+    printf("  filter    %10.3f ms (%.2f ns per pixel and channel)\n",
+           filter.duration() / 1e6, (double) filter.duration() / (pixels * 3));
+    printf("  write     %10.3f ms\n", write.duration() / 1e6);
+  }
+
+  free(m.out);
+  free(m.fine);
+  free(m.coarse);
+  free_img(&input);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+/* Hardware counters for ggc::Phase (histo_trace.h), through
+   perf_event_open.  Each thread opens one group when its outermost phase
+   starts and closes it when that phase ends; every phase reads the group
+   at both ends and keeps the difference.  Counters the kernel or the
+   machine will not give us (perf_event_paranoid, no PMU in a VM) are left
+   out of the group, with one note on stderr, and the phases are timed
+   all the same.  When the PMU multiplexes the group, the deltas are scaled
+   by the time the group was enabled over the time it ran; a group that
+   never ran counts nothing. */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+namespace ggc {
+
+enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_TASK_CLOCK,
+  PERF_PAGE_FAULTS,
+  PERF_CONTEXT_SWITCHES,
+  PERF_COUNTERS
+};
+
+static const char *perf_names[PERF_COUNTERS] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses",
+  "task_clock_ns", "page_faults", "context_switches"
+};
+
+struct PerfSample {
+  unsigned valid;               // bit i: value[i] was counted
+  unsigned long long value[PERF_COUNTERS];
+  unsigned long long enabled;   // ns the group was enabled
+  unsigned long long running;   // ns it was on the PMU
+};
+
+/* after minus before, into after, scaled up to the time enabled if the
+   group only ran part of it.  No counter is valid if it never ran. */
+static inline void perf_delta(PerfSample *after, const PerfSample *before) {
+  after->valid &= before->valid;
+  after->enabled -= before->enabled;
+  after->running -= before->running;
+  if(after->running == 0)
+    after->valid = 0;
+  for(int c = 0; c < PERF_COUNTERS; c++) {
+    if(!((after->valid >> c) & 1)) {
+      after->value[c] = 0;
+      continue;
+    }
+    after->value[c] -= before->value[c];
+    if(after->running < after->enabled)
+      after->value[c] = (unsigned long long) ((double) after->value[c] * after->enabled /
+                                              after->running + 0.5);
+  }
+}
+
+class PerfGroup {
+  int fd[PERF_COUNTERS];
+  int slot[PERF_COUNTERS];      // position in the group read, or -1
+  int leader;
+  int members;
+
+  static void describe(int counter, struct perf_event_attr *attr) {
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                        PERF_FORMAT_TOTAL_TIME_RUNNING;
+    switch(counter) {
+    case PERF_CYCLES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PERF_INSTRUCTIONS:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PERF_L1D_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case PERF_LLC_MISSES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case PERF_TASK_CLOCK:
+      attr->type = PERF_TYPE_SOFTWARE;
+      attr->config = PERF_COUNT_SW_TASK_CLOCK;
+      break;
+    case PERF_PAGE_FAULTS:
+      attr->type = PERF_TYPE_SOFTWARE;
+      attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+      break;
+    default:
+      attr->type = PERF_TYPE_SOFTWARE;
+      attr->config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+      break;
+    }
+    // user space is all perf_event_paranoid 2 allows; switches happen in the kernel
+    attr->exclude_kernel = attr->type != PERF_TYPE_SOFTWARE;
+    attr->exclude_hv = 1;
+  }
+
+  // Which counters failed to open, reported once per process.
+  static std::atomic<unsigned> &missing() {
+    static std::atomic<unsigned> mask(0);
+    return mask;
+  }
+
+ public:
+  PerfGroup() : leader(-1), members(0) {
+    for(int i = 0; i < PERF_COUNTERS; i++) {
+      fd[i] = -1;
+      slot[i] = -1;
+    }
+  }
+
+  bool open() {
+    for(int i = 0; i < PERF_COUNTERS; i++) {
+      struct perf_event_attr attr;
+      describe(i, &attr);
+      fd[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+      if(fd[i] < 0) {
+        int err = errno;
+        unsigned bit = 1u << i;
+        if(!(missing().fetch_or(bit) & bit)) {
+          FILE *p = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+          int paranoid = 0;
+          if(!p || fscanf(p, "%d", &paranoid) != 1)
+            paranoid = -9;
+          if(p)
+            fclose(p);
+          fprintf(stderr, "perf: %s unavailable (%s, perf_event_paranoid %d)\n",
+                  perf_names[i], strerror(err), paranoid);
+        }
+        continue;
+      }
+      if(leader < 0)
+        leader = fd[i];
+      slot[i] = members++;
+    }
+    return leader >= 0;
+  }
+
+  // nr, time enabled, time running, then the values in group order
+  void read(PerfSample *s) {
+    unsigned long long buf[3 + PERF_COUNTERS];
+    s->valid = 0;
+    s->enabled = s->running = 0;
+    if(leader < 0 || ::read(leader, buf, sizeof(buf)) < (ssize_t) (3 * sizeof(buf[0])))
+      return;
+    s->enabled = buf[1];
+    s->running = buf[2];
+    for(int i = 0; i < PERF_COUNTERS; i++) {
+      if(slot[i] >= 0 && slot[i] < (int) buf[0]) {
+        s->value[i] = buf[3 + slot[i]];
+        s->valid |= 1u << i;
+      }
+    }
+  }
+
+  void close() {
+    for(int i = 0; i < PERF_COUNTERS; i++) {
+      if(fd[i] >= 0)
+        ::close(fd[i]);
+      fd[i] = -1;
+      slot[i] = -1;
+    }
+    leader = -1;
+    members = 0;
+  }
+};
+}
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_pipeline.h"
+#include "histo_store.h"
+
+static const char *io_names[] = { "stdio", "pread", "io_uring" };
+
+struct stage_arg {
+  struct pipeline *p;
+  int stage;
+};
+
+static void account(struct pipeline *p, int stage, long long items, ggc::Timer &busy,
+                    ggc::Timer &wait_in, ggc::Timer &wait_out) {
+  pthread_mutex_lock(&p->lock);
+  struct stage_stats *s = &p->stats[stage];
+  s->items += items;
+  s->busy += busy.total_duration();
+  s->wait_in += wait_in.total_duration();
+  s->wait_out += wait_out.total_duration();
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void load_stage_stdio(struct pipeline *p, long long *items,
+                             ggc::Timer &wait_in, ggc::Timer &wait_out) {
+  for(;;) {
+    int i = p->next_file.fetch_add(1);
+    if(i >= p->nfiles)
+      break;
+    struct slot *s = (struct slot *) p->free_q->pop(wait_in);
+    s->index = i;
+    if(p->arenas) {
+      FILE *f = open_ppm(p->files[i], &s->input);
+      s->ok = f && !read_ppm_arena(f, p->files[i], &s->input, &p->arenas[s->id], 1);
+    } else {
+      s->ok = !load_ppm(p->files[i], &s->input, &s->capacity);
+    }
+    p->load_q->push(s, wait_out);
+    (*items)++;
+  }
+}
+
+// The last loader out tells every counter to stop.
+void finish_load(struct pipeline *p, ggc::Timer &wait_out) {
+  if(p->loaders_left.fetch_sub(1) == 1) {
+    for(int c = 0; c < p->opt->counters; c++)
+      p->load_q->push(&p->end, wait_out);
+  }
+}
+
+// The last counter out tells every emitter to stop.
+static void finish_count(struct pipeline *p, ggc::Timer &wait_out) {
+  if(p->counters_left.fetch_sub(1) == 1) {
+    for(int e = 0; e < p->opt->emitters; e++)
+      p->emit_q->push(&p->end, wait_out);
+  }
+}
+
+static void count_stage(struct pipeline *p, long long *items,
+                        ggc::Timer &wait_in, ggc::Timer &wait_out) {
+  for(;;) {
+    struct slot *s = (struct slot *) p->load_q->pop(wait_in);
+    if(s == &p->end)
+      break;
+    if(s->ok) {
+      histo_image image;
+      if(s->raw)
+        histo_image_interleaved(&image, s->input.xsize, s->input.ysize,
+                                s->file + s->data_offset, (ptrdiff_t) s->input.xsize * 3,
+                                3, 0, 1, 2);
+      else
+        histo_image_planar(&image, s->input.xsize, s->input.ysize,
+                           s->input.r, s->input.g, s->input.b, s->input.xsize);
+      int err = count_channels(&image, s->hist_r, s->hist_g, s->hist_b, HISTO_SINGLE_THREAD,
+                               p->opt);
+      if(err < 0) {
+        fprintf(stderr, "Unable to count %s: %s\n", p->files[s->index], histo_strerror(err));
+        s->ok = false;
+      }
+    }
+    p->emit_q->push(s, wait_out);
+    (*items)++;
+  }
+
+  finish_count(p, wait_out);
+}
+
+static void emit_stage(struct pipeline *p, long long *items,
+                       ggc::Timer &wait_in, ggc::Timer &wait_out) {
+  long long pixels = 0;
+  int failed = 0;
+
+  for(;;) {
+    struct slot *s = (struct slot *) p->emit_q->pop(wait_in);
+    if(s == &p->end)
+      break;
+
+    if(!s->ok) {
+      failed++;
+    } else if(p->store >= 0) {
+      const uint64_t *hists[3] = { s->hist_r, s->hist_g, s->hist_b };
+      if(store_append(p->store, p->files[s->index], hists, p->opt->channels,
+                      p->opt->nchannels, s->input.maxrgb)) {
+        fprintf(stderr, "Failed appending %s to %s\n", p->files[s->index], p->opt->store);
+        failed++;
+      }
+    } else if(p->results) {
+      struct batch_result *res = &p->results[s->index];
+      memcpy(res->hist_r, s->hist_r, sizeof(res->hist_r));
+      memcpy(res->hist_g, s->hist_g, sizeof(res->hist_g));
+      memcpy(res->hist_b, s->hist_b, sizeof(res->hist_b));
+      res->maxrgb = s->input.maxrgb;
+      res->ok = true;
+    } else {
+      write_hist_file(p->opt, p->files[s->index], s->hist_r, s->hist_g,
+                      s->hist_b, s->input.maxrgb);
+    }
+    if(s->ok)
+      pixels += (long long) s->input.xsize * s->input.ysize;
+
+    // the free queue holds every slot, so this never waits
+    p->free_q->push(s, wait_out);
+    (*items)++;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->pixels += pixels;
+  p->failed += failed;
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void* stage_thread(void *thread) {
+  struct stage_arg *a = (struct stage_arg *) thread;
+  struct pipeline *p = a->p;
+  ggc::Timer busy("busy"), wait_in("wait_in"), wait_out("wait_out");
+  long long items = 0;
+
+  busy.start();
+  if(a->stage == LOAD) {
+    if(p->opt->io == IO_URING && load_stage_uring(p, &items, wait_in, wait_out)) {
+      fprintf(stderr, "io_uring not available, falling back to pread\n");
+      load_stage_pread(p, &items, wait_in, wait_out);
+    } else if(p->opt->io == IO_PREAD) {
+      load_stage_pread(p, &items, wait_in, wait_out);
+    } else if(p->opt->io == IO_STDIO) {
+      load_stage_stdio(p, &items, wait_in, wait_out);
+    }
+    finish_load(p, wait_out);
+  } else if(a->stage == COUNT)
+    count_stage(p, &items, wait_in, wait_out);
+  else
+    emit_stage(p, &items, wait_in, wait_out);
+  busy.stop();
+
+  account(p, a->stage, items, busy, wait_in, wait_out);
+  return NULL;
+}
+
+int run_pipeline(const char *source, const struct options *opt) {
+  struct pipeline p;
+  memset(&p, 0, sizeof(p));
+  p.opt = opt;
+  p.files = collect_files(source, &p.nfiles);
+  if(!p.files || p.nfiles == 0) {
+    if(p.files)
+      fprintf(stderr, "No images in batch source %s\n", source);
+    else
+      fprintf(stderr, "Unable to read batch source %s: %s\n", source, strerror(errno));
+    free_files(p.files, p.nfiles);
+    return 1;
+  }
+  p.store = -1;
+  if(opt->store && (p.store = store_open_append(opt->store)) < 0) {
+    free_files(p.files, p.nfiles);
+    return 1;
+  }
+  bool ready = true;
+  if(opt->combined && p.store < 0) {
+    p.results = (struct batch_result *) calloc(p.nfiles, sizeof(struct batch_result));
+    ready = p.results != NULL;
+  }
+
+  int depth = opt->depth;
+  size_t capacity = depth + opt->counters + opt->emitters;
+  MPMCQueue free_q(capacity), load_q(capacity), emit_q(capacity);
+  p.free_q = &free_q;
+  p.load_q = &load_q;
+  p.emit_q = &emit_q;
+  ready = ready && free_q.ok() && load_q.ok() && emit_q.ok();
+
+  struct slot *slots = (struct slot *) calloc(depth, sizeof(struct slot));
+  ready = ready && slots;
+  for(int i = 0; ready && i < depth; i++) {
+    slots[i].id = i;
+    free_q.try_push(&slots[i]);
+  }
+  if(opt->arena && opt->io == IO_STDIO) {
+    p.arenas = (struct arena *) calloc(depth, sizeof(struct arena));
+    ready = ready && p.arenas;
+  }
+  if(!ready)
+    fprintf(stderr, "Unable to allocate pipeline state for depth %d\n", depth);
+
+  // One mapping holds every slot's file buffer so io_uring can register it
+  // once; pages are only touched as files are read into them.
+  size_t fixed_len = 0;
+  if(ready && opt->io != IO_STDIO) {
+    fixed_len = (size_t) depth * opt->io_buffer;
+    p.fixed = (unsigned char *) mmap(NULL, fixed_len, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p.fixed == MAP_FAILED) {
+      fprintf(stderr, "Unable to allocate %zu bytes of I/O buffers\n", fixed_len);
+      p.fixed = NULL;
+      fixed_len = 0;
+      ready = false;
+    }
+  }
+  if(!ready)
+    p.failed = p.nfiles;
+
+  p.next_file.store(0);
+  p.loaders_left.store(opt->loaders);
+  p.counters_left.store(opt->counters);
+  pthread_mutex_init(&p.lock, NULL);
+
+  int nthreads[3] = { opt->loaders, opt->counters, opt->emitters };
+  const char *names[3] = { "load", "count", "emit" };
+  int total = nthreads[LOAD] + nthreads[COUNT] + nthreads[EMIT];
+  pthread_t thread_ids[total];
+  struct stage_arg args[total];
+
+  ggc::Timer t("pipeline");
+
+  /* Downstream stages start first, so if a thread cannot be created every
+     stage after it is already running.  The threads that did not start
+     are then retired here: no more files are handed out, and their end
+     markers are passed on for them. */
+  t.start();
+  int n = 0;
+  bool started = ready;
+  for(int stage = EMIT; stage >= LOAD; stage--) {
+    p.stats[stage].name = names[stage];
+    p.stats[stage].threads = 0;
+    for(int i = 0; started && i < nthreads[stage]; i++) {
+      args[n].p = &p;
+      args[n].stage = stage;
+      if(pthread_create(&thread_ids[n], NULL, stage_thread, (void *) (args+n))) {
+        fprintf(stderr, "Unable to start a thread for the %s stage\n", names[stage]);
+        started = false;
+        break;
+      }
+      p.stats[stage].threads++;
+      n++;
+    }
+  }
+  if(ready && !started) {
+    int claimed = p.next_file.exchange(p.nfiles);
+    if(claimed < p.nfiles) {
+      pthread_mutex_lock(&p.lock);
+      p.failed += p.nfiles - claimed;
+      pthread_mutex_unlock(&p.lock);
+    }
+    ggc::Timer unused("unused");
+    for(int i = p.stats[COUNT].threads; i < nthreads[COUNT]; i++)
+      finish_count(&p, unused);
+    for(int i = p.stats[LOAD].threads; i < nthreads[LOAD]; i++)
+      finish_load(&p, unused);
+  }
+  for(int i = 0; i < n; i++) {
+    pthread_join(thread_ids[i], NULL);
+  }
+
+  if(p.results && ready)
+    write_combined(opt, p.files, p.results, p.nfiles);
+  t.stop();
+
+  int done = p.nfiles - p.failed;
+  double seconds = (double) t.duration() / NANOSEC;
+  printf("Images: %d (%d failed)\n", done, p.failed);
+  printf("Depth: %d\n", depth);
+  printf("I/O: %s\n", io_names[opt->io]);
+  printf("Time: %llu ns\n", t.duration());
+  printf("Throughput: %.1f images/s, %.1f Mpixels/s\n",
+         seconds > 0 ? done / seconds : 0.0,
+         seconds > 0 ? p.pixels / seconds / 1e6 : 0.0);
+  printf("%-6s %7s %7s %12s %12s %12s\n", "stage", "threads", "items",
+         "busy ms", "starved ms", "blocked ms");
+  for(int stage = LOAD; stage <= EMIT; stage++) {
+    struct stage_stats *s = &p.stats[stage];
+    printf("%-6s %7d %7lld %12.3f %12.3f %12.3f\n", s->name, s->threads, s->items,
+           s->busy / 1e6, s->wait_in / 1e6, s->wait_out / 1e6);
+  }
+  if(p.arenas)
+    report_arenas(p.arenas, depth);
+
+  for(int i = 0; slots && i < depth; i++) {
+    if(p.arenas)
+      arena_release(&p.arenas[i]);
+    else
+      free_img(&slots[i].input);
+    free(slots[i].file_heap);
+  }
+  free(p.arenas);
+  free(slots);
+  if(fixed_len)
+    munmap(p.fixed, fixed_len);
+  free(p.results);
+  if(p.store >= 0)
+    close(p.store);
+  free_files(p.files, p.nfiles);
+  pthread_mutex_destroy(&p.lock);
+  return p.failed ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <pthread.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_queue.h"
+
+/* Three-stage batch pipeline: loaders read and decode images into recycled
+   slots, counters histogram them, emitters write the results and hand the
+   slots back.  All hand-offs go through bounded lock-free queues, so at most
+   opt->depth images are in memory at once. */
+
+struct slot {
+  int id;
+  int index;
+  bool ok;
+  struct img input;
+  size_t capacity;
+
+  // --io pread/uring: the whole file, counted in place as interleaved RGB
+  bool raw;
+  unsigned char *file;          // fixed (registered) buffer or file_heap
+  unsigned char *file_heap;     // for files larger than the fixed buffer
+  size_t file_heap_capacity;
+  size_t file_size;
+  size_t data_offset;           // start of the pixel data
+  size_t read_done;
+  int fd;
+
+  uint64_t hist_r[HISTO_BINS];
+  uint64_t hist_g[HISTO_BINS];
+  uint64_t hist_b[HISTO_BINS];
+};
+
+struct stage_stats {
+  const char *name;
+  int threads;
+  long long items;
+  unsigned long long busy;       // summed thread lifetimes
+  unsigned long long wait_in;    // starved: input queue empty
+  unsigned long long wait_out;   // blocked: output queue full
+};
+
+struct pipeline {
+  const struct options *opt;
+  char **files;
+  int nfiles;
+  struct batch_result *results;
+  int store;                     // --store descriptor, or -1
+
+  std::atomic<int> next_file;
+  std::atomic<int> loaders_left;
+  std::atomic<int> counters_left;
+
+  MPMCQueue *free_q;
+  MPMCQueue *load_q;
+  MPMCQueue *emit_q;
+  struct slot end;               // end-of-stream marker
+
+  unsigned char *fixed;          // opt->depth buffers of opt->io_buffer bytes
+  struct arena *arenas;          // --arena with stdio loaders: one per slot id
+
+  pthread_mutex_t lock;
+  struct stage_stats stats[3];
+  long long pixels;
+  int failed;
+};
+
+enum { LOAD, COUNT, EMIT };
+
+/* Loader stage bodies (histo_ingest.cpp).  Both read whole files into the
+   slot buffers and leave the pixels interleaved for the counters.
+   load_stage_uring returns true, having done nothing, if io_uring is not
+   available. */
+void load_stage_pread(struct pipeline *p, long long *items,
+                      ggc::Timer &wait_in, ggc::Timer &wait_out);
+bool load_stage_uring(struct pipeline *p, long long *items,
+                      ggc::Timer &wait_in, ggc::Timer &wait_out);
+void finish_load(struct pipeline *p, ggc::Timer &wait_out);
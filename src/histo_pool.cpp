@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <pthread.h>
+#include "histo_pool.h"
+
+struct pool {
+  int threads;
+  pthread_t *thread_ids;
+
+  pthread_mutex_t run_lock;   // one pool_run() at a time
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+
+  unsigned long generation;
+  bool shutdown;
+
+  pool_task_fn fn;
+  void *arg;
+  int ntasks;
+  std::atomic<int> next;
+  int busy;                   // helpers still working on this generation
+};
+
+struct worker_arg {
+  struct pool *p;
+  int worker;
+};
+
+static void drain(struct pool *p, int worker) {
+  for(;;) {
+    int task = p->next.fetch_add(1, std::memory_order_relaxed);
+    if(task >= p->ntasks)
+      break;
+    p->fn(p->arg, task, worker);
+  }
+}
+
+static void* pool_worker(void *thread) {
+  struct worker_arg *wa = (struct worker_arg *) thread;
+  struct pool *p = wa->p;
+  int worker = wa->worker;
+  unsigned long seen = 0;
+  free(wa);
+
+  pthread_mutex_lock(&p->lock);
+  for(;;) {
+    while(!p->shutdown && p->generation == seen)
+      pthread_cond_wait(&p->wake, &p->lock);
+    if(p->shutdown)
+      break;
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+
+    drain(p, worker);
+
+    pthread_mutex_lock(&p->lock);
+    if(--p->busy == 0)
+      pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+struct pool *pool_create(int threads) {
+  if(threads < 1)
+    threads = 1;
+
+  struct pool *p = (struct pool *) calloc(1, sizeof(struct pool));
+  if(!p)
+    return NULL;
+
+  p->threads = threads;
+  p->next.store(0);
+  pthread_mutex_init(&p->run_lock, NULL);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->done, NULL);
+
+  p->thread_ids = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+  if(!p->thread_ids) {
+    p->threads = 1;
+    pool_destroy(p);
+    return NULL;
+  }
+  for(int i = 1; i < threads; i++) {
+    struct worker_arg *wa = (struct worker_arg *) malloc(sizeof(struct worker_arg));
+    if(!wa) {
+      // stop the workers already running
+      p->threads = i;
+      pool_destroy(p);
+      return NULL;
+    }
+    wa->p = p;
+    wa->worker = i;
+    if(pthread_create(&p->thread_ids[i], NULL, pool_worker, (void *) wa)) {
+      fprintf(stderr, "pool: unable to start worker %d\n", i);
+      free(wa);
+      p->threads = i;
+      break;
+    }
+  }
+  return p;
+}
+
+void pool_destroy(struct pool *p) {
+  if(!p)
+    return;
+
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = true;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+
+  for(int i = 1; i < p->threads; i++) {
+    pthread_join(p->thread_ids[i], NULL);
+  }
+
+  pthread_cond_destroy(&p->wake);
+  pthread_cond_destroy(&p->done);
+  pthread_mutex_destroy(&p->lock);
+  pthread_mutex_destroy(&p->run_lock);
+  free(p->thread_ids);
+  free(p);
+}
+
+int pool_size(const struct pool *p) {
+  return p->threads;
+}
+
+void pool_run(struct pool *p, pool_task_fn fn, void *arg, int ntasks) {
+  if(ntasks <= 0)
+    return;
+
+  pthread_mutex_lock(&p->run_lock);
+
+  // nothing to share out: skip the wake-up round trip
+  if(ntasks == 1 || p->threads == 1) {
+    for(int task = 0; task < ntasks; task++)
+      fn(arg, task, 0);
+    pthread_mutex_unlock(&p->run_lock);
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->fn = fn;
+  p->arg = arg;
+  p->ntasks = ntasks;
+  p->next.store(0, std::memory_order_relaxed);
+  p->busy = p->threads - 1;
+  p->generation++;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+
+  drain(p, 0);
+
+  pthread_mutex_lock(&p->lock);
+  while(p->busy > 0)
+    pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+
+  pthread_mutex_unlock(&p->run_lock);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+/* Persistent worker pool shared by libhisto and the histo driver.
+
+   pool_run() hands out task indices 0..ntasks-1 to the workers and returns
+   once all of them have finished.  The calling thread takes part as worker 0,
+   so a pool of size 1 has no helper threads at all.  Runs on one pool are
+   serialized; concurrent callers simply queue up behind each other. */
+
+typedef void (*pool_task_fn)(void *arg, int task, int worker);
+
+struct pool;
+
+struct pool *pool_create(int threads);
+void pool_destroy(struct pool *p);
+int pool_size(const struct pool *p);
+void pool_run(struct pool *p, pool_task_fn fn, void *arg, int ntasks);
+
+/* The pool behind libhisto, started on first use.  Tasks running on it must
+   call histo_compute with HISTO_SINGLE_THREAD. */
+struct pool *histo_shared_pool(void);
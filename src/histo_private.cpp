@@ -4,6 +4,8 @@
 #include <cassert>
 #include <pthread.h>
 #include "Timer.h"
+#include "histo_trace.h"
+#include "histo_emit.h"
 
 extern "C" {
 #include "ppmb_io.h"
@@ -18,13 +20,6 @@ struct img {
   unsigned char *b;
 };
 
-void print_histogram(FILE *f, int *hist, int N) {
-  fprintf(f, "%d\n", N+1);
-  for(int i = 0; i <= N; i++) {
-    fprintf(f, "%d %d\n", i, hist[i]);
-  }
-}
-
 struct index {
   struct img *input;
   int *hist_r;
@@ -42,6 +37,7 @@ void* private_histogram(void *thread) {
   int *hist_b = idx->hist_b;
   int start = idx->start;
   int end = idx->end;
+  ggc::Phase count("count");
 
   for(int pix = start; pix < end; pix++) {
     hist_r[input->r[pix]] += 1;
@@ -52,8 +48,8 @@ void* private_histogram(void *thread) {
 }
 
 int main(int argc, char *argv[]) {
-  if(argc != 4) {
-    printf("Usage: %s input-file output-file threads\n", argv[0]);
+  if(argc < 4 || !ggc::trace.parse(argc, argv, 4)) {
+    printf("Usage: %s input-file output-file threads [--phases] [--counters] [--memory] [--trace file.json]\n", argv[0]);
     printf("       For single-threaded runs, pass threads = 1\n");
     exit(1);
   }
@@ -64,8 +60,11 @@ int main(int argc, char *argv[]) {
 
   struct img input;
 
+  ggc::Phase load("load");
   if(!ppmb_read(input_file, &input.xsize, &input.ysize, &input.maxrgb, 
 		&input.r, &input.g, &input.b)) {
+    load.end();
+    ggc::trace.pixels = (long long) input.xsize * input.ysize;
     if(input.maxrgb > 255) {
       printf("Maxrgb %d not supported\n", input.maxrgb);
       exit(1);
@@ -73,13 +72,17 @@ int main(int argc, char *argv[]) {
 
     int *hist_r, *hist_g, *hist_b;
 
+    ggc::Phase alloc("alloc");
     hist_r = (int *) calloc(input.maxrgb+1, sizeof(int));
     hist_g = (int *) calloc(input.maxrgb+1, sizeof(int));
     hist_b = (int *) calloc(input.maxrgb+1, sizeof(int));
+    alloc.end();
 
     ggc::Timer t("histogram");
+    ggc::Phase phase("histogram");
     t.start();
 
+    ggc::Phase alloc_private("alloc");
     int **private_hist_r = (int **) malloc(threads * sizeof(int *));
     int **private_hist_g = (int **) malloc(threads * sizeof(int *));
     int **private_hist_b = (int **) malloc(threads * sizeof(int *));
@@ -88,7 +91,9 @@ int main(int argc, char *argv[]) {
       private_hist_g[i] = (int *) calloc(input.maxrgb+1, sizeof(int));
       private_hist_b[i] = (int *) calloc(input.maxrgb+1, sizeof(int));
     }
+    alloc_private.end();
 
+    ggc::Phase spawn("spawn");
     pthread_t thread_ids[threads];
     struct index *idx = (struct index *) malloc(sizeof(struct index) * threads);
     int N = input.xsize * input.ysize;
@@ -102,11 +107,15 @@ int main(int argc, char *argv[]) {
       idx[i].end = N*(i+1)/threads;
       pthread_create(&thread_ids[i], NULL, private_histogram, (void *) (idx+i));
     }
+    spawn.end();
     
+    ggc::Phase join("join");
     for (int i = 0; i < threads; i++) {
       pthread_join(thread_ids[i], NULL);
     }
+    join.end();
     
+    ggc::Phase merge("merge");
     for (int i = 0; i < threads; i++) {
       for (int j = 0; j <= input.maxrgb; j++) {
         hist_r[j] += private_hist_r[i][j];
@@ -114,20 +123,18 @@ int main(int argc, char *argv[]) {
         hist_b[j] += private_hist_b[i][j];
       }
     }
+    merge.end();
     
     t.stop();
+    phase.end();
 
-    FILE *out = fopen(output_file, "w");
-    if(out) {
-      print_histogram(out, hist_r, input.maxrgb);
-      print_histogram(out, hist_g, input.maxrgb);
-      print_histogram(out, hist_b, input. maxrgb);
-      fclose(out);
-    } else {
+    ggc::Phase emit("emit");
+    if(ggc::write_histogram_file(output_file, hist_r, hist_g, hist_b, input.maxrgb))
       fprintf(stderr, "Unable to output!\n");
-    }
+    emit.end();
     
     printf("Time: %llu ns\n", t.duration());
+    ggc::trace.report(stdout);
     
     for(int i = 0; i < threads; i++) {
       free(private_hist_r[i]);
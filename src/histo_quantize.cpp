@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_pool.h"
+
+/* --quantize: reduce an image to --colors colors.  Median cut runs over the
+   occupied cells of the joint histogram (histo_joint_compute at --bits per
+   channel) rather than over pixels, so the palette costs the same for any
+   image size.  Every occupied cell of the color cube then gets its nearest
+   palette entry in a lookup table, and the pixels are mapped through it in
+   row bands on the shared pool. */
+
+struct box {
+  size_t begin, end;          // cells[begin..end)
+  int lo[3], hi[3];           // bounds in cell units
+  uint64_t count;             // pixels
+};
+
+struct quantize {
+  const struct img *input;
+  int bits;
+  int colors;
+  unsigned char palette[HISTO_BINS][3];
+  const uint32_t *cells;      // occupied cells, for the table
+  size_t entries;
+  unsigned char *lut;         // cell -> palette index, 2^(3 bits) entries
+  unsigned char *out;         // interleaved output pixels
+  int slices;
+  int bands;
+  uint64_t *error;            // per band: squared error
+};
+
+static inline int cell_channel(uint32_t cell, int c, int bits) {
+  return (int) (cell >> ((2 - c) * bits)) & ((1 << bits) - 1);
+}
+
+// the 8-bit value in the middle of a cell
+static inline int cell_center(int v, int bits) {
+  int shift = 8 - bits;
+  return (v << shift) | (shift ? 1 << (shift - 1) : 0);
+}
+
+static void shrink_box(struct box *b, const uint32_t *cells, const uint64_t *counts, int bits) {
+  for(int c = 0; c < 3; c++) {
+    b->lo[c] = 1 << bits;
+    b->hi[c] = -1;
+  }
+  b->count = 0;
+  for(size_t i = b->begin; i < b->end; i++) {
+    for(int c = 0; c < 3; c++) {
+      int v = cell_channel(cells[i], c, bits);
+      if(v < b->lo[c])
+        b->lo[c] = v;
+      if(v > b->hi[c])
+        b->hi[c] = v;
+    }
+    b->count += counts[i];
+  }
+}
+
+static int longest_axis(const struct box *b) {
+  int axis = 0;
+  for(int c = 1; c < 3; c++) {
+    if(b->hi[c] - b->lo[c] > b->hi[axis] - b->lo[axis])
+      axis = c;
+  }
+  return axis;
+}
+
+/* Sort the cells of b along its longest axis (a counting sort, the axis
+   has at most 256 values) and cut where half its pixels fall on each side.
+   Both halves keep at least one cell. */
+static void split_box(struct box *b, struct box *right, uint32_t *cells, uint64_t *counts,
+                      uint32_t *cell_tmp, uint64_t *count_tmp, int bits) {
+  int axis = longest_axis(b);
+  size_t start[HISTO_BINS + 1];
+  memset(start, 0, sizeof(start));
+  for(size_t i = b->begin; i < b->end; i++)
+    start[cell_channel(cells[i], axis, bits) + 1]++;
+  for(int v = 0; v < HISTO_BINS; v++)
+    start[v + 1] += start[v];
+  for(size_t i = b->begin; i < b->end; i++) {
+    size_t j = start[cell_channel(cells[i], axis, bits)]++;
+    cell_tmp[j] = cells[i];
+    count_tmp[j] = counts[i];
+  }
+  size_t n = b->end - b->begin;
+  memcpy(cells + b->begin, cell_tmp, sizeof(uint32_t) * n);
+  memcpy(counts + b->begin, count_tmp, sizeof(uint64_t) * n);
+
+  uint64_t below = 0;
+  size_t cut = b->begin + 1;
+  while(cut < b->end - 1 && (below += counts[cut - 1]) * 2 < b->count)
+    cut++;
+
+  right->begin = cut;
+  right->end = b->end;
+  b->end = cut;
+  shrink_box(b, cells, counts, bits);
+  shrink_box(right, cells, counts, bits);
+}
+
+// Median cut into at most q->colors boxes; returns how many there are.
+static int median_cut(struct quantize *q, uint32_t *cells, uint64_t *counts, size_t entries) {
+  struct box *boxes = (struct box *) malloc(sizeof(struct box) * q->colors);
+  uint32_t *cell_tmp = (uint32_t *) malloc(sizeof(uint32_t) * entries);
+  uint64_t *count_tmp = (uint64_t *) malloc(sizeof(uint64_t) * entries);
+  if(!boxes || !cell_tmp || !count_tmp) {
+    free(boxes);
+    free(cell_tmp);
+    free(count_tmp);
+    return 0;
+  }
+
+  int n = 1;
+  boxes[0].begin = 0;
+  boxes[0].end = entries;
+  shrink_box(&boxes[0], cells, counts, q->bits);
+  while(n < q->colors) {
+    // the most pixels over the widest range goes first
+    int best = -1;
+    double best_score = 0;
+    for(int i = 0; i < n; i++) {
+      if(boxes[i].end - boxes[i].begin < 2)
+        continue;
+      int axis = longest_axis(&boxes[i]);
+      double score = (double) boxes[i].count * (boxes[i].hi[axis] - boxes[i].lo[axis]);
+      if(best < 0 || score > best_score) {
+        best = i;
+        best_score = score;
+      }
+    }
+    if(best < 0)
+      break;
+    split_box(&boxes[best], &boxes[n++], cells, counts, cell_tmp, count_tmp, q->bits);
+  }
+
+  // each color is the pixel-weighted mean of its box
+  int maxrgb = q->input->maxrgb;
+  for(int i = 0; i < n; i++) {
+    uint64_t sum[3] = { 0, 0, 0 };
+    for(size_t j = boxes[i].begin; j < boxes[i].end; j++) {
+      for(int c = 0; c < 3; c++)
+        sum[c] += counts[j] * cell_center(cell_channel(cells[j], c, q->bits), q->bits);
+    }
+    for(int c = 0; c < 3; c++) {
+      uint64_t v = boxes[i].count ? (sum[c] + boxes[i].count / 2) / boxes[i].count : 0;
+      q->palette[i][c] = (unsigned char) (v > (uint64_t) maxrgb ? maxrgb : v);
+    }
+  }
+
+  free(boxes);
+  free(cell_tmp);
+  free(count_tmp);
+  return n;
+}
+
+// Nearest palette entry for a slice of the occupied cells.
+static void lut_task(void *arg, int task, int worker) {
+  struct quantize *q = (struct quantize *) arg;
+  size_t i0 = q->entries * task / q->slices;
+  size_t i1 = q->entries * (task + 1) / q->slices;
+
+  for(size_t i = i0; i < i1; i++) {
+    uint32_t cell = q->cells[i];
+    int r = cell_center(cell_channel(cell, 0, q->bits), q->bits);
+    int g = cell_center(cell_channel(cell, 1, q->bits), q->bits);
+    int b = cell_center(cell_channel(cell, 2, q->bits), q->bits);
+    int best = 0, best_dist = 1 << 30;
+    for(int k = 0; k < q->colors; k++) {
+      int dr = r - q->palette[k][0], dg = g - q->palette[k][1], db = b - q->palette[k][2];
+      int dist = dr * dr + dg * dg + db * db;
+      if(dist < best_dist) {
+        best = k;
+        best_dist = dist;
+      }
+    }
+    q->lut[cell] = (unsigned char) best;
+  }
+}
+
+static void map_task(void *arg, int task, int worker) {
+  struct quantize *q = (struct quantize *) arg;
+  const struct img *in = q->input;
+  int w = in->xsize;
+  size_t p0 = (size_t) w * (int) ((long long) in->ysize * task / q->bands);
+  size_t p1 = (size_t) w * (int) ((long long) in->ysize * (task + 1) / q->bands);
+  int bits = q->bits, shift = 8 - bits;
+  uint64_t error = 0;
+
+  for(size_t i = p0; i < p1; i++) {
+    int r = in->r[i], g = in->g[i], b = in->b[i];
+    uint32_t cell = (uint32_t) (r >> shift) << (2 * bits) |
+                    (uint32_t) (g >> shift) << bits | (uint32_t) (b >> shift);
+    const unsigned char *color = q->palette[q->lut[cell]];
+    unsigned char *dst = q->out + 3 * i;
+    dst[0] = color[0];
+    dst[1] = color[1];
+    dst[2] = color[2];
+    int dr = r - color[0], dg = g - color[1], db = b - color[2];
+    error += dr * dr + dg * dg + db * db;
+  }
+  q->error[task] = error;
+}
+
+int run_quantize(const char *input_file, const char *output_file,
+                 const struct options *opt) {
+  struct img input;
+  size_t capacity = 0;
+  memset(&input, 0, sizeof(input));
+
+  ggc::Timer t("quantize"), load("load"), hist("histogram"), cut("median cut"),
+    table("table"), map("map"), write("write");
+
+  t.start();
+  load.start();
+  if(load_ppm(input_file, &input, &capacity))
+    return 1;
+  load.stop();
+
+  struct pool *p = histo_shared_pool();
+  int workers = pool_size(p);
+  size_t pixels = (size_t) input.xsize * input.ysize;
+
+  struct quantize q;
+  memset(&q, 0, sizeof(q));
+  q.input = &input;
+  q.bits = opt->joint_bits;
+  q.colors = opt->colors;
+  q.bands = workers * 4 < input.ysize ? workers * 4 : input.ysize;
+
+  histo_image image;
+  histo_image_planar(&image, input.xsize, input.ysize,
+                     input.r, input.g, input.b, input.xsize);
+  histo_joint *h = NULL;
+  hist.start();
+  int err = histo_joint_compute(&image, NULL, q.bits, &h);
+  hist.stop();
+  if(err) {
+    fprintf(stderr, "Cannot compute the joint histogram: %s\n", histo_strerror(err));
+    free_img(&input);
+    return 1;
+  }
+
+  size_t entries = histo_joint_entries(h);
+  uint32_t *cells = (uint32_t *) malloc(sizeof(uint32_t) * entries);
+  uint64_t *counts = (uint64_t *) malloc(sizeof(uint64_t) * entries);
+  q.lut = (unsigned char *) malloc((size_t) 1 << (3 * q.bits));
+  q.out = (unsigned char *) malloc(pixels * 3);
+  q.error = (uint64_t *) calloc(q.bands, sizeof(uint64_t));
+  bool failed = !cells || !counts || !q.lut || !q.out || !q.error;
+
+  if(!failed) {
+    histo_joint_list(h, cells, counts, entries);
+    cut.start();
+    q.colors = median_cut(&q, cells, counts, entries);
+    cut.stop();
+    failed = q.colors == 0;
+  }
+  if(failed) {
+    fprintf(stderr, "Unable to allocate memory for %s.\n", output_file);
+  } else {
+    // median cut reordered cells; any order will do for the table
+    q.cells = cells;
+    q.entries = entries;
+    q.slices = workers * 4;
+    table.start();
+    pool_run(p, lut_task, &q, q.slices);
+    table.stop();
+
+    map.start();
+    pool_run(p, map_task, &q, q.bands);
+    map.stop();
+
+    write.start();
+    failed = write_ppm(output_file, input.xsize, input.ysize, input.maxrgb, q.out);
+    write.stop();
+  }
+  t.stop();
+
+  if(!failed) {
+    uint64_t error = 0;
+    for(int i = 0; i < q.bands; i++)
+      error += q.error[i];
+    printf("Quantized: %s (%dx%d, %d colors from %zu cells at %d bits)\n", output_file,
+           input.xsize, input.ysize, q.colors, entries, q.bits);
+    printf("Threads: %d\n", workers);
+    printf("Error: %.3f mean squared per channel\n",
+           pixels ? (double) error / (pixels * 3) : 0.0);
+    printf("Time: %llu ns\n", t.duration());
+    printf("  load      %10.3f ms\n", load.duration() / 1e6);
+    printf("  histogram %10.3f ms\n", hist.duration() / 1e6);
+    printf("  palette   %10.3f ms\n", cut.duration() / 1e6);
+    printf("  table     %10.3f ms\n", table.duration() / 1e6);
+    printf("  map       %10.3f ms (%.1f Mpixels/s)\n", map.duration() / 1e6,
+           pixels * 1e3 / (map.duration() ? map.duration() : 1));
+    printf("  write     %10.3f ms\n", write.duration() / 1e6);
+  }
+
+  free(cells);
+  free(counts);
+  free(q.lut);
+  free(q.out);
+  free(q.error);
+  histo_joint_free(h);
+  free_img(&input);
+  return failed ? 1 : 0;
+}
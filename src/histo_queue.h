@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <sched.h>
+#include "Timer.h"
+
+/* Bounded lock-free multi-producer/multi-consumer queue of pointers
+   (Vyukov's sequence-numbered ring).  With one producer and one consumer it
+   degenerates into a plain SPSC ring, so the pipeline uses it everywhere. */
+class MPMCQueue {
+  struct cell {
+    std::atomic<size_t> seq;
+    void *data;
+  };
+
+  cell *cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+  char padding[64 - sizeof(std::atomic<size_t>)];
+
+public:
+  // capacity is rounded up to a power of two; check ok() before use
+  MPMCQueue(size_t capacity) : head(0), tail(0) {
+    size_t n = 2;
+    while(n < capacity)
+      n <<= 1;
+    mask = n - 1;
+    cells = static_cast<cell *>(calloc(n, sizeof(cell)));
+    for(size_t i = 0; cells && i < n; i++)
+      new (&cells[i].seq) std::atomic<size_t>(i);
+  }
+
+  ~MPMCQueue() {
+    free(cells);
+  }
+
+  // False if the ring could not be allocated.
+  bool ok() const {
+    return cells != NULL;
+  }
+
+  bool try_push(void *data) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    for(;;) {
+      cell *c = &cells[pos & mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      long diff = (long) seq - (long) pos;
+      if(diff == 0) {
+        if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if(diff < 0) {
+        return false;   // full
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    cells[pos & mask].data = data;
+    cells[pos & mask].seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(void **data) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    for(;;) {
+      cell *c = &cells[pos & mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      long diff = (long) seq - (long) (pos + 1);
+      if(diff == 0) {
+        if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if(diff < 0) {
+        return false;   // empty
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+    *data = cells[pos & mask].data;
+    cells[pos & mask].seq.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Blocking variants.  Time spent waiting is added to stall.
+  void push(void *data, ggc::Timer &stall) {
+    if(try_push(data))
+      return;
+    stall.start();
+    for(int spins = 0; !try_push(data); spins++)
+      backoff(spins);
+    stall.stop();
+  }
+
+  void *pop(ggc::Timer &stall) {
+    void *data;
+    if(try_pop(&data))
+      return data;
+    stall.start();
+    for(int spins = 0; !try_pop(&data); spins++)
+      backoff(spins);
+    stall.stop();
+    return data;
+  }
+
+private:
+  static void backoff(int spins) {
+    if(spins < 64) {
+      #if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+      #elif defined(__aarch64__)
+      __asm__ __volatile__("yield");
+      #endif
+    } else {
+      sched_yield();
+    }
+  }
+};
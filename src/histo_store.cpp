@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_store.h"
+
+#define STORE_NAME_MAX 4095
+
+uint64_t store_key(const char *name) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(; *name; name++)
+    h = (h ^ (unsigned char) *name) * 0x100000001b3ULL;
+  return h;
+}
+
+// CRC-32 (IEEE, as zlib's crc32) of n bytes continuing from crc, a nibble at a time.
+static uint32_t store_crc(uint32_t crc, const unsigned char *p, size_t n) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+  };
+  uint32_t c = crc ^ 0xffffffffu;
+  for(size_t i = 0; i < n; i++) {
+    c ^= p[i];
+    c = table[c & 15] ^ (c >> 4);
+    c = table[c & 15] ^ (c >> 4);
+  }
+  return c ^ 0xffffffffu;
+}
+
+static void store_header_init(struct store_header *h) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, STORE_MAGIC, 8);
+  h->version = STORE_VERSION;
+  h->header_size = sizeof(*h);
+  h->bins = HISTO_BINS;
+}
+
+static bool store_header_ok(const struct store_header *h) {
+  return memcmp(h->magic, STORE_MAGIC, 8) == 0 && h->version == STORE_VERSION &&
+         h->header_size >= sizeof(*h) && h->header_size % 8 == 0 && h->bins == HISTO_BINS;
+}
+
+int store_open_append(const char *path) {
+  /* The header goes into a temporary file that is linked into place, so
+     a concurrent opener finds either no store or one with its header. */
+  char tmp[STORE_NAME_MAX + 16];
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if(fd < 0) {
+    fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct store_header h;
+  store_header_init(&h);
+  bool failed = write(fd, &h, sizeof(h)) != (ssize_t) sizeof(h) ||
+                fchmod(fd, 0644) || fcntl(fd, F_SETFL, O_APPEND);
+  int linked = failed ? -1 : link(tmp, path);
+  int link_errno = errno;
+  unlink(tmp);
+  if(linked == 0)
+    return fd;
+  close(fd);
+  if(failed || link_errno != EEXIST) {
+    fprintf(stderr, "Unable to create %s: %s\n", path, strerror(link_errno));
+    return -1;
+  }
+
+  // it exists: append after its header
+  fd = open(path, O_RDWR | O_APPEND);
+  if(fd < 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h) || !store_header_ok(&h)) {
+    fprintf(stderr, "%s is not a histogram store\n", path);
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool store_append(int fd, const char *name, const uint64_t *const *hists,
+                  const int *channels, int nchannels, int maxrgb) {
+  size_t name_len = strlen(name);
+  if(nchannels < 1 || nchannels > 3 || name_len > STORE_NAME_MAX)
+    return true;
+
+  int width = 4;
+  for(int c = 0; c < nchannels; c++) {
+    for(int i = 0; i < HISTO_BINS; i++) {
+      if(hists[c][i] > 0xffffffffULL)
+        width = 8;
+    }
+  }
+  size_t bins = (size_t) nchannels * HISTO_BINS * width;
+  size_t size = (sizeof(struct store_record) + bins + name_len + 1 + 7) & ~(size_t) 7;
+  unsigned char buf[sizeof(struct store_record) + 3 * HISTO_BINS * 8 + STORE_NAME_MAX + 8];
+  memset(buf, 0, size);
+
+  struct store_record *r = (struct store_record *) buf;
+  r->magic = STORE_RECORD_MAGIC;
+  r->key = store_key(name);
+  r->size = (uint32_t) size;
+  r->name_len = (uint16_t) name_len;
+  r->nchannels = (uint8_t) nchannels;
+  r->width = (uint8_t) width;
+  for(int c = 0; c < nchannels; c++)
+    r->channels[c] = (uint8_t) channels[c];
+  r->maxrgb = (uint16_t) maxrgb;
+  for(int c = 0; c < nchannels; c++) {
+    for(int i = 0; i < HISTO_BINS; i++) {
+      if(width == 4)
+        ((uint32_t *) (r + 1))[c * HISTO_BINS + i] = (uint32_t) hists[c][i];
+      else
+        ((uint64_t *) (r + 1))[c * HISTO_BINS + i] = hists[c][i];
+    }
+  }
+  memcpy(buf + sizeof(*r) + bins, name, name_len);
+  r->crc = store_crc(0, buf, size);
+
+  return write(fd, buf, size) != (ssize_t) size;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const struct store_entry *x = (const struct store_entry *) a;
+  const struct store_entry *y = (const struct store_entry *) b;
+  if(x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->record < y->record ? -1 : x->record > y->record;
+}
+
+/* A whole record starts at p, within the avail bytes left in the file.
+   p need not be aligned; its header is copied to *r. */
+static bool record_ok(const unsigned char *p, size_t avail, struct store_record *r) {
+  memcpy(r, p, sizeof(*r));
+  if(r->magic != STORE_RECORD_MAGIC || r->size % 8 || r->size > avail ||
+     r->nchannels < 1 || r->nchannels > 3 || (r->width != 4 && r->width != 8))
+    return false;
+  size_t need = sizeof(*r) + (size_t) r->nchannels * HISTO_BINS * r->width + r->name_len + 1;
+  if(r->size < need || p[need - 1] != '\0')
+    return false;
+  struct store_record head = *r;
+  head.crc = 0;
+  uint32_t crc = store_crc(0, (const unsigned char *) &head, sizeof(head));
+  return store_crc(crc, p + sizeof(head), r->size - sizeof(head)) == r->crc;
+}
+
+bool store_open(const char *path, struct store *s) {
+  memset(s, 0, sizeof(*s));
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) || (size_t) st.st_size < sizeof(struct store_header)) {
+    fprintf(stderr, "Unable to read store %s\n", path);
+    if(fd >= 0)
+      close(fd);
+    return true;
+  }
+  s->size = st.st_size;
+  void *map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    fprintf(stderr, "Unable to map store %s\n", path);
+    return true;
+  }
+  s->map = (const unsigned char *) map;
+  const struct store_header *h = (const struct store_header *) s->map;
+  if(!store_header_ok(h)) {
+    fprintf(stderr, "%s is not a histogram store\n", path);
+    store_close(s);
+    return true;
+  }
+
+  /* One pass to count, one to fill.  A record that is not whole (torn by
+     a crash, or still being written) is skipped a byte at a time until
+     the next one that is.  A torn record need not end on a word, so
+     records appended after it may be unaligned: those are copied out. */
+  size_t copied = 0;
+  for(int pass = 0; pass < 2; pass++) {
+    int n = 0;
+    size_t pos = h->header_size;
+    s->skipped = 0;
+    copied = 0;
+    while(pos + sizeof(struct store_record) <= s->size) {
+      struct store_record head;
+      if(!record_ok(s->map + pos, s->size - pos, &head)) {
+        pos++;
+        s->skipped++;
+        continue;
+      }
+      const struct store_record *r = (const struct store_record *) (s->map + pos);
+      if(pos % 8) {
+        r = (const struct store_record *) (s->copies + copied);
+        if(pass == 1)
+          memcpy(s->copies + copied, s->map + pos, head.size);
+        copied += head.size;
+      }
+      if(pass == 1) {
+        s->records[n] = r;
+        s->index[n].key = r->key;
+        s->index[n].record = r;
+      }
+      n++;
+      pos += head.size;
+    }
+    if(pass == 0) {
+      s->count = n;
+      s->records = (const struct store_record **) malloc(sizeof(*s->records) * (n ? n : 1));
+      s->index = (struct store_entry *) malloc(sizeof(*s->index) * (n ? n : 1));
+      s->copies = copied ? (unsigned char *) malloc(copied) : NULL;
+      if(!s->records || !s->index || (copied && !s->copies)) {
+        store_close(s);
+        return true;
+      }
+    }
+  }
+  if(s->skipped)
+    fprintf(stderr, "%s: skipped %zu bytes of torn or damaged records\n", path, s->skipped);
+  qsort(s->index, s->count, sizeof(*s->index), compare_entries);
+  return false;
+}
+
+void store_close(struct store *s) {
+  if(s->map)
+    munmap((void *) s->map, s->size);
+  free(s->records);
+  free(s->index);
+  free(s->copies);
+  memset(s, 0, sizeof(*s));
+}
+
+const struct store_record *store_find(const struct store *s, const char *name) {
+  uint64_t key = store_key(name);
+  int lo = 0, hi = s->count;
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(s->index[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // entries with one key are in file order; the last match wins
+  const struct store_record *found = NULL;
+  for(int i = lo; i < s->count && s->index[i].key == key; i++) {
+    if(strcmp(store_name(s->index[i].record), name) == 0)
+      found = s->index[i].record;
+  }
+  return found;
+}
+
+void store_hist(const struct store_record *r, int c, uint64_t *hist) {
+  for(int i = 0; i < HISTO_BINS; i++)
+    hist[i] = store_bin(r, c, i);
+}
+
+/* Text .hist files: blocks of "N" and N lines of "bin count", one block
+   per channel, three to an image.  Combined files put "# path" before
+   each image; "# stats" lines are skipped. */
+struct text_image {
+  char name[STORE_NAME_MAX + 1];
+  uint64_t hists[3][HISTO_BINS];
+  int nchannels;
+  int maxrgb;
+};
+
+// Reads the next image; false at the end of the file or on bad input.
+static bool read_text_image(FILE *f, struct text_image *img, const char *default_name,
+                            bool *bad) {
+  char line[STORE_NAME_MAX + 16];
+  img->nchannels = 0;
+  img->maxrgb = 0;
+  memset(img->hists, 0, sizeof(img->hists));
+  snprintf(img->name, sizeof(img->name), "%s", default_name);
+  long before = ftell(f);
+  while(fgets(line, sizeof(line), f)) {
+    if(strncmp(line, "# stats", 7) == 0) {
+      before = ftell(f);
+      continue;
+    }
+    if(line[0] == '#') {
+      if(img->nchannels > 0) {
+        fseek(f, before, SEEK_SET);     // the next image's name
+        return true;
+      }
+      size_t len = strcspn(line + 2, "\r\n");
+      snprintf(img->name, sizeof(img->name), "%.*s", (int) len, line + 2);
+      before = ftell(f);
+      continue;
+    }
+    int n;
+    if(sscanf(line, "%d", &n) != 1 || n < 1 || n > HISTO_BINS || img->nchannels == 3) {
+      *bad = true;
+      return false;
+    }
+    uint64_t *hist = img->hists[img->nchannels];
+    for(int i = 0; i < n; i++) {
+      int bin;
+      unsigned long long count;
+      if(!fgets(line, sizeof(line), f) || sscanf(line, "%d %llu", &bin, &count) != 2 ||
+         bin < 0 || bin >= HISTO_BINS) {
+        *bad = true;
+        return false;
+      }
+      hist[bin] = count;
+    }
+    if(img->nchannels == 0)
+      img->maxrgb = n - 1;
+    img->nchannels++;
+    before = ftell(f);
+  }
+  return img->nchannels > 0;
+}
+
+int run_hist2store(const char *text_file, const char *store_file) {
+  FILE *f = fopen(text_file, "r");
+  if(!f) {
+    fprintf(stderr, "Cannot open the input file %s.\n", text_file);
+    return 1;
+  }
+  int fd = store_open_append(store_file);
+  if(fd < 0) {
+    fclose(f);
+    return 1;
+  }
+
+  // a plain .hist is one image, named after the file without .hist
+  char base[STORE_NAME_MAX + 1];
+  size_t len = strlen(text_file);
+  if(len > 5 && strcmp(text_file + len - 5, ".hist") == 0)
+    len -= 5;
+  snprintf(base, sizeof(base), "%.*s", (int) len, text_file);
+
+  struct text_image *img = (struct text_image *) malloc(sizeof(struct text_image));
+  static const int rgb[3] = { HISTO_CHANNEL_R, HISTO_CHANNEL_G, HISTO_CHANNEL_B };
+  ggc::Timer t("hist2store");
+  int records = 0;
+  bool bad = false, failed = false;
+  t.start();
+  while(!failed && read_text_image(f, img, base, &bad)) {
+    const uint64_t *hists[3] = { img->hists[0], img->hists[1], img->hists[2] };
+    failed = store_append(fd, img->name, hists, rgb, img->nchannels, img->maxrgb);
+    records++;
+  }
+  t.stop();
+  fclose(f);
+  close(fd);
+  free(img);
+
+  if(bad)
+    fprintf(stderr, "%s: not a .hist file after %d images\n", text_file, records);
+  if(failed)
+    fprintf(stderr, "Failed appending to %s\n", store_file);
+  printf("Records: %d\n", records);
+  printf("Time: %llu ns\n", t.duration());
+  return bad || failed ? 1 : 0;
+}
+
+static void write_record(FILE *out, const struct store_record *r, bool named,
+                         const struct options *opt) {
+  uint64_t hists[3][HISTO_BINS];
+  struct options copy = *opt;
+  memset(hists, 0, sizeof(hists));
+  copy.nchannels = r->nchannels;
+  for(int c = 0; c < r->nchannels; c++) {
+    copy.channels[c] = r->channels[c];
+    store_hist(r, c, hists[c]);
+  }
+  if(named)
+    fprintf(out, "# %s\n", store_name(r));
+  write_histograms(out, hists[0], hists[1], hists[2], r->maxrgb, &copy);
+  write_stats(out, hists[0], hists[1], hists[2], &copy);
+}
+
+int run_store2hist(const char *store_file, const char *text_file, const char *key,
+                   const struct options *opt) {
+  struct store s;
+  ggc::Timer t("store2hist");
+  t.start();
+  if(store_open(store_file, &s))
+    return 1;
+  FILE *out = fopen(text_file, "w");
+  if(!out) {
+    fprintf(stderr, "Unable to output %s!\n", text_file);
+    store_close(&s);
+    return 1;
+  }
+
+  int rv = 0, written = 0;
+  if(key) {
+    // one image, as a plain .hist
+    const struct store_record *r = store_find(&s, key);
+    if(r) {
+      write_record(out, r, false, opt);
+      written++;
+    } else {
+      fprintf(stderr, "%s is not in %s\n", key, store_file);
+      rv = 1;
+    }
+  } else {
+    for(int i = 0; i < s.count; i++)
+      write_record(out, s.records[i], true, opt);
+    written = s.count;
+  }
+  if(fclose(out)) {
+    fprintf(stderr, "Failed writing %s.\n", text_file);
+    rv = 1;
+  }
+  t.stop();
+
+  printf("Records: %d of %d, %.1f MB\n", written, s.count, s.size / 1048576.0);
+  printf("Time: %llu ns\n", t.duration());
+  store_close(&s);
+  return rv;
+}
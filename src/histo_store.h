@@ -0,0 +1,105 @@
+#pragma once
+
+/* Binary histogram store: many histograms in one append-only file that
+   readers mmap and use in place.
+
+   The file is a 32-byte header and then records, each a whole number of
+   8-byte words:
+
+     magic      STORE_RECORD_MAGIC
+     crc        CRC-32 of the whole record, taken with crc = 0
+     key        FNV-1a 64 of the name (the image path)
+     size       bytes in the record, padding included
+     name_len
+     nchannels  1..3, with their HISTO_CHANNEL_* ids in channels[]
+     width      bytes per bin: 4 if every count fits, else 8
+     maxrgb
+     bins       nchannels x 256 counts of width bytes, host byte order
+     name       name_len bytes and a NUL, padded to 8
+
+   The creator writes the header to a temporary file and links it into
+   place, so nobody sees a store without one.  Writers build a record in
+   memory and append it with one write() on an O_APPEND descriptor, so any
+   number of threads or processes can add to the same store without
+   locking; the kernel serializes the appends.  Readers check the header,
+   step from record to record by size and sort (key, record) pairs for
+   lookups.  A record cut short by a crash fails its CRC even once later
+   appends follow it; readers skip it and resync on the next byte that
+   starts a whole record, copying the records it left unaligned.  Later records with the same name shadow
+   earlier ones. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STORE_MAGIC "HISTSTOR"
+#define STORE_VERSION 2
+#define STORE_RECORD_MAGIC 0x52545348u  // "HSTR"
+
+struct store_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t bins;                // HISTO_BINS
+  uint32_t reserved[3];
+};
+
+struct store_record {
+  uint32_t magic;
+  uint32_t crc;
+  uint64_t key;
+  uint32_t size;
+  uint16_t name_len;
+  uint8_t nchannels;
+  uint8_t width;
+  uint8_t channels[3];
+  uint8_t pad;
+  uint16_t maxrgb;
+  uint16_t reserved;
+};
+
+struct store_entry {
+  uint64_t key;
+  const struct store_record *record;
+};
+
+struct store {
+  const unsigned char *map;
+  size_t size;
+  int count;
+  size_t skipped;                       // bytes of torn or damaged records
+  unsigned char *copies;                // records a torn one left unaligned
+  const struct store_record **records;  // in file order
+  struct store_entry *index;            // sorted by key, then file order
+};
+
+uint64_t store_key(const char *name);
+
+/* Opens path for appending, creating it with its header if it does not
+   exist.  Returns the descriptor, or -1 with a message on stderr. */
+int store_open_append(const char *path);
+
+/* Appends the histograms of one image.  Safe to call from many threads
+   on one descriptor.  Returns true on failure. */
+bool store_append(int fd, const char *name, const uint64_t *const *hists,
+                  const int *channels, int nchannels, int maxrgb);
+
+/* Maps path and indexes its records.  Returns true on failure. */
+bool store_open(const char *path, struct store *s);
+void store_close(struct store *s);
+
+// The latest record named name, or NULL.
+const struct store_record *store_find(const struct store *s, const char *name);
+
+static inline const char *store_name(const struct store_record *r) {
+  return (const char *) (r + 1) + (size_t) r->nchannels * 256 * r->width;
+}
+
+// Bin i of channel c, read in place.
+static inline uint64_t store_bin(const struct store_record *r, int c, int i) {
+  const void *bins = (const void *) (r + 1);
+  size_t k = (size_t) c * 256 + i;
+  return r->width == 4 ? ((const uint32_t *) bins)[k] : ((const uint64_t *) bins)[k];
+}
+
+// Channel c widened into hist[256].
+void store_hist(const struct store_record *r, int c, uint64_t *hist);
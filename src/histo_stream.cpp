@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <atomic>
+#include <pthread.h>
+#include "Timer.h"
+#include "histo.h"
+#include "histo_queue.h"
+
+/* --stream: histogram a sequence of concatenated P6 frames, e.g. from
+   ffmpeg -f image2pipe -vcodec ppm.  The main thread parses frames into a
+   ring of recycled buffers, worker threads count several frames at once,
+   and an emitter thread puts the results back into frame order through a
+   reorder buffer before writing them. */
+
+struct frame {
+  long long seq;
+  struct img input;
+  unsigned char *data;          // interleaved pixels
+  size_t capacity;
+  unsigned long long arrived;   // data fully read
+  bool ok;                      // counted
+  uint64_t hist_r[HISTO_BINS];
+  uint64_t hist_g[HISTO_BINS];
+  uint64_t hist_b[HISTO_BINS];
+};
+
+struct stream {
+  int workers;
+  int depth;
+  FILE *out;
+
+  MPMCQueue *free_q;
+  MPMCQueue *work_q;
+  MPMCQueue *done_q;
+  struct frame end;
+  std::atomic<int> workers_left;
+
+  const struct options *opt;
+  long long changed;            // --delta: pixels updated
+  long long refreshed;          // --delta: frames counted in full
+
+  struct frame **pending;       // reorder buffer, indexed by seq % depth
+  unsigned long long *latency;  // per emitted frame
+  long long emitted;
+  long long failed;             // frames that could not be counted
+  long long latency_cap;
+};
+
+static unsigned long long now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCKTYPE, &t);
+  return t.tv_sec * NANOSEC + t.tv_nsec;
+}
+
+static bool header_field(FILE *in, int *value) {
+  int c;
+  for(;;) {
+    c = getc(in);
+    if(c == '#') {
+      while(c != EOF && c != '\n')
+        c = getc(in);
+    } else if(c == EOF || !isspace(c)) {
+      break;
+    }
+  }
+
+  long v = 0;
+  int digits = 0;
+  while(c != EOF && isdigit(c) && v < (1L << 30)) {
+    v = v * 10 + (c - '0');
+    digits++;
+    c = getc(in);
+  }
+  if(digits == 0 || c == EOF || !isspace(c))
+    return true;
+  *value = (int) v;
+  return false;
+}
+
+// Returns 1 for a frame header, 0 at a clean end of stream, -1 on error.
+static int read_frame_header(FILE *in, struct img *input) {
+  int c;
+  do {
+    c = getc(in);
+  } while(c != EOF && isspace(c));
+  if(c == EOF)
+    return 0;
+
+  if(c != 'P' || getc(in) != '6' ||
+     header_field(in, &input->xsize) || header_field(in, &input->ysize) ||
+     header_field(in, &input->maxrgb))
+    return -1;
+  if(input->xsize <= 0 || input->ysize <= 0 || input->maxrgb <= 0 || input->maxrgb > 255)
+    return -1;
+  return 1;
+}
+
+static void* stream_worker(void *thread) {
+  struct stream *s = (struct stream *) thread;
+  ggc::Timer wait("wait");
+
+  for(;;) {
+    struct frame *f = (struct frame *) s->work_q->pop(wait);
+    if(f == &s->end)
+      break;
+    histo_image image;
+    histo_image_interleaved(&image, f->input.xsize, f->input.ysize, f->data,
+                            (ptrdiff_t) f->input.xsize * 3, 3, 0, 1, 2);
+    int err = count_channels(&image, f->hist_r, f->hist_g, f->hist_b, HISTO_SINGLE_THREAD,
+                             s->opt);
+    f->ok = err >= 0;
+    if(!f->ok)
+      fprintf(stderr, "Unable to count frame %lld: %s\n", f->seq, histo_strerror(err));
+    s->done_q->push(f, wait);
+  }
+
+  if(s->workers_left.fetch_sub(1) == 1)
+    s->done_q->push(&s->end, wait);
+  return NULL;
+}
+
+static void* stream_delta_worker(void *thread) {
+  struct stream *s = (struct stream *) thread;
+  ggc::Timer wait("wait");
+  uint64_t hist_r[HISTO_BINS], hist_g[HISTO_BINS], hist_b[HISTO_BINS];
+  uint64_t *hists[3] = { hist_r, hist_g, hist_b };
+  unsigned char *ref = NULL;    // pixels of the previous frame
+  size_t ref_capacity = 0;
+  int ref_x = 0, ref_y = 0;
+  long long since_refresh = 0;
+  bool base_ok = false;         // hist_* hold the previous frame's counts
+
+  for(;;) {
+    struct frame *f = (struct frame *) s->work_q->pop(wait);
+    if(f == &s->end)
+      break;
+    int x = f->input.xsize, y = f->input.ysize;
+    histo_image image, previous;
+    histo_image_interleaved(&image, x, y, f->data, (ptrdiff_t) x * 3, 3, 0, 1, 2);
+
+    uint64_t changed = 0;
+    bool full = !base_ok || !ref || x != ref_x || y != ref_y ||
+                (s->opt->refresh > 0 && since_refresh >= s->opt->refresh);
+    if(!full) {
+      histo_image_interleaved(&previous, x, y, ref, (ptrdiff_t) x * 3, 3, 0, 1, 2);
+      full = histo_update_channels(&previous, &image, s->opt->channels, s->opt->nchannels,
+                                   hists, &changed) != HISTO_OK;
+    }
+    f->ok = true;
+    if(full) {
+      int err = count_channels(&image, hist_r, hist_g, hist_b, 0, s->opt);
+      if(err < 0) {
+        // nothing to build the next frame on: it is recounted in full too
+        fprintf(stderr, "Unable to count frame %lld: %s\n", f->seq, histo_strerror(err));
+        f->ok = false;
+      }
+      changed = (uint64_t) x * y;
+      since_refresh = 0;
+      s->refreshed++;
+    }
+    base_ok = f->ok;
+    since_refresh++;
+    s->changed += changed;
+
+    memcpy(f->hist_r, hist_r, sizeof(hist_r));
+    memcpy(f->hist_g, hist_g, sizeof(hist_g));
+    memcpy(f->hist_b, hist_b, sizeof(hist_b));
+
+    // keep these pixels; the frame goes on with the older buffer
+    unsigned char *data = f->data;
+    size_t capacity = f->capacity;
+    f->data = ref;
+    f->capacity = ref_capacity;
+    ref = data;
+    ref_capacity = capacity;
+    ref_x = x;
+    ref_y = y;
+    s->done_q->push(f, wait);
+  }
+
+  free(ref);
+  s->done_q->push(&s->end, wait);
+  return NULL;
+}
+
+static void emit_frame(struct stream *s, struct frame *f) {
+  if(!f->ok) {
+    s->failed++;
+    if(s->out)
+      fprintf(s->out, "# frame %lld failed\n", f->seq);
+  } else if(s->out) {
+    fprintf(s->out, "# frame %lld\n", f->seq);
+    write_histograms(s->out, f->hist_r, f->hist_g, f->hist_b, f->input.maxrgb, s->opt);
+    write_stats(s->out, f->hist_r, f->hist_g, f->hist_b, s->opt);
+  }
+
+  if(s->emitted == s->latency_cap) {
+    s->latency_cap = s->latency_cap ? s->latency_cap * 2 : 1024;
+    s->latency = (unsigned long long *) realloc(s->latency,
+                                                sizeof(unsigned long long) * s->latency_cap);
+  }
+  s->latency[s->emitted++] = now_ns() - f->arrived;
+}
+
+static void* stream_emitter(void *thread) {
+  struct stream *s = (struct stream *) thread;
+  ggc::Timer wait("wait");
+  long long next = 0;
+
+  for(;;) {
+    struct frame *f = (struct frame *) s->done_q->pop(wait);
+    if(f == &s->end)
+      break;
+    s->pending[f->seq % s->depth] = f;
+
+    // release every frame that is now in order
+    struct frame *ready;
+    while((ready = s->pending[next % s->depth]) && ready->seq == next) {
+      s->pending[next % s->depth] = NULL;
+      emit_frame(s, ready);
+      s->free_q->push(ready, wait);
+      next++;
+    }
+  }
+  if(s->out)
+    fflush(s->out);
+  return NULL;
+}
+
+static int compare_ull(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+int run_stream(const char *source, const struct options *opt) {
+  FILE *in = strcmp(source, "-") == 0 ? stdin : fopen(source, "rb");
+  if(!in) {
+    fprintf(stderr, "Cannot open the input stream %s.\n", source);
+    return 1;
+  }
+
+  struct stream s;
+  memset(&s, 0, sizeof(s));
+  s.opt = opt;
+  s.workers = opt->delta ? 1 : opt->threads;
+  s.depth = opt->depth > s.workers * 2 ? opt->depth : s.workers * 2;
+  s.out = opt->combined ? fopen(opt->combined, "w") : stdout;
+  if(!s.out) {
+    fprintf(stderr, "Unable to output %s!\n", opt->combined);
+    return 1;
+  }
+
+  size_t capacity = s.depth + s.workers + 1;
+  MPMCQueue free_q(capacity), work_q(capacity), done_q(capacity);
+  s.free_q = &free_q;
+  s.work_q = &work_q;
+  s.done_q = &done_q;
+  s.pending = (struct frame **) calloc(s.depth, sizeof(struct frame *));
+
+  struct frame *frames = (struct frame *) calloc(s.depth, sizeof(struct frame));
+  bool ready = free_q.ok() && work_q.ok() && done_q.ok() && s.pending && frames;
+  for(int i = 0; ready && i < s.depth; i++)
+    free_q.try_push(&frames[i]);
+  if(!ready)
+    fprintf(stderr, "Unable to allocate stream state for depth %d\n", s.depth);
+
+  // Fewer workers than asked for still make progress; none, or no
+  // emitter, and no frame is read.
+  pthread_t worker_ids[s.workers], emitter_id;
+  int started = 0;
+  for(; ready && started < s.workers; started++) {
+    if(pthread_create(&worker_ids[started], NULL,
+                      opt->delta ? stream_delta_worker : stream_worker, (void *) &s)) {
+      fprintf(stderr, "Unable to start stream worker %d\n", started);
+      break;
+    }
+  }
+  s.workers_left.store(started);
+  bool emitting = started > 0 &&
+                  pthread_create(&emitter_id, NULL, stream_emitter, (void *) &s) == 0;
+  if(started > 0 && !emitting)
+    fprintf(stderr, "Unable to start the stream emitter\n");
+
+  ggc::Timer t("stream"), read_wait("read_wait"), wait("wait");
+  long long frames_read = 0, pixels = 0;
+  int rv = emitting ? 0 : 1;
+
+  t.start();
+  while(emitting) {
+    struct img header;
+    int h = read_frame_header(in, &header);
+    if(h == 0)
+      break;
+    if(h < 0) {
+      fprintf(stderr, "Bad PPM header in frame %lld.\n", frames_read);
+      rv = 1;
+      break;
+    }
+
+    struct frame *f = (struct frame *) free_q.pop(wait);
+    size_t bytes = (size_t) header.xsize * header.ysize * 3;
+    if(bytes > f->capacity) {
+      free(f->data);
+      f->data = (unsigned char *) malloc(bytes);
+      f->capacity = f->data ? bytes : 0;
+      if(!f->data) {
+        fprintf(stderr, "Unable to allocate memory for frame %lld.\n", frames_read);
+        free_q.push(f, wait);
+        rv = 1;
+        break;
+      }
+    }
+
+    read_wait.start();
+    size_t got = fread(f->data, 1, bytes, in);
+    read_wait.stop();
+    if(got != bytes) {
+      fprintf(stderr, "Truncated frame %lld.\n", frames_read);
+      free_q.push(f, wait);
+      rv = 1;
+      break;
+    }
+
+    f->input = header;
+    f->seq = frames_read++;
+    f->arrived = now_ns();
+    pixels += (long long) header.xsize * header.ysize;
+    work_q.push(f, wait);
+  }
+
+  for(int i = 0; i < started; i++)
+    work_q.push(&s.end, wait);
+  for(int i = 0; i < started; i++)
+    pthread_join(worker_ids[i], NULL);
+  if(emitting)
+    pthread_join(emitter_id, NULL);
+  t.stop();
+  if(s.failed)
+    rv = 1;
+
+  double seconds = (double) t.duration() / NANOSEC;
+  fprintf(stderr, "Frames: %lld (%lld failed)\n", s.emitted, s.failed);
+  if(opt->delta) {
+    fprintf(stderr, "Threads: %d per frame, depth %d\n", histo_threads(), s.depth);
+    fprintf(stderr, "Delta: %.2f%% of pixels changed, %lld full recounts\n",
+            pixels > 0 ? 100.0 * s.changed / pixels : 0.0, s.refreshed);
+  } else {
+    fprintf(stderr, "Threads: %d, depth %d\n", started, s.depth);
+  }
+  fprintf(stderr, "Time: %llu ns (%.3f ms waiting for input)\n", t.duration(),
+          read_wait.total_duration() / 1e6);
+  fprintf(stderr, "Throughput: %.1f fps, %.1f Mpixels/s\n",
+          seconds > 0 ? s.emitted / seconds : 0.0,
+          seconds > 0 ? pixels / seconds / 1e6 : 0.0);
+  if(s.emitted > 0) {
+    qsort(s.latency, s.emitted, sizeof(unsigned long long), compare_ull);
+    unsigned long long sum = 0;
+    for(long long i = 0; i < s.emitted; i++)
+      sum += s.latency[i];
+    fprintf(stderr, "Latency: mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            sum / 1e6 / s.emitted, s.latency[s.emitted / 2] / 1e6,
+            s.latency[(s.emitted * 99) / 100] / 1e6, s.latency[s.emitted - 1] / 1e6);
+  }
+
+  if(opt->combined)
+    fclose(s.out);
+  if(in != stdin)
+    fclose(in);
+  for(int i = 0; frames && i < s.depth; i++)
+    free(frames[i].data);
+  free(frames);
+  free(s.pending);
+  free(s.latency);
+  return rv;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "histo_synth.h"
+
+/* Generated inputs: images of any size whose value distribution is known,
+   for the cases the files in images/ do not cover.  Every row draws from
+   its own generator seeded from (seed, row), so an image depends only on
+   its kind, size and seed. */
+
+#define ZIPF_EXPONENT 1.2
+#define ZIPF_TABLE 65536
+
+static const char *synth_names[SYNTH_KINDS] = {
+  "uniform", "single", "zipf", "gradient", "noise"
+};
+
+static inline unsigned long long mix64(unsigned long long x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static inline unsigned long long next_random(unsigned long long *state) {
+  unsigned long long x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+// Lattice value of one noise octave, 0..255.
+static inline int lattice(unsigned long long seed, int x, int y, int octave) {
+  unsigned long long h = seed ^ ((unsigned long long) (unsigned) x << 32) ^
+                         ((unsigned long long) (unsigned) y << 8) ^ (unsigned) octave;
+  return (int) (mix64(h) >> 56);
+}
+
+// Bilinear value noise with cells of 2^shift pixels, 0..255 << 8.
+static inline int value_noise(unsigned long long seed, int x, int y, int shift, int octave) {
+  int ix = x >> shift, iy = y >> shift;
+  int mask = (1 << shift) - 1;
+  int fx = ((x & mask) << 8) >> shift, fy = ((y & mask) << 8) >> shift;
+  int v00 = lattice(seed, ix, iy, octave), v10 = lattice(seed, ix + 1, iy, octave);
+  int v01 = lattice(seed, ix, iy + 1, octave), v11 = lattice(seed, ix + 1, iy + 1, octave);
+  int top = (v00 << 8) + (v10 - v00) * fx;
+  int bottom = (v01 << 8) + (v11 - v01) * fx;
+  return top + (((bottom - top) * fy) >> 8);
+}
+
+static inline unsigned char clamp255(int v) {
+  return (unsigned char) (v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+int synth_kind(const char *name) {
+  for(int k = 0; k < SYNTH_KINDS; k++) {
+    if(strcmp(name, synth_names[k]) == 0)
+      return k;
+  }
+  return -1;
+}
+
+const char *synth_name(int kind) {
+  return kind >= 0 && kind < SYNTH_KINDS ? synth_names[kind] : "?";
+}
+
+bool synth_parse(const char *spec, int *kind, int *xsize, int *ysize) {
+  const char *colon = strchr(spec, ':');
+  char name[32];
+  size_t len = colon ? (size_t) (colon - spec) : 0;
+  if(!colon || len >= sizeof(name))
+    return true;
+  memcpy(name, spec, len);
+  name[len] = '\0';
+  *kind = synth_kind(name);
+  char x;
+  return *kind < 0 || sscanf(colon + 1, "%d%c%d", xsize, &x, ysize) != 3 || x != 'x' ||
+         *xsize < 1 || *ysize < 1;
+}
+
+bool synth_image(struct img *input, int kind, int xsize, int ysize, unsigned long long seed) {
+  size_t pixels = (size_t) xsize * ysize;
+  input->xsize = xsize;
+  input->ysize = ysize;
+  input->maxrgb = 255;
+  input->r = (unsigned char *) malloc(pixels);
+  input->g = (unsigned char *) malloc(pixels);
+  input->b = (unsigned char *) malloc(pixels);
+  unsigned char *zipf = kind == SYNTH_ZIPF ? (unsigned char *) malloc(ZIPF_TABLE) : NULL;
+  if(!input->r || !input->g || !input->b || (kind == SYNTH_ZIPF && !zipf)) {
+    free(zipf);
+    free(input->r);
+    free(input->g);
+    free(input->b);
+    input->r = input->g = input->b = NULL;
+    return true;
+  }
+
+  if(zipf) {
+    // value v has weight 1 / (v + 1)^s; a 16-bit draw indexes the inverse CDF
+    double weight[256], total = 0;
+    for(int v = 0; v < 256; v++)
+      total += weight[v] = pow(v + 1.0, -ZIPF_EXPONENT);
+    double cdf = 0;
+    int i = 0;
+    for(int v = 0; v < 256; v++) {
+      cdf += weight[v] / total;
+      int end = v == 255 ? ZIPF_TABLE : (int) (cdf * ZIPF_TABLE);
+      for(; i < end; i++)
+        zipf[i] = (unsigned char) v;
+    }
+  }
+
+  for(int y = 0; y < ysize; y++) {
+    unsigned long long state = mix64(seed ^ mix64((unsigned long long) y + 1)) | 1;
+    unsigned char *r = input->r + (size_t) y * xsize;
+    unsigned char *g = input->g + (size_t) y * xsize;
+    unsigned char *b = input->b + (size_t) y * xsize;
+    switch(kind) {
+    case SYNTH_UNIFORM:
+      for(int x = 0; x < xsize; x++) {
+        unsigned long long v = next_random(&state);
+        r[x] = (unsigned char) (v >> 40);
+        g[x] = (unsigned char) (v >> 48);
+        b[x] = (unsigned char) (v >> 56);
+      }
+      break;
+    case SYNTH_SINGLE:
+      memset(r, 128, xsize);
+      memset(g, 128, xsize);
+      memset(b, 128, xsize);
+      break;
+    case SYNTH_ZIPF:
+      for(int x = 0; x < xsize; x++) {
+        unsigned long long v = next_random(&state);
+        r[x] = zipf[(v >> 16) & 0xffff];
+        g[x] = zipf[(v >> 32) & 0xffff];
+        b[x] = zipf[v >> 48];
+      }
+      break;
+    case SYNTH_GRADIENT:
+      for(int x = 0; x < xsize; x++) {
+        r[x] = (unsigned char) (xsize > 1 ? (long long) x * 255 / (xsize - 1) : 0);
+        g[x] = (unsigned char) (ysize > 1 ? (long long) y * 255 / (ysize - 1) : 0);
+        b[x] = (unsigned char) (xsize + ysize > 2 ?
+                                (long long) (x + y) * 255 / (xsize + ysize - 2) : 0);
+      }
+      break;
+    default:
+      /* Four octaves of value noise (1/f-ish, like a photograph's
+         luminance), a slow tint per channel and a little grain. */
+      for(int x = 0; x < xsize; x++) {
+        int l = (value_noise(seed, x, y, 7, 0) >> 1) + (value_noise(seed, x, y, 6, 1) >> 2) +
+                (value_noise(seed, x, y, 4, 2) >> 3) + (value_noise(seed, x, y, 2, 3) >> 3);
+        int tint = value_noise(seed, x, y, 8, 4) - (128 << 8);
+        unsigned long long v = next_random(&state);
+        int grain = (int) (v >> 60) - 8;
+        r[x] = clamp255(((l + tint / 2) >> 8) + grain);
+        g[x] = clamp255((l >> 8) + grain);
+        b[x] = clamp255(((l - tint / 2) >> 8) + grain);
+      }
+      break;
+    }
+  }
+  free(zipf);
+  return false;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+/* Generated test images (histo_synth.cpp), used by histo --generate and by
+   histo_bench for inputs named synth:KIND:WxH. */
+
+#include "histo.h"
+
+enum {
+  SYNTH_UNIFORM,              // every channel uniform over 0..255
+  SYNTH_SINGLE,               // every pixel 128: one bin, worst case for sharing
+  SYNTH_ZIPF,                 // value v with weight 1 / (v + 1)^1.2
+  SYNTH_GRADIENT,             // r along x, g along y, b along the diagonal
+  SYNTH_NOISE,                // smooth multi-octave noise, photograph-like
+  SYNTH_KINDS
+};
+
+// The SYNTH_* for name, or -1.
+int synth_kind(const char *name);
+const char *synth_name(int kind);
+
+/* Parse "KIND:WxH", e.g. "zipf:4000x3000".  Returns true on failure. */
+bool synth_parse(const char *spec, int *kind, int *xsize, int *ysize);
+
+/* Fill input with a generated xsize*ysize image, maxrgb 255, in newly
+   malloc'd planes (free_img or free them).  The same kind, size and seed
+   give the same pixels.  Returns true if out of memory. */
+bool synth_image(struct img *input, int kind, int xsize, int ysize, unsigned long long seed);
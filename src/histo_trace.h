@@ -0,0 +1,414 @@
+#pragma once
+
+/* Phase tracing for the standalone programs.  A ggc::Phase times the scope
+   it lives in (or up to end()) with a ggc::Timer and, when tracing is on,
+   appends one event to a fixed buffer: a slot taken with one atomic add,
+   so workers record without locks.  Phases nest; each event keeps the
+   depth of its thread at the time.
+
+   ggc::trace.parse() takes --phases, --counters and --trace FILE after the
+   usual arguments; ggc::trace.report() then prints the total of every
+   phase per thread, with the spread across threads for the ones several
+   threads run, and writes FILE in Chrome's trace event format
+   (chrome://tracing, ui.perfetto.dev).  With --counters each phase also
+   carries perf counter deltas (histo_perf.h), turned into IPC, misses
+   per pixel and bytes per cycle against ggc::trace.pixels.  With --memory
+   each phase counts the calls its thread made to the allocator
+   (histo_alloc.h), and the report ends with the process's peak RSS, heap
+   peak, allocation totals and page faults. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "Timer.h"
+#include "histo_perf.h"
+#include "histo_alloc.h"
+
+#define TRACE_EVENTS 4096
+#define TRACE_GROUPS 64
+
+namespace ggc {
+
+struct TraceEvent {
+  const char *name;
+  int thread;
+  int depth;
+  unsigned long long begin;     // ns since the trace started
+  unsigned long long duration;
+  PerfSample counters;          // deltas, with --counters
+  AllocCounts allocs;           // deltas of this thread, with --memory
+};
+
+class Trace {
+  TraceEvent events[TRACE_EVENTS];
+  std::atomic<int> count;
+  std::atomic<int> threads;
+  unsigned long long origin;
+  const char *path;
+
+ public:
+  bool enabled;
+  bool counting;                // --counters
+  bool memory;                  // --memory
+  long long pixels;             // per-pixel rates; set by the program
+
+  Trace() : count(0), threads(0), origin(0), path(NULL), enabled(false), counting(false),
+            memory(false), pixels(0) {}
+
+  static unsigned long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCKTYPE, &ts);
+    return ts.tv_sec * NANOSEC + ts.tv_nsec;
+  }
+
+  // Small ids in order of first use; the main thread gets 0.
+  int thread() {
+    static thread_local int id = -1;
+    if(id < 0)
+      id = threads.fetch_add(1, std::memory_order_relaxed);
+    return id;
+  }
+
+  int &depth() {
+    static thread_local int level = 0;
+    return level;
+  }
+
+  PerfGroup &group() {
+    static thread_local PerfGroup perf;
+    return perf;
+  }
+
+  void record(const char *name, int depth, unsigned long long begin,
+              unsigned long long duration, const PerfSample *counters,
+              const AllocCounts *allocs) {
+    int slot = count.fetch_add(1, std::memory_order_relaxed);
+    if(slot >= TRACE_EVENTS)
+      return;
+    TraceEvent *e = &events[slot];
+    e->name = name;
+    e->thread = thread();
+    e->depth = depth;
+    e->begin = begin - origin;
+    e->duration = duration;
+    e->counters = *counters;
+    e->allocs = *allocs;
+  }
+
+  /* Reads the options from argv[first] on; false if one is not known.
+     Called before anything is timed. */
+  bool parse(int argc, char *argv[], int first) {
+    for(int i = first; i < argc; i++) {
+      if(strcmp(argv[i], "--phases") == 0) {
+        enabled = true;
+      } else if(strcmp(argv[i], "--counters") == 0) {
+        enabled = true;
+        counting = true;
+      } else if(strcmp(argv[i], "--memory") == 0) {
+        enabled = true;
+        memory = true;
+        alloc_enable();
+      } else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+        enabled = true;
+        path = argv[++i];
+      } else {
+        return false;
+      }
+    }
+    origin = now();
+    thread();
+    return true;
+  }
+
+  void summary(FILE *f) {
+    int n = count.load() < TRACE_EVENTS ? count.load() : TRACE_EVENTS;
+    int nthreads = threads.load();
+    const TraceEvent *groups[TRACE_GROUPS];
+    int ngroups = 0;
+
+    /* One line per (name, depth), in order of first start.  Phases of the
+       workers are indented under the outermost main thread phase they
+       started in ("count" under "histogram"). */
+    for(int i = 0; i < n; i++) {
+      int j = 0;
+      while(j < ngroups && !(groups[j]->depth == events[i].depth &&
+                             strcmp(groups[j]->name, events[i].name) == 0))
+        j++;
+      if(j < ngroups) {
+        if(events[i].begin < groups[j]->begin)
+          groups[j] = &events[i];
+      } else if(ngroups < TRACE_GROUPS) {
+        groups[ngroups++] = &events[i];
+      }
+    }
+    for(int j = 1; j < ngroups; j++) {
+      const TraceEvent *g = groups[j];
+      int k = j;
+      for(; k > 0 && groups[k - 1]->begin > g->begin; k--)
+        groups[k] = groups[k - 1];
+      groups[k] = g;
+    }
+    int levels[TRACE_GROUPS];
+    for(int j = 0; j < ngroups; j++) {
+      const TraceEvent *g = groups[j];
+      int outer = -1;
+      for(int i = 0; i < n; i++) {
+        const TraceEvent *e = &events[i];
+        if(g->thread != 0 && e->thread == 0 && e->begin <= g->begin &&
+           g->begin < e->begin + e->duration && (outer < 0 || e->depth < outer))
+          outer = e->depth;
+      }
+      levels[j] = g->depth + outer + 1;
+    }
+
+    unsigned long long *per_thread =
+      (unsigned long long *) malloc(sizeof(unsigned long long) * (nthreads > 0 ? nthreads : 1));
+    fprintf(f, "Phases:\n");
+    for(int j = 0; j < ngroups && per_thread; j++) {
+      memset(per_thread, 0, sizeof(unsigned long long) * nthreads);
+      int calls = 0;
+      for(int i = 0; i < n; i++) {
+        if(events[i].depth == groups[j]->depth && strcmp(events[i].name, groups[j]->name) == 0) {
+          per_thread[events[i].thread] += events[i].duration;
+          calls++;
+        }
+      }
+      int ran = 0, first = -1;
+      unsigned long long sum = 0, lo = 0, hi = 0;
+      for(int t = 0; t < nthreads; t++) {
+        if(!per_thread[t])
+          continue;
+        if(ran == 0 || per_thread[t] < lo)
+          lo = per_thread[t];
+        if(per_thread[t] > hi)
+          hi = per_thread[t];
+        if(first < 0)
+          first = t;
+        sum += per_thread[t];
+        ran++;
+      }
+
+      int indent = 2 + 2 * levels[j];
+      int width = 16 - 2 * levels[j];
+      fprintf(f, "%*s%-*s", indent, "", width > 1 ? width : 1, groups[j]->name);
+      if(ran <= 1) {
+        fprintf(f, "%10.3f ms  thread %d, %d call%s\n", sum / 1e6, first, calls,
+                calls == 1 ? "" : "s");
+      } else {
+        double mean = (double) sum / ran;
+        fprintf(f, "%10.3f ms  %d threads: min %.3f max %.3f ms, imbalance %.2f\n",
+                mean / 1e6, ran, lo / 1e6, hi / 1e6, hi / mean);
+      }
+      if(counting)
+        counter_line(f, groups[j]);
+      if(memory)
+        alloc_line(f, groups[j]);
+    }
+    if(count.load() > TRACE_EVENTS)
+      fprintf(f, "  (%d events dropped)\n", count.load() - TRACE_EVENTS);
+    free(per_thread);
+    if(memory)
+      memory_summary(f, n);
+  }
+
+  // Allocator calls of one phase summed over its threads and calls.
+  void alloc_line(FILE *f, const TraceEvent *group) {
+    int n = count.load() < TRACE_EVENTS ? count.load() : TRACE_EVENTS;
+    AllocCounts sum = { 0, 0, 0 };
+    for(int i = 0; i < n; i++) {
+      if(events[i].depth != group->depth || strcmp(events[i].name, group->name) != 0)
+        continue;
+      sum.allocs += events[i].allocs.allocs;
+      sum.frees += events[i].allocs.frees;
+      sum.bytes += events[i].allocs.bytes;
+    }
+    fprintf(f, "%20s %llu allocs, %.1f KB, %llu frees\n", "", sum.allocs, sum.bytes / 1024.0,
+            sum.frees);
+  }
+
+  /* The process as a whole.  Worker phases are the counting loops, so
+     their allocations are the ones on the hot path. */
+  void memory_summary(FILE *f, int n) {
+    AllocCounts total, hot = { 0, 0, 0 };
+    MemoryUsage usage;
+    alloc_process(&total);
+    memory_usage(&usage);
+    for(int i = 0; i < n; i++) {
+      if(events[i].thread != 0 && events[i].depth == 0) {
+        hot.allocs += events[i].allocs.allocs;
+        hot.bytes += events[i].allocs.bytes;
+      }
+    }
+    fprintf(f, "Memory:\n");
+    fprintf(f, "  peak RSS        %10.1f MB\n", usage.peak_rss / 1048576.0);
+    fprintf(f, "  peak heap       %10.1f MB\n", alloc_peak() / 1048576.0);
+    fprintf(f, "  allocated       %10.1f MB in %llu allocs, %llu frees\n",
+            total.bytes / 1048576.0, total.allocs, total.frees);
+    fprintf(f, "  hot path        %10llu allocs, %.1f KB (worker phases)\n", hot.allocs,
+            hot.bytes / 1024.0);
+    fprintf(f, "  page faults     %10llu minor, %llu major\n", usage.minor_faults,
+            usage.major_faults);
+  }
+
+  // Counters of one phase summed over its threads and calls.
+  void counter_line(FILE *f, const TraceEvent *group) {
+    int n = count.load() < TRACE_EVENTS ? count.load() : TRACE_EVENTS;
+    unsigned valid = ~0u;
+    unsigned long long sum[PERF_COUNTERS];
+    unsigned long long enabled = 0, running = 0;
+    memset(sum, 0, sizeof(sum));
+    for(int i = 0; i < n; i++) {
+      if(events[i].depth != group->depth || strcmp(events[i].name, group->name) != 0)
+        continue;
+      valid &= events[i].counters.valid;
+      enabled += events[i].counters.enabled;
+      for(int c = 0; c < PERF_COUNTERS; c++)
+        sum[c] += events[i].counters.value[c];
+      if(events[i].counters.valid)
+        running += events[i].counters.running;
+    }
+    double px = pixels > 0 ? (double) pixels : 1.0;
+    bool has[PERF_COUNTERS];
+    for(int c = 0; c < PERF_COUNTERS; c++)
+      has[c] = (valid >> c) & 1;
+    if(!(valid & ((1u << PERF_COUNTERS) - 1))) {
+      // the group was open but the PMU never scheduled it
+      if(enabled > 0)
+        fprintf(f, "%20s not counted (multiplexed out)\n", "");
+      return;
+    }
+
+    const char *sep = "";
+    fprintf(f, "%20s", "");
+    if(has[PERF_CYCLES]) {
+      fprintf(f, " %.2f cycles/px", sum[PERF_CYCLES] / px);
+      if(has[PERF_INSTRUCTIONS] && sum[PERF_CYCLES])
+        fprintf(f, ", IPC %.2f", (double) sum[PERF_INSTRUCTIONS] / sum[PERF_CYCLES]);
+      if(sum[PERF_CYCLES])
+        fprintf(f, ", %.2f B/cycle", pixels * 3.0 / sum[PERF_CYCLES]);
+      sep = ",";
+    }
+    if(has[PERF_L1D_MISSES]) {
+      fprintf(f, "%s L1D %.4f/px", sep, sum[PERF_L1D_MISSES] / px);
+      sep = ",";
+    }
+    if(has[PERF_LLC_MISSES]) {
+      fprintf(f, "%s LLC %.4f/px", sep, sum[PERF_LLC_MISSES] / px);
+      sep = ",";
+    }
+    if(has[PERF_TASK_CLOCK]) {
+      fprintf(f, "%s task %.3f ms", sep, sum[PERF_TASK_CLOCK] / 1e6);
+      sep = ",";
+    }
+    if(has[PERF_PAGE_FAULTS]) {
+      fprintf(f, "%s %llu faults", sep, sum[PERF_PAGE_FAULTS]);
+      sep = ",";
+    }
+    if(has[PERF_CONTEXT_SWITCHES])
+      fprintf(f, "%s %llu switches", sep, sum[PERF_CONTEXT_SWITCHES]);
+    if(running < enabled)
+      fprintf(f, " (scaled, counted %.0f%% of the time)", 100.0 * running / enabled);
+    fprintf(f, "\n");
+  }
+
+  bool write_chrome(const char *file) {
+    FILE *f = fopen(file, "w");
+    if(!f) {
+      fprintf(stderr, "Unable to output %s!\n", file);
+      return true;
+    }
+    int n = count.load() < TRACE_EVENTS ? count.load() : TRACE_EVENTS;
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for(int t = 0; t < threads.load(); t++)
+      fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+              "\"args\": {\"name\": \"%s %d\"}},\n", t, t ? "worker" : "main", t);
+    for(int i = 0; i < n; i++) {
+      fprintf(f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+              "\"ts\": %.3f, \"dur\": %.3f, \"args\": {", events[i].name, events[i].thread,
+              events[i].begin / 1e3, events[i].duration / 1e3);
+      const char *sep = "";
+      for(int c = 0; c < PERF_COUNTERS; c++) {
+        if((events[i].counters.valid >> c) & 1) {
+          fprintf(f, "%s\"%s\": %llu", sep, perf_names[c], events[i].counters.value[c]);
+          sep = ", ";
+        }
+      }
+      if(memory)
+        fprintf(f, "%s\"allocs\": %llu, \"alloc_bytes\": %llu, \"frees\": %llu", sep,
+                events[i].allocs.allocs, events[i].allocs.bytes, events[i].allocs.frees);
+      fprintf(f, "}}%s\n", i + 1 < n ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+    return false;
+  }
+
+  // After the run: the summary on f and the trace file, if asked for.
+  void report(FILE *f) {
+    if(!enabled)
+      return;
+    summary(f);
+    if(path)
+      write_chrome(path);
+  }
+};
+
+static Trace trace;
+
+class Phase {
+  const char *name;
+  Timer timer;
+  unsigned long long begin;
+  PerfSample before;
+  AllocCounts allocs;
+  int depth;
+  bool active;
+
+ public:
+  Phase(const char *phase_name) : name(phase_name), timer(phase_name), active(trace.enabled) {
+    if(!active)
+      return;
+    depth = trace.depth()++;
+    before.valid = 0;
+    if(trace.counting) {
+      if(depth == 0)
+        trace.group().open();
+      trace.group().read(&before);
+    }
+    if(trace.memory)
+      alloc_thread(&allocs);
+    begin = Trace::now();
+    timer.start();
+  }
+
+  void end() {
+    if(!active)
+      return;
+    timer.stop();
+    PerfSample delta;
+    delta.valid = 0;
+    delta.enabled = delta.running = 0;
+    if(trace.counting) {
+      trace.group().read(&delta);
+      perf_delta(&delta, &before);
+      if(depth == 0)
+        trace.group().close();
+    }
+    AllocCounts after = { 0, 0, 0 };
+    if(trace.memory) {
+      alloc_thread(&after);
+      after.allocs -= allocs.allocs;
+      after.frees -= allocs.frees;
+      after.bytes -= allocs.bytes;
+    }
+    trace.depth()--;
+    trace.record(name, depth, begin, timer.duration(), &delta, &after);
+    active = false;
+  }
+
+  ~Phase() {
+    end();
+  }
+};
+}
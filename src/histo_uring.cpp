@@ -0,0 +1,112 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "histo_uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+bool uring_init(struct uring *u, unsigned entries) {
+  struct io_uring_params p;
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  u->fd = -1;
+
+  int fd = sys_setup(entries, &p);
+  if(fd < 0)
+    return true;
+  u->fd = fd;
+  u->entries = p.sq_entries;
+
+  u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void *sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    if(u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_len);
+    if(u->cq_ring != MAP_FAILED) munmap(u->cq_ring, u->cq_ring_len);
+    if(sqes != MAP_FAILED) munmap(sqes, u->sqes_len);
+    close(fd);
+    u->fd = -1;
+    return true;
+  }
+
+  char *sq = (char *) u->sq_ring;
+  char *cq = (char *) u->cq_ring;
+  u->sq_head = (unsigned *) (sq + p.sq_off.head);
+  u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *) (sq + p.sq_off.array);
+  u->sqes = (struct io_uring_sqe *) sqes;
+  u->cq_head = (unsigned *) (cq + p.cq_off.head);
+  u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return false;
+}
+
+void uring_exit(struct uring *u) {
+  if(u->fd < 0)
+    return;
+  munmap(u->sqes, u->sqes_len);
+  munmap(u->sq_ring, u->sq_ring_len);
+  munmap(u->cq_ring, u->cq_ring_len);
+  close(u->fd);
+  u->fd = -1;
+}
+
+bool uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned n) {
+  return syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, n) < 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *u) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *u->sq_tail + u->to_submit;
+  if(tail - head >= u->entries)
+    return NULL;
+
+  unsigned index = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[index] = index;
+  u->to_submit++;
+  return sqe;
+}
+
+int uring_submit_and_wait(struct uring *u, unsigned wait_nr) {
+  unsigned submit = u->to_submit;
+  if(submit) {
+    __atomic_store_n(u->sq_tail, *u->sq_tail + submit, __ATOMIC_RELEASE);
+    u->to_submit = 0;
+  }
+  if(!submit && !wait_nr)
+    return 0;
+
+  int rv = sys_enter(u->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+  // an interrupted wait has already consumed the submissions
+  while(rv < 0 && errno == EINTR && wait_nr)
+    rv = sys_enter(u->fd, 0, wait_nr, IORING_ENTER_GETEVENTS);
+  return rv;
+}
+
+bool uring_pop_cqe(struct uring *u, struct io_uring_cqe *cqe) {
+  unsigned head = *u->cq_head;
+  if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return false;
+  *cqe = u->cqes[head & *u->cq_mask];
+  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/* Minimal io_uring wrapper on top of the raw system calls, so the build does
+   not depend on liburing.  Functions returning bool return true on failure,
+   like the ppmb_* readers. */
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+  unsigned entries;
+  unsigned to_submit;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_len;
+  size_t cq_ring_len;
+  size_t sqes_len;
+};
+
+bool uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+bool uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned n);
+
+/* Next free submission entry, zeroed, or NULL if the ring is full. */
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+
+/* Submit everything queued so far and wait for at least wait_nr
+   completions.  Returns the io_uring_enter result. */
+int uring_submit_and_wait(struct uring *u, unsigned wait_nr);
+
+/* Pop one completion into *cqe; false if none is ready. */
+bool uring_pop_cqe(struct uring *u, struct io_uring_cqe *cqe);
@@ -3,6 +3,8 @@
 #include <cstring>
 #include <cassert>
 #include "Timer.h"
+#include "histo_trace.h"
+#include "histo_emit.h"
 
 extern "C" {
 #include "ppmb_io.h"
@@ -17,15 +19,9 @@ struct img {
   unsigned char *b;
 };
 
-void print_histogram(FILE *f, int *hist, int N) {
-  fprintf(f, "%d\n", N+1);
-  for(int i = 0; i <= N; i++) {
-    fprintf(f, "%d %d\n", i, hist[i]);
-  }
-}
-
 void histogram(struct img *input, int *hist_r, int *hist_g, int *hist_b) {
   // we assume hist_r, hist_g, hist_b are zeroed on entry.
+  ggc::Phase count("count");
 
   for(int pix = 0; pix < input->xsize * input->ysize; pix++) {
     hist_r[input->r[pix]] += 1;
@@ -35,8 +31,8 @@ void histogram(struct img *input, int *hist_r, int *hist_g, int *hist_b) {
 }
 
 int main(int argc, char *argv[]) {
-  if(argc != 4) {
-    printf("Usage: %s input-file output-file threads\n", argv[0]);
+  if(argc < 4 || !ggc::trace.parse(argc, argv, 4)) {
+    printf("Usage: %s input-file output-file threads [--phases] [--counters] [--memory] [--trace file.json]\n", argv[0]);
     printf("       For single-threaded runs, pass threads = 1\n");
     exit(1);
   }
@@ -53,8 +49,11 @@ int main(int argc, char *argv[]) {
 
   struct img input;
 
+  ggc::Phase load("load");
   if(!ppmb_read(input_file, &input.xsize, &input.ysize, &input.maxrgb, 
 		&input.r, &input.g, &input.b)) {
+    load.end();
+    ggc::trace.pixels = (long long) input.xsize * input.ysize;
     if(input.maxrgb > 255) {
       printf("Maxrgb %d not supported\n", input.maxrgb);
       exit(1);
@@ -62,26 +61,26 @@ int main(int argc, char *argv[]) {
 
     int *hist_r, *hist_g, *hist_b;
 
+    ggc::Phase alloc("alloc");
     hist_r = (int *) calloc(input.maxrgb+1, sizeof(int));
     hist_g = (int *) calloc(input.maxrgb+1, sizeof(int));
     hist_b = (int *) calloc(input.maxrgb+1, sizeof(int));
+    alloc.end();
 
     ggc::Timer t("histogram");
 
+    ggc::Phase phase("histogram");
     t.start();
     histogram(&input, hist_r, hist_g, hist_b);
     t.stop();
+    phase.end();
 
 
-    FILE *out = fopen(output_file, "w");
-    if(out) {
-      print_histogram(out, hist_r, input.maxrgb);
-      print_histogram(out, hist_g, input.maxrgb);
-      print_histogram(out, hist_b, input.maxrgb);
-      fclose(out);
-    } else {
+    ggc::Phase emit("emit");
+    if(ggc::write_histogram_file(output_file, hist_r, hist_g, hist_b, input.maxrgb))
       fprintf(stderr, "Unable to output!\n");
-    }
+    emit.end();
     printf("Time: %llu ns\n", t.duration());
+    ggc::trace.report(stdout);
   }  
 }
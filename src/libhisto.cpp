@@ -0,0 +1,1452 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <new>
+#include "libhisto.h"
+#include "histo_pool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// ROIs smaller than this are counted on the calling thread
+#define INLINE_PIXELS (32 * 1024)
+// smallest band of pixels handed to a worker
+#define MIN_TASK_PIXELS (16 * 1024)
+// HISTO_LIVE workers publish their tables after about this many pixels
+#define LIVE_CHUNK_PIXELS (256 * 1024)
+
+// Per-worker private tables.  Delta updates wrap below zero; the unsigned
+// sums still come out right once every worker has been merged.
+struct alignas(64) worker_hist {
+  uint64_t r[HISTO_BINS];
+  uint64_t g[HISTO_BINS];
+  uint64_t b[HISTO_BINS];
+  uint64_t changed;
+};
+
+/* What a HISTO_LIVE worker has counted so far, copied out of its private
+   table between chunks of rows.  seq is odd while a copy is being written,
+   so readers retry instead of seeing half of one. */
+struct alignas(64) live_hist {
+  std::atomic<unsigned> seq;
+  uint64_t pixels;
+  uint64_t r[HISTO_BINS];
+  uint64_t g[HISTO_BINS];
+  uint64_t b[HISTO_BINS];
+};
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool *g_pool;
+static struct worker_hist *g_tables;
+static struct live_hist *g_live;
+
+// Odd while a HISTO_LIVE job runs; bumped at its start and end so a
+// snapshot that straddles either is thrown away.
+static std::atomic<unsigned> g_live_epoch;
+static int g_live_workers;
+static uint64_t g_live_total;
+
+struct job {
+  const histo_image *img;
+  const histo_image *prev;    // histo_update only
+  const int *channels;        // NULL: R, G, B into the three tables
+  int nchannels;
+  histo_roi roi;
+  int bands;
+};
+
+static int start_pool(int threads) {
+  if(threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads <= 0)
+    threads = 1;
+
+  struct pool *p = pool_create(threads);
+  if(!p)
+    return HISTO_ENOMEM;
+
+  void *tables = NULL;
+  if(posix_memalign(&tables, 64, sizeof(struct worker_hist) * pool_size(p))) {
+    pool_destroy(p);
+    return HISTO_ENOMEM;
+  }
+  void *live = NULL;
+  if(posix_memalign(&live, 64, sizeof(struct live_hist) * pool_size(p))) {
+    free(tables);
+    pool_destroy(p);
+    return HISTO_ENOMEM;
+  }
+  for(int i = 0; i < pool_size(p); i++)
+    new (&((struct live_hist *) live)[i].seq) std::atomic<unsigned>(0);
+  g_tables = (struct worker_hist *) tables;
+  g_live = (struct live_hist *) live;
+  g_pool = p;
+  return HISTO_OK;
+}
+
+static struct pool *get_pool() {
+  pthread_mutex_lock(&init_lock);
+  if(!g_pool)
+    start_pool(0);
+  struct pool *p = g_pool;
+  pthread_mutex_unlock(&init_lock);
+  return p;
+}
+
+static void count_rows(const histo_image *img, const histo_roi *roi,
+                       int y0, int y1, struct worker_hist *h) {
+  uint64_t *hist_r = h->r;
+  uint64_t *hist_g = h->g;
+  uint64_t *hist_b = h->b;
+  int w = roi->width;
+
+  if(img->layout == HISTO_LAYOUT_PLANAR) {
+    for(int y = y0; y < y1; y++) {
+      ptrdiff_t row = (ptrdiff_t) (roi->y + y) * img->pitch + roi->x;
+      const unsigned char *r = img->data[0] + row;
+      const unsigned char *g = img->data[1] + row;
+      const unsigned char *b = img->data[2] + row;
+      for(int x = 0; x < w; x++) {
+        hist_r[r[x]] += 1;
+        hist_g[g[x]] += 1;
+        hist_b[b[x]] += 1;
+      }
+    }
+  } else {
+    int stride = img->pixel_stride;
+    for(int y = y0; y < y1; y++) {
+      const unsigned char *p = img->data[0] + (ptrdiff_t) (roi->y + y) * img->pitch
+        + (ptrdiff_t) roi->x * stride;
+      const unsigned char *r = p + img->offset[0];
+      const unsigned char *g = p + img->offset[1];
+      const unsigned char *b = p + img->offset[2];
+      for(int x = 0; x < w; x++) {
+        hist_r[r[x * stride]] += 1;
+        hist_g[g[x * stride]] += 1;
+        hist_b[b[x * stride]] += 1;
+      }
+    }
+  }
+}
+
+// One pixel's value of a channel, for tails, strided pixels and updates.
+static inline int derive(int channel, int r, int g, int b) {
+  switch(channel) {
+  case HISTO_CHANNEL_R:
+    return r;
+  case HISTO_CHANNEL_G:
+    return g;
+  case HISTO_CHANNEL_B:
+    return b;
+  case HISTO_CHANNEL_LUMA601:
+    return (77 * r + 150 * g + 29 * b + 128) >> 8;
+  case HISTO_CHANNEL_LUMA709:
+    return (54 * r + 183 * g + 19 * b + 128) >> 8;
+  }
+
+  int v = r > g ? r : g, m = r < g ? r : g;
+  v = v > b ? v : b;
+  m = m < b ? m : b;
+  int c = v - m;
+  switch(channel) {
+  case HISTO_CHANNEL_VALUE:
+    return v;
+  case HISTO_CHANNEL_CHROMA:
+    return c;
+  case HISTO_CHANNEL_SATURATION:
+    return v ? (255 * c + v / 2) / v : 0;
+  }
+
+  // hue: sixths of the circle from red, each c wide, scaled to 256 bins
+  int h;
+  if(v == r)
+    h = g >= b ? g - b : 6 * c + g - b;
+  else if(v == g)
+    h = 2 * c + b - r;
+  else
+    h = 4 * c + r - g;
+  return c ? 128 * h / (3 * c) : 0;
+}
+
+#ifdef __SSE2__
+static inline __m128i luma16(__m128i r, __m128i g, __m128i b, int kr, int kg, int kb) {
+  __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(128);
+  __m128i cr = _mm_set1_epi16(kr), cg = _mm_set1_epi16(kg), cb = _mm_set1_epi16(kb);
+  __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), cr),
+                                           _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), cg)),
+                             _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), cb), half));
+  __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), cr),
+                                           _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), cg)),
+                             _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), cb), half));
+  return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+// floor(num / den) for 8 unsigned 16-bit lanes whose quotient is below 256.
+// Single floats are exact enough: a quotient just under an integer is at
+// least 1/den below it, far more than the rounding error.
+static inline __m128i divide8(__m128i num, __m128i den) {
+  __m128i zero = _mm_setzero_si128();
+  __m128 lo = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(num, zero)),
+                         _mm_cvtepi32_ps(_mm_unpacklo_epi16(den, zero)));
+  __m128 hi = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(num, zero)),
+                         _mm_cvtepi32_ps(_mm_unpackhi_epi16(den, zero)));
+  return _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi));
+}
+
+// Saturation or hue of 8 pixels held in 16-bit lanes, as derive() does it.
+static inline __m128i hsv8(int channel, __m128i r, __m128i g, __m128i b) {
+  __m128i v = _mm_max_epi16(_mm_max_epi16(r, g), b);
+  __m128i c = _mm_sub_epi16(v, _mm_min_epi16(_mm_min_epi16(r, g), b));
+  __m128i one = _mm_set1_epi16(1);
+
+  if(channel == HISTO_CHANNEL_SATURATION) {
+    __m128i num = _mm_add_epi16(_mm_mullo_epi16(c, _mm_set1_epi16(255)), _mm_srli_epi16(v, 1));
+    return divide8(num, _mm_max_epi16(v, one));
+  }
+
+  __m128i is_r = _mm_cmpeq_epi16(v, r);
+  __m128i is_g = _mm_andnot_si128(is_r, _mm_cmpeq_epi16(v, g));
+  __m128i is_b = _mm_andnot_si128(_mm_or_si128(is_r, is_g), _mm_set1_epi16(-1));
+  __m128i from_r = _mm_sub_epi16(g, b);
+  from_r = _mm_add_epi16(from_r, _mm_and_si128(_mm_cmplt_epi16(from_r, _mm_setzero_si128()),
+                                               _mm_mullo_epi16(c, _mm_set1_epi16(6))));
+  __m128i from_g = _mm_add_epi16(_mm_add_epi16(c, c), _mm_sub_epi16(b, r));
+  __m128i from_b = _mm_add_epi16(_mm_slli_epi16(c, 2), _mm_sub_epi16(r, g));
+  __m128i h = _mm_or_si128(_mm_or_si128(_mm_and_si128(is_r, from_r), _mm_and_si128(is_g, from_g)),
+                           _mm_and_si128(is_b, from_b));
+  // h * 128 / (3 c); h is 0 for grays, so any nonzero divisor does
+  __m128i zero = _mm_setzero_si128();
+  __m128i den = _mm_max_epi16(_mm_mullo_epi16(c, _mm_set1_epi16(3)), one);
+  __m128 scale = _mm_set1_ps(128.0f);
+  __m128 lo = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(h, zero)), scale),
+                         _mm_cvtepi32_ps(_mm_unpacklo_epi16(den, zero)));
+  __m128 hi = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(h, zero)), scale),
+                         _mm_cvtepi32_ps(_mm_unpackhi_epi16(den, zero)));
+  return _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi));
+}
+
+// 16 pixels of one channel, entirely in registers.
+static inline __m128i derive16(int channel, __m128i r, __m128i g, __m128i b) {
+  __m128i zero = _mm_setzero_si128();
+  switch(channel) {
+  case HISTO_CHANNEL_R:
+    return r;
+  case HISTO_CHANNEL_G:
+    return g;
+  case HISTO_CHANNEL_B:
+    return b;
+  case HISTO_CHANNEL_LUMA601:
+    return luma16(r, g, b, 77, 150, 29);
+  case HISTO_CHANNEL_LUMA709:
+    return luma16(r, g, b, 54, 183, 19);
+  case HISTO_CHANNEL_VALUE:
+    return _mm_max_epu8(_mm_max_epu8(r, g), b);
+  case HISTO_CHANNEL_CHROMA:
+    return _mm_sub_epi8(_mm_max_epu8(_mm_max_epu8(r, g), b),
+                        _mm_min_epu8(_mm_min_epu8(r, g), b));
+  }
+  __m128i lo = hsv8(channel, _mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero),
+                    _mm_unpacklo_epi8(b, zero));
+  __m128i hi = hsv8(channel, _mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero),
+                    _mm_unpackhi_epi8(b, zero));
+  return _mm_packus_epi16(lo, hi);
+}
+#endif
+
+/* count_rows for derived channels.  Each block of 16 pixels is converted
+   in registers and counted straight from there; no plane is written.
+   Interleaved pixels are gathered into three 16-byte vectors first. */
+static void count_derived(const histo_image *img, const histo_roi *roi, int y0, int y1,
+                          const int *channels, int n, struct worker_hist *h) {
+  uint64_t *hist[3] = { h->r, h->g, h->b };
+  int w = roi->width;
+  bool planar = img->layout == HISTO_LAYOUT_PLANAR;
+  int stride = planar ? 1 : img->pixel_stride;
+
+  for(int y = y0; y < y1; y++) {
+    const unsigned char *r, *g, *b;
+    if(planar) {
+      ptrdiff_t row = (ptrdiff_t) (roi->y + y) * img->pitch + roi->x;
+      r = img->data[0] + row;
+      g = img->data[1] + row;
+      b = img->data[2] + row;
+    } else {
+      const unsigned char *p = img->data[0] + (ptrdiff_t) (roi->y + y) * img->pitch
+        + (ptrdiff_t) roi->x * stride;
+      r = p + img->offset[0];
+      g = p + img->offset[1];
+      b = p + img->offset[2];
+    }
+
+    int x = 0;
+#ifdef __SSE2__
+    alignas(16) unsigned char out[3][16];
+    for(; x + 16 <= w; x += 16) {
+      __m128i vr, vg, vb;
+      if(planar) {
+        vr = _mm_loadu_si128((const __m128i *) (r + x));
+        vg = _mm_loadu_si128((const __m128i *) (g + x));
+        vb = _mm_loadu_si128((const __m128i *) (b + x));
+      } else {
+        alignas(16) unsigned char pr[16], pg[16], pb[16];
+        for(int i = 0; i < 16; i++) {
+          ptrdiff_t o = (ptrdiff_t) (x + i) * stride;
+          pr[i] = r[o];
+          pg[i] = g[o];
+          pb[i] = b[o];
+        }
+        vr = _mm_load_si128((const __m128i *) pr);
+        vg = _mm_load_si128((const __m128i *) pg);
+        vb = _mm_load_si128((const __m128i *) pb);
+      }
+      for(int c = 0; c < n; c++)
+        _mm_store_si128((__m128i *) out[c], derive16(channels[c], vr, vg, vb));
+      for(int c = 0; c < n; c++) {
+        for(int i = 0; i < 16; i++)
+          hist[c][out[c][i]] += 1;
+      }
+    }
+#endif
+    for(; x < w; x++) {
+      ptrdiff_t o = (ptrdiff_t) x * stride;
+      for(int c = 0; c < n; c++)
+        hist[c][derive(channels[c], r[o], g[o], b[o])] += 1;
+    }
+  }
+}
+
+static void count_job(const struct job *j, int y0, int y1, struct worker_hist *h) {
+  if(j->channels)
+    count_derived(j->img, &j->roi, y0, y1, j->channels, j->nchannels, h);
+  else
+    count_rows(j->img, &j->roi, y0, y1, h);
+}
+
+static void band_task(void *arg, int task, int worker) {
+  struct job *j = (struct job *) arg;
+  int rows = j->roi.height;
+  count_job(j, (int) ((long long) rows * task / j->bands),
+            (int) ((long long) rows * (task + 1) / j->bands), &g_tables[worker]);
+}
+
+static void publish(struct live_hist *l, const struct worker_hist *h, uint64_t pixels) {
+  unsigned seq = l->seq.load(std::memory_order_relaxed);
+  l->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(l->r, h->r, sizeof(l->r));
+  memcpy(l->g, h->g, sizeof(l->g));
+  memcpy(l->b, h->b, sizeof(l->b));
+  l->pixels += pixels;
+  l->seq.store(seq + 2, std::memory_order_release);
+}
+
+// band_task for HISTO_LIVE: the same counting, published between chunks.
+static void live_band_task(void *arg, int task, int worker) {
+  struct job *j = (struct job *) arg;
+  int rows = j->roi.height;
+  int y0 = (int) ((long long) rows * task / j->bands);
+  int y1 = (int) ((long long) rows * (task + 1) / j->bands);
+  int chunk = LIVE_CHUNK_PIXELS / (j->roi.width > 0 ? j->roi.width : 1);
+  if(chunk < 1)
+    chunk = 1;
+
+  for(int y = y0; y < y1; y += chunk) {
+    int end = y + chunk < y1 ? y + chunk : y1;
+    count_job(j, y, end, &g_tables[worker]);
+    publish(&g_live[worker], &g_tables[worker], (uint64_t) (end - y) * j->roi.width);
+  }
+}
+
+static inline void move_pixel(struct worker_hist *h, const struct job *j,
+                              const unsigned char *old_r, const unsigned char *old_g,
+                              const unsigned char *old_b, const unsigned char *new_r,
+                              const unsigned char *new_g, const unsigned char *new_b) {
+  if(j->channels) {
+    uint64_t *hist[3] = { h->r, h->g, h->b };
+    for(int c = 0; c < j->nchannels; c++) {
+      hist[c][derive(j->channels[c], *old_r, *old_g, *old_b)] -= 1;
+      hist[c][derive(j->channels[c], *new_r, *new_g, *new_b)] += 1;
+    }
+    h->changed += 1;
+    return;
+  }
+  h->r[*old_r] -= 1;
+  h->g[*old_g] -= 1;
+  h->b[*old_b] -= 1;
+  h->r[*new_r] += 1;
+  h->g[*new_g] += 1;
+  h->b[*new_b] += 1;
+  h->changed += 1;
+}
+
+#ifdef __SSE2__
+// Bit i set for every byte i that differs between a[0..15] and b[0..15].
+static inline unsigned diff16(const unsigned char *a, const unsigned char *b) {
+  __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) a),
+                              _mm_loadu_si128((const __m128i *) b));
+  return ~_mm_movemask_epi8(eq) & 0xFFFF;
+}
+#endif
+
+// Move every pixel that changed between prev and cur from its old bins to
+// its new ones.  Unchanged 16-pixel blocks cost one compare per plane.
+static void delta_rows(const struct job *j, int y0, int y1, struct worker_hist *h) {
+  const histo_image *prev = j->prev, *cur = j->img;
+  int w = cur->width;
+
+  if(cur->layout == HISTO_LAYOUT_PLANAR) {
+    for(int y = y0; y < y1; y++) {
+      const unsigned char *pr = prev->data[0] + (ptrdiff_t) y * prev->pitch;
+      const unsigned char *pg = prev->data[1] + (ptrdiff_t) y * prev->pitch;
+      const unsigned char *pb = prev->data[2] + (ptrdiff_t) y * prev->pitch;
+      const unsigned char *cr = cur->data[0] + (ptrdiff_t) y * cur->pitch;
+      const unsigned char *cg = cur->data[1] + (ptrdiff_t) y * cur->pitch;
+      const unsigned char *cb = cur->data[2] + (ptrdiff_t) y * cur->pitch;
+      int x = 0;
+#ifdef __SSE2__
+      for(; x + 16 <= w; x += 16) {
+        unsigned mask = diff16(pr + x, cr + x) | diff16(pg + x, cg + x) | diff16(pb + x, cb + x);
+        while(mask) {
+          int i = x + __builtin_ctz(mask);
+          mask &= mask - 1;
+          move_pixel(h, j, pr + i, pg + i, pb + i, cr + i, cg + i, cb + i);
+        }
+      }
+#endif
+      for(; x < w; x++) {
+        if(pr[x] != cr[x] || pg[x] != cg[x] || pb[x] != cb[x])
+          move_pixel(h, j, pr + x, pg + x, pb + x, cr + x, cg + x, cb + x);
+      }
+    }
+    return;
+  }
+
+  int stride = cur->pixel_stride;
+  int r = cur->offset[0], g = cur->offset[1], b = cur->offset[2];
+  unsigned long long channels = (1ULL << r) | (1ULL << g) | (1ULL << b);
+
+  for(int y = y0; y < y1; y++) {
+    const unsigned char *p = prev->data[0] + (ptrdiff_t) y * prev->pitch;
+    const unsigned char *c = cur->data[0] + (ptrdiff_t) y * cur->pitch;
+    int x = 0;
+#ifdef __SSE2__
+    // 16 pixels of up to 4 bytes fit one 64-bit byte mask
+    if(stride <= 4) {
+      for(; x + 16 <= w; x += 16) {
+        const unsigned char *pp = p + (ptrdiff_t) x * stride;
+        const unsigned char *cp = c + (ptrdiff_t) x * stride;
+        unsigned long long mask = 0;
+        for(int k = 0; k < stride; k++)
+          mask |= (unsigned long long) diff16(pp + 16 * k, cp + 16 * k) << (16 * k);
+        if(!mask)
+          continue;
+        for(int i = 0; i < 16; i++) {
+          if((mask >> (i * stride)) & channels) {
+            const unsigned char *po = pp + i * stride;
+            const unsigned char *co = cp + i * stride;
+            move_pixel(h, j, po + r, po + g, po + b, co + r, co + g, co + b);
+          }
+        }
+      }
+    }
+#endif
+    for(; x < w; x++) {
+      const unsigned char *po = p + (ptrdiff_t) x * stride;
+      const unsigned char *co = c + (ptrdiff_t) x * stride;
+      if(po[r] != co[r] || po[g] != co[g] || po[b] != co[b])
+        move_pixel(h, j, po + r, po + g, po + b, co + r, co + g, co + b);
+    }
+  }
+}
+
+static void delta_task(void *arg, int task, int worker) {
+  struct job *j = (struct job *) arg;
+  int rows = j->roi.height;
+  delta_rows(j, (int) ((long long) rows * task / j->bands),
+             (int) ((long long) rows * (task + 1) / j->bands), &g_tables[worker]);
+}
+
+static void store(uint64_t *out, const uint64_t *in, unsigned flags) {
+  if(!out)
+    return;
+  if(flags & HISTO_ACCUMULATE) {
+    for(int i = 0; i < HISTO_BINS; i++)
+      out[i] += in[i];
+  } else {
+    for(int i = 0; i < HISTO_BINS; i++)
+      out[i] = in[i];
+  }
+}
+
+static int check_image(const histo_image *img) {
+  if(!img || img->width <= 0 || img->height <= 0 || !img->data[0])
+    return HISTO_EINVAL;
+
+  ptrdiff_t pitch = img->pitch < 0 ? -img->pitch : img->pitch;
+  if(img->layout == HISTO_LAYOUT_PLANAR) {
+    if(!img->data[1] || !img->data[2] || pitch < img->width)
+      return HISTO_EINVAL;
+  } else if(img->layout == HISTO_LAYOUT_INTERLEAVED) {
+    if(img->pixel_stride <= 0 || pitch < (ptrdiff_t) img->width * img->pixel_stride)
+      return HISTO_EINVAL;
+    for(int c = 0; c < 3; c++) {
+      if(img->offset[c] < 0 || img->offset[c] >= img->pixel_stride)
+        return HISTO_EINVAL;
+    }
+  } else {
+    return HISTO_EINVAL;
+  }
+  return HISTO_OK;
+}
+
+// Split j->roi into row bands on the pool and merge the per-worker tables.
+static int run_bands(struct job *j, pool_task_fn fn, struct worker_hist *sum) {
+  struct pool *p = get_pool();
+  if(!p)
+    return HISTO_ENOMEM;
+
+  pthread_mutex_lock(&job_lock);
+
+  int workers = pool_size(p);
+  long long bands = (long long) j->roi.width * j->roi.height / MIN_TASK_PIXELS;
+  if(bands > workers * 4)
+    bands = workers * 4;
+  if(bands > j->roi.height)
+    bands = j->roi.height;
+  if(bands < 1)
+    bands = 1;
+  j->bands = (int) bands;
+
+  memset(g_tables, 0, sizeof(struct worker_hist) * workers);
+  bool live = fn == live_band_task;
+  if(live) {
+    for(int w = 0; w < workers; w++) {
+      g_live[w].pixels = 0;
+      memset(g_live[w].r, 0, sizeof(g_live[w].r));
+      memset(g_live[w].g, 0, sizeof(g_live[w].g));
+      memset(g_live[w].b, 0, sizeof(g_live[w].b));
+    }
+    g_live_workers = workers;
+    g_live_total = (uint64_t) j->roi.width * j->roi.height;
+    g_live_epoch.fetch_add(1, std::memory_order_release);
+  }
+  pool_run(p, fn, j, j->bands);
+  if(live)
+    g_live_epoch.fetch_add(1, std::memory_order_release);
+
+  memset(sum, 0, sizeof(*sum));
+  for(int w = 0; w < workers; w++) {
+    for(int i = 0; i < HISTO_BINS; i++) {
+      sum->r[i] += g_tables[w].r[i];
+      sum->g[i] += g_tables[w].g[i];
+      sum->b[i] += g_tables[w].b[i];
+    }
+    sum->changed += g_tables[w].changed;
+  }
+  pthread_mutex_unlock(&job_lock);
+  return HISTO_OK;
+}
+
+int histo_version(void) {
+  return HISTO_API_VERSION;
+}
+
+const char *histo_strerror(int err) {
+  switch(err) {
+  case HISTO_OK: return "success";
+  case HISTO_EINVAL: return "invalid argument";
+  case HISTO_EROI: return "region of interest outside image";
+  case HISTO_ENOMEM: return "out of memory";
+  case HISTO_EIDLE: return "no live computation running";
+  }
+  return "unknown error";
+}
+
+int histo_init(int threads) {
+  pthread_mutex_lock(&init_lock);
+  int err = g_pool ? HISTO_EINVAL : start_pool(threads);
+  pthread_mutex_unlock(&init_lock);
+  return err;
+}
+
+void histo_shutdown(void) {
+  pthread_mutex_lock(&init_lock);
+  pthread_mutex_lock(&job_lock);
+  pool_destroy(g_pool);
+  free(g_tables);
+  free(g_live);
+  g_pool = NULL;
+  g_tables = NULL;
+  g_live = NULL;
+  pthread_mutex_unlock(&job_lock);
+  pthread_mutex_unlock(&init_lock);
+}
+
+struct pool *histo_shared_pool(void) {
+  return get_pool();
+}
+
+int histo_threads(void) {
+  return pool_size(get_pool());
+}
+
+void histo_image_planar(histo_image *img, int width, int height,
+                        const unsigned char *r, const unsigned char *g,
+                        const unsigned char *b, ptrdiff_t pitch) {
+  memset(img, 0, sizeof(*img));
+  img->layout = HISTO_LAYOUT_PLANAR;
+  img->width = width;
+  img->height = height;
+  img->data[0] = r;
+  img->data[1] = g;
+  img->data[2] = b;
+  img->pitch = pitch;
+  img->pixel_stride = 1;
+}
+
+void histo_image_interleaved(histo_image *img, int width, int height,
+                             const unsigned char *data, ptrdiff_t pitch,
+                             int pixel_stride, int r_offset,
+                             int g_offset, int b_offset) {
+  memset(img, 0, sizeof(*img));
+  img->layout = HISTO_LAYOUT_INTERLEAVED;
+  img->width = width;
+  img->height = height;
+  img->data[0] = data;
+  img->pitch = pitch;
+  img->pixel_stride = pixel_stride;
+  img->offset[0] = r_offset;
+  img->offset[1] = g_offset;
+  img->offset[2] = b_offset;
+}
+
+static int check_channels(const int *channels, int n, uint64_t *const *hists) {
+  if(!channels || !hists || n < 1 || n > 3)
+    return HISTO_EINVAL;
+  for(int c = 0; c < n; c++) {
+    if(channels[c] < 0 || channels[c] >= HISTO_CHANNELS || !hists[c])
+      return HISTO_EINVAL;
+  }
+  return HISTO_OK;
+}
+
+// histo_compute and histo_compute_channels; hists[] may hold NULLs.
+static int compute(const histo_image *img, const histo_roi *roi, const int *channels,
+                   int n, uint64_t *const *hists, unsigned flags) {
+  int err = check_image(img);
+  if(err)
+    return err;
+
+  struct job j;
+  j.img = img;
+  j.prev = NULL;
+  j.channels = channels;
+  j.nchannels = n;
+  if(roi) {
+    if(roi->x < 0 || roi->y < 0 || roi->width < 0 || roi->height < 0 ||
+       roi->x > img->width - roi->width || roi->y > img->height - roi->height)
+      return HISTO_EROI;
+    j.roi = *roi;
+  } else {
+    j.roi.x = 0;
+    j.roi.y = 0;
+    j.roi.width = img->width;
+    j.roi.height = img->height;
+  }
+
+  long long pixels = (long long) j.roi.width * j.roi.height;
+  bool live = flags & HISTO_LIVE;
+  if(live && (flags & HISTO_SINGLE_THREAD))
+    return HISTO_EINVAL;
+
+  if(!live && (pixels < INLINE_PIXELS || (flags & HISTO_SINGLE_THREAD))) {
+    struct worker_hist h;
+    memset(&h, 0, sizeof(h));
+    count_job(&j, 0, j.roi.height, &h);
+    store(hists[0], h.r, flags);
+    store(hists[1], h.g, flags);
+    store(hists[2], h.b, flags);
+    return HISTO_OK;
+  }
+
+  struct worker_hist sum;
+  err = run_bands(&j, live ? live_band_task : band_task, &sum);
+  if(err)
+    return err;
+
+  store(hists[0], sum.r, flags);
+  store(hists[1], sum.g, flags);
+  store(hists[2], sum.b, flags);
+  return HISTO_OK;
+}
+
+int histo_compute(const histo_image *img, const histo_roi *roi,
+                  uint64_t *hist_r, uint64_t *hist_g,
+                  uint64_t *hist_b, unsigned flags) {
+  uint64_t *hists[3] = { hist_r, hist_g, hist_b };
+  return compute(img, roi, NULL, 3, hists, flags);
+}
+
+int histo_compute_channels(const histo_image *img, const histo_roi *roi,
+                           const int *channels, int n, uint64_t *const *hists,
+                           unsigned flags) {
+  int err = check_channels(channels, n, hists);
+  if(err)
+    return err;
+  uint64_t *out[3] = { NULL, NULL, NULL };
+  for(int c = 0; c < n; c++)
+    out[c] = hists[c];
+  // plain R, G, B keeps the direct loop
+  if(n == 3 && channels[0] == HISTO_CHANNEL_R && channels[1] == HISTO_CHANNEL_G &&
+     channels[2] == HISTO_CHANNEL_B)
+    channels = NULL;
+  return compute(img, roi, channels, n, out, flags);
+}
+
+static int update(const histo_image *prev, const histo_image *cur, const int *channels,
+                  int n, uint64_t *const *hists, uint64_t *changed) {
+  int err = check_image(prev);
+  if(err)
+    return err;
+  err = check_image(cur);
+  if(err)
+    return err;
+  if(prev->layout != cur->layout ||
+     prev->width != cur->width || prev->height != cur->height ||
+     prev->pixel_stride != cur->pixel_stride)
+    return HISTO_EINVAL;
+  if(cur->layout == HISTO_LAYOUT_INTERLEAVED) {
+    for(int c = 0; c < 3; c++) {
+      if(prev->offset[c] != cur->offset[c])
+        return HISTO_EINVAL;
+    }
+  }
+
+  struct job j;
+  j.img = cur;
+  j.prev = prev;
+  j.channels = channels;
+  j.nchannels = n;
+  j.roi.x = 0;
+  j.roi.y = 0;
+  j.roi.width = cur->width;
+  j.roi.height = cur->height;
+
+  struct worker_hist sum;
+  if((long long) cur->width * cur->height < INLINE_PIXELS) {
+    memset(&sum, 0, sizeof(sum));
+    delta_rows(&j, 0, cur->height, &sum);
+  } else {
+    err = run_bands(&j, delta_task, &sum);
+    if(err)
+      return err;
+  }
+
+  store(hists[0], sum.r, HISTO_ACCUMULATE);
+  store(hists[1], sum.g, HISTO_ACCUMULATE);
+  store(hists[2], sum.b, HISTO_ACCUMULATE);
+  if(changed)
+    *changed = sum.changed;
+  return HISTO_OK;
+}
+
+int histo_update(const histo_image *prev, const histo_image *cur,
+                 uint64_t *hist_r, uint64_t *hist_g, uint64_t *hist_b,
+                 uint64_t *changed) {
+  if(!hist_r || !hist_g || !hist_b)
+    return HISTO_EINVAL;
+  uint64_t *hists[3] = { hist_r, hist_g, hist_b };
+  return update(prev, cur, NULL, 3, hists, changed);
+}
+
+int histo_update_channels(const histo_image *prev, const histo_image *cur,
+                          const int *channels, int n, uint64_t *const *hists,
+                          uint64_t *changed) {
+  int err = check_channels(channels, n, hists);
+  if(err)
+    return err;
+  uint64_t *out[3] = { NULL, NULL, NULL };
+  for(int c = 0; c < n; c++)
+    out[c] = hists[c];
+  return update(prev, cur, channels, n, out, changed);
+}
+
+int histo_snapshot(uint64_t *hist_r, uint64_t *hist_g, uint64_t *hist_b,
+                   uint64_t *pixels, uint64_t *total) {
+  unsigned epoch = g_live_epoch.load(std::memory_order_acquire);
+  if(!(epoch & 1))
+    return HISTO_EIDLE;
+  int workers = g_live_workers;
+  uint64_t job_total = g_live_total;
+
+  struct worker_hist sum, copy;
+  uint64_t done = 0;
+  memset(&sum, 0, sizeof(sum));
+  for(int w = 0; w < workers; w++) {
+    struct live_hist *l = &g_live[w];
+    uint64_t n;
+    for(;;) {
+      unsigned seq = l->seq.load(std::memory_order_acquire);
+      if(seq & 1) {
+        sched_yield();
+        continue;
+      }
+      memcpy(copy.r, l->r, sizeof(copy.r));
+      memcpy(copy.g, l->g, sizeof(copy.g));
+      memcpy(copy.b, l->b, sizeof(copy.b));
+      n = l->pixels;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(l->seq.load(std::memory_order_relaxed) == seq)
+        break;
+    }
+    for(int i = 0; i < HISTO_BINS; i++) {
+      sum.r[i] += copy.r[i];
+      sum.g[i] += copy.g[i];
+      sum.b[i] += copy.b[i];
+    }
+    done += n;
+  }
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if(g_live_epoch.load(std::memory_order_relaxed) != epoch)
+    return HISTO_EIDLE;
+
+  store(hist_r, sum.r, 0);
+  store(hist_g, sum.g, 0);
+  store(hist_b, sum.b, 0);
+  if(pixels)
+    *pixels = done;
+  if(total)
+    *total = job_total;
+  return HISTO_OK;
+}
+
+void histo_stats_compute(const uint64_t *hist, histo_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->min = -1;
+  stats->max = -1;
+  uint64_t running = 0;
+  double weighted_log = 0;      // sum of n * log2(n) over the bins
+  for(int v = 0; v < HISTO_BINS; v++) {
+    uint64_t n = hist[v];
+    running += n;
+    stats->cumulative[v] = running;
+    if(!n)
+      continue;
+    if(stats->min < 0)
+      stats->min = v;
+    stats->max = v;
+    stats->sum += n * v;
+    stats->sum_squares += n * v * v;
+    weighted_log += n * log2((double) n);
+  }
+  stats->count = running;
+  if(!running)
+    return;
+
+  double count = (double) running;
+  stats->mean = stats->sum / count;
+  stats->variance = stats->sum_squares / count - stats->mean * stats->mean;
+  if(stats->variance < 0)
+    stats->variance = 0;
+  stats->entropy = log2(count) - weighted_log / count;
+}
+
+int histo_percentile(const histo_stats *stats, double p) {
+  if(!stats->count)
+    return -1;
+  if(p <= 0)
+    return stats->min;
+  // rank of the pixel wanted, counting from 1
+  uint64_t rank = (uint64_t) ceil(p / 100 * stats->count);
+  if(rank < 1)
+    rank = 1;
+  if(rank > stats->count)
+    rank = stats->count;
+  int lo = 0, hi = HISTO_BINS - 1;
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(stats->cumulative[mid] >= rank)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+/* Integral histogram: counts[y][x][c][bin] holds the histogram of every
+   pixel above and left of (x, y), with a zero row and column in front, so
+   any rectangle is four lookups per bin.  Built in two parallel passes:
+   running sums along each row band, then down each strip of columns. */
+struct histo_integral {
+  int width;
+  int height;
+  int bins;
+  unsigned char bin_of[256];
+  size_t row_len;             // uint32 counts per row of the table
+  size_t bytes;
+  uint32_t *counts;
+  const histo_image *img;     // only while building
+  int tasks;
+};
+
+static void integral_rows(void *arg, int task, int worker) {
+  struct histo_integral *ih = (struct histo_integral *) arg;
+  const histo_image *img = ih->img;
+  size_t block = 3 * (size_t) ih->bins;
+  int y0 = (int) ((long long) ih->height * task / ih->tasks);
+  int y1 = (int) ((long long) ih->height * (task + 1) / ih->tasks);
+  (void) worker;
+
+  for(int y = y0; y < y1; y++) {
+    uint32_t *row = ih->counts + (size_t) (y + 1) * ih->row_len;
+    const unsigned char *r, *g, *b;
+    int stride;
+    if(img->layout == HISTO_LAYOUT_PLANAR) {
+      r = img->data[0] + (ptrdiff_t) y * img->pitch;
+      g = img->data[1] + (ptrdiff_t) y * img->pitch;
+      b = img->data[2] + (ptrdiff_t) y * img->pitch;
+      stride = 1;
+    } else {
+      const unsigned char *p = img->data[0] + (ptrdiff_t) y * img->pitch;
+      r = p + img->offset[0];
+      g = p + img->offset[1];
+      b = p + img->offset[2];
+      stride = img->pixel_stride;
+    }
+
+    memset(row, 0, block * sizeof(uint32_t));
+    for(int x = 0; x < ih->width; x++) {
+      uint32_t *cell = row + (x + 1) * block;
+      memcpy(cell, cell - block, block * sizeof(uint32_t));
+      cell[ih->bin_of[r[x * stride]]] += 1;
+      cell[ih->bins + ih->bin_of[g[x * stride]]] += 1;
+      cell[2 * ih->bins + ih->bin_of[b[x * stride]]] += 1;
+    }
+  }
+}
+
+static void integral_columns(void *arg, int task, int worker) {
+  struct histo_integral *ih = (struct histo_integral *) arg;
+  size_t i0 = ih->row_len * task / ih->tasks;
+  size_t i1 = ih->row_len * (task + 1) / ih->tasks;
+  (void) worker;
+
+  for(int y = 2; y <= ih->height; y++) {
+    uint32_t *row = ih->counts + (size_t) y * ih->row_len;
+    const uint32_t *above = row - ih->row_len;
+    for(size_t i = i0; i < i1; i++)
+      row[i] += above[i];
+  }
+}
+
+int histo_integral_build(const histo_image *img, int bins, histo_integral **out) {
+  int err = check_image(img);
+  if(err)
+    return err;
+  if(!out || bins < 1 || bins > HISTO_BINS ||
+     (unsigned long long) img->width * img->height > 0xFFFFFFFFULL)
+    return HISTO_EINVAL;
+  struct pool *p = get_pool();
+  if(!p)
+    return HISTO_ENOMEM;
+
+  struct histo_integral *ih = (struct histo_integral *) calloc(1, sizeof(*ih));
+  if(!ih)
+    return HISTO_ENOMEM;
+  ih->width = img->width;
+  ih->height = img->height;
+  ih->bins = bins;
+  for(int v = 0; v < 256; v++)
+    ih->bin_of[v] = (unsigned char) (v * bins / 256);
+  ih->row_len = (size_t) (img->width + 1) * 3 * bins;
+  ih->bytes = ih->row_len * (img->height + 1) * sizeof(uint32_t);
+
+  void *counts = NULL;
+  if(posix_memalign(&counts, 64, ih->bytes)) {
+    free(ih);
+    return HISTO_ENOMEM;
+  }
+  ih->counts = (uint32_t *) counts;
+  memset(ih->counts, 0, ih->row_len * sizeof(uint32_t));
+
+  ih->img = img;
+  ih->tasks = pool_size(p) * 4 < img->height ? pool_size(p) * 4 : img->height;
+  pool_run(p, integral_rows, ih, ih->tasks);
+  pool_run(p, integral_columns, ih, ih->tasks);
+  ih->img = NULL;
+
+  *out = ih;
+  return HISTO_OK;
+}
+
+void histo_integral_free(histo_integral *ih) {
+  if(!ih)
+    return;
+  free(ih->counts);
+  free(ih);
+}
+
+int histo_integral_bins(const histo_integral *ih) {
+  return ih->bins;
+}
+
+size_t histo_integral_bytes(const histo_integral *ih) {
+  return ih->bytes + sizeof(*ih);
+}
+
+struct integral_query {
+  const histo_integral *ih;
+  const histo_roi *rects;
+  int n;
+  uint64_t *out;
+  int tasks;
+};
+
+static void query_one(const histo_integral *ih, const histo_roi *q, uint64_t *out) {
+  size_t block = 3 * (size_t) ih->bins;
+  const uint32_t *top = ih->counts + (size_t) q->y * ih->row_len;
+  const uint32_t *bottom = ih->counts + (size_t) (q->y + q->height) * ih->row_len;
+  size_t left = (size_t) q->x * block, right = (size_t) (q->x + q->width) * block;
+  for(size_t i = 0; i < block; i++)
+    out[i] = (uint32_t) (bottom[right + i] - bottom[left + i] - top[right + i] + top[left + i]);
+}
+
+static void query_task(void *arg, int task, int worker) {
+  struct integral_query *q = (struct integral_query *) arg;
+  int i0 = (int) ((long long) q->n * task / q->tasks);
+  int i1 = (int) ((long long) q->n * (task + 1) / q->tasks);
+  size_t block = 3 * (size_t) q->ih->bins;
+  (void) worker;
+
+  for(int i = i0; i < i1; i++)
+    query_one(q->ih, &q->rects[i], q->out + i * block);
+}
+
+// queries below this many run on the calling thread
+#define INLINE_QUERIES 256
+
+int histo_integral_query(const histo_integral *ih, const histo_roi *rects, int n,
+                         uint64_t *out) {
+  if(!ih || n < 0 || (n > 0 && (!rects || !out)))
+    return HISTO_EINVAL;
+  for(int i = 0; i < n; i++) {
+    const histo_roi *r = &rects[i];
+    if(r->x < 0 || r->y < 0 || r->width < 0 || r->height < 0 ||
+       r->x > ih->width - r->width || r->y > ih->height - r->height)
+      return HISTO_EROI;
+  }
+
+  struct integral_query q;
+  q.ih = ih;
+  q.rects = rects;
+  q.n = n;
+  q.out = out;
+  struct pool *p = n < INLINE_QUERIES ? NULL : get_pool();
+  if(!p) {
+    q.tasks = 1;
+    query_task(&q, 0, 0);
+    return HISTO_OK;
+  }
+  q.tasks = pool_size(p) * 4;
+  pool_run(p, query_task, &q, q.tasks);
+  return HISTO_OK;
+}
+
+/* Joint (r,g,b) histogram over bits per channel.  Up to HISTO_JOINT_DENSE_BITS
+   every worker counts into a private dense table and the tables are summed
+   in slices.  Above that a dense table per worker no longer fits in cache
+   (or memory), so the cells are radix partitioned instead: one pass counts
+   the pixels of each band per partition, a second scatters the keys to their
+   partitions, and a task per partition counts its slice of the key space in
+   a small local table and emits the occupied cells in order. */
+// key bits counted by one partition task (64K cells, 256 KB)
+#define JOINT_PART_BITS 16
+
+struct histo_joint {
+  int bits;
+  bool dense;
+  size_t entries;             // occupied cells
+  size_t bytes;
+  uint64_t *counts;           // dense: every cell; sparse: one per entry
+  uint32_t *colors;           // sparse: the cell of each entry, ascending
+};
+
+struct joint_job {
+  const histo_image *img;
+  histo_roi roi;
+  int bits;
+  int bands;
+  int workers;
+  uint32_t *row_keys;         // one row of keys per worker
+
+  // dense
+  size_t cells;
+  uint32_t *tables;           // [workers][cells]
+  uint64_t *merged;
+
+  // sparse
+  int part_shift;             // key >> part_shift is the partition
+  int parts;
+  uint32_t *band_counts;      // [bands][parts], then scatter positions
+  size_t *part_start;         // [parts + 1] into keys
+  size_t *out_start;          // [parts + 1] room for each partition's entries
+  size_t *out_len;
+  uint32_t *keys;
+  uint32_t *local;            // [workers][1 << part_shift]
+  uint32_t *colors;
+  uint64_t *counts;
+};
+
+static void joint_keys(const struct joint_job *j, int y, uint32_t *keys) {
+  const histo_image *img = j->img;
+  int shift = 8 - j->bits, bits = j->bits, w = j->roi.width;
+  const unsigned char *r, *g, *b;
+  int stride;
+  if(img->layout == HISTO_LAYOUT_PLANAR) {
+    ptrdiff_t row = (ptrdiff_t) (j->roi.y + y) * img->pitch + j->roi.x;
+    r = img->data[0] + row;
+    g = img->data[1] + row;
+    b = img->data[2] + row;
+    stride = 1;
+  } else {
+    stride = img->pixel_stride;
+    const unsigned char *p = img->data[0] + (ptrdiff_t) (j->roi.y + y) * img->pitch
+      + (ptrdiff_t) j->roi.x * stride;
+    r = p + img->offset[0];
+    g = p + img->offset[1];
+    b = p + img->offset[2];
+  }
+  for(int x = 0; x < w; x++) {
+    keys[x] = ((uint32_t) (r[x * stride] >> shift) << (2 * bits)) |
+              ((uint32_t) (g[x * stride] >> shift) << bits) |
+              (uint32_t) (b[x * stride] >> shift);
+  }
+}
+
+static void joint_band(const struct joint_job *j, int task, int *y0, int *y1) {
+  *y0 = (int) ((long long) j->roi.height * task / j->bands);
+  *y1 = (int) ((long long) j->roi.height * (task + 1) / j->bands);
+}
+
+static void joint_dense_task(void *arg, int task, int worker) {
+  struct joint_job *j = (struct joint_job *) arg;
+  uint32_t *table = j->tables + (size_t) worker * j->cells;
+  uint32_t *keys = j->row_keys + (size_t) worker * j->roi.width;
+  int y0, y1;
+  joint_band(j, task, &y0, &y1);
+  for(int y = y0; y < y1; y++) {
+    joint_keys(j, y, keys);
+    for(int x = 0; x < j->roi.width; x++)
+      table[keys[x]] += 1;
+  }
+}
+
+static void joint_merge_task(void *arg, int task, int worker) {
+  struct joint_job *j = (struct joint_job *) arg;
+  size_t i0 = j->cells * task / j->bands, i1 = j->cells * (task + 1) / j->bands;
+  (void) worker;
+  for(size_t i = i0; i < i1; i++) {
+    uint64_t sum = 0;
+    for(int w = 0; w < j->workers; w++)
+      sum += j->tables[(size_t) w * j->cells + i];
+    j->merged[i] = sum;
+  }
+}
+
+static void joint_count_task(void *arg, int task, int worker) {
+  struct joint_job *j = (struct joint_job *) arg;
+  uint32_t *counts = j->band_counts + (size_t) task * j->parts;
+  uint32_t *keys = j->row_keys + (size_t) worker * j->roi.width;
+  int y0, y1;
+  joint_band(j, task, &y0, &y1);
+  for(int y = y0; y < y1; y++) {
+    joint_keys(j, y, keys);
+    for(int x = 0; x < j->roi.width; x++)
+      counts[keys[x] >> j->part_shift] += 1;
+  }
+}
+
+static void joint_scatter_task(void *arg, int task, int worker) {
+  struct joint_job *j = (struct joint_job *) arg;
+  uint32_t *next = j->band_counts + (size_t) task * j->parts;
+  uint32_t *keys = j->row_keys + (size_t) worker * j->roi.width;
+  int y0, y1;
+  joint_band(j, task, &y0, &y1);
+  for(int y = y0; y < y1; y++) {
+    joint_keys(j, y, keys);
+    for(int x = 0; x < j->roi.width; x++)
+      j->keys[next[keys[x] >> j->part_shift]++] = keys[x];
+  }
+}
+
+// Sort n cell offsets below 1 << 16 with two byte-wide counting passes.
+static void sort_cells(uint32_t *cells, uint32_t *scratch, size_t n) {
+  uint32_t *from = cells, *to = scratch;
+  for(int shift = 0; shift < 16; shift += 8) {
+    size_t start[257];
+    memset(start, 0, sizeof(start));
+    for(size_t i = 0; i < n; i++)
+      start[((from[i] >> shift) & 255) + 1] += 1;
+    for(int d = 0; d < 256; d++)
+      start[d + 1] += start[d];
+    for(size_t i = 0; i < n; i++)
+      to[start[(from[i] >> shift) & 255]++] = from[i];
+    uint32_t *t = from;
+    from = to;
+    to = t;
+  }
+}
+
+static void joint_partition_task(void *arg, int task, int worker) {
+  struct joint_job *j = (struct joint_job *) arg;
+  uint32_t *keys = j->keys + j->part_start[task];
+  size_t n = j->part_start[task + 1] - j->part_start[task];
+  size_t cells = (size_t) 1 << j->part_shift;
+  uint32_t base = (uint32_t) task << j->part_shift;
+  uint32_t *local = j->local + (size_t) worker * cells;
+  uint32_t *colors = j->colors + j->out_start[task];
+  uint64_t *counts = j->counts + j->out_start[task];
+
+  // Count, keeping the cells seen for the first time at the front of keys
+  // (never past the key being read).
+  size_t touched = 0;
+  for(size_t i = 0; i < n; i++) {
+    uint32_t c = keys[i] - base;
+    if(local[c]++ == 0)
+      keys[touched++] = c;
+  }
+
+  // few cells: sorting them beats sweeping the whole slice
+  if(touched * 8 < cells) {
+    sort_cells(keys, colors, touched);
+    for(size_t i = 0; i < touched; i++) {
+      colors[i] = base + keys[i];
+      counts[i] = local[keys[i]];
+      local[keys[i]] = 0;
+    }
+  } else {
+    size_t out = 0;
+    for(size_t c = 0; c < cells; c++) {
+      if(local[c]) {
+        colors[out] = base + (uint32_t) c;
+        counts[out++] = local[c];
+        local[c] = 0;
+      }
+    }
+  }
+  j->out_len[task] = touched;
+}
+
+static int joint_dense(struct joint_job *j, struct pool *p, struct histo_joint *h) {
+  j->cells = (size_t) 1 << (3 * j->bits);
+  j->tables = (uint32_t *) calloc(j->cells * j->workers, sizeof(uint32_t));
+  h->counts = (uint64_t *) malloc(sizeof(uint64_t) * j->cells);
+  if(!j->tables || !h->counts) {
+    free(j->tables);
+    free(h->counts);
+    h->counts = NULL;
+    return HISTO_ENOMEM;
+  }
+  j->merged = h->counts;
+  pool_run(p, joint_dense_task, j, j->bands);
+  pool_run(p, joint_merge_task, j, j->bands);
+  free(j->tables);
+
+  h->dense = true;
+  h->entries = 0;
+  for(size_t i = 0; i < j->cells; i++)
+    h->entries += h->counts[i] != 0;
+  h->bytes = sizeof(uint64_t) * j->cells;
+  return HISTO_OK;
+}
+
+static int joint_sparse(struct joint_job *j, struct pool *p, struct histo_joint *h) {
+  size_t pixels = (size_t) j->roi.width * j->roi.height;
+  j->part_shift = JOINT_PART_BITS;
+  j->parts = 1 << (3 * j->bits - JOINT_PART_BITS);
+  j->band_counts = (uint32_t *) calloc((size_t) j->bands * j->parts, sizeof(uint32_t));
+  j->part_start = (size_t *) malloc(sizeof(size_t) * (j->parts + 1));
+  j->out_start = (size_t *) malloc(sizeof(size_t) * (j->parts + 1));
+  j->out_len = (size_t *) malloc(sizeof(size_t) * j->parts);
+  j->keys = (uint32_t *) malloc(sizeof(uint32_t) * (pixels ? pixels : 1));
+  j->local = (uint32_t *) calloc((size_t) j->workers << JOINT_PART_BITS, sizeof(uint32_t));
+
+  int err = HISTO_ENOMEM;
+  if(j->band_counts && j->part_start && j->out_start && j->out_len && j->keys && j->local) {
+    pool_run(p, joint_count_task, j, j->bands);
+
+    // partitions in key order, each band's pixels after the previous band's
+    size_t at = 0, room = 0;
+    for(int part = 0; part < j->parts; part++) {
+      j->part_start[part] = at;
+      j->out_start[part] = room;
+      size_t n = 0;
+      for(int band = 0; band < j->bands; band++) {
+        uint32_t *c = &j->band_counts[(size_t) band * j->parts + part];
+        uint32_t count = *c;
+        *c = (uint32_t) (at + n);
+        n += count;
+      }
+      at += n;
+      room += n < ((size_t) 1 << JOINT_PART_BITS) ? n : ((size_t) 1 << JOINT_PART_BITS);
+    }
+    j->part_start[j->parts] = at;
+    j->out_start[j->parts] = room;
+
+    j->colors = (uint32_t *) malloc(sizeof(uint32_t) * (room ? room : 1));
+    j->counts = (uint64_t *) malloc(sizeof(uint64_t) * (room ? room : 1));
+    if(j->colors && j->counts) {
+      pool_run(p, joint_scatter_task, j, j->bands);
+      pool_run(p, joint_partition_task, j, j->parts);
+
+      size_t entries = 0;
+      for(int part = 0; part < j->parts; part++) {
+        memmove(j->colors + entries, j->colors + j->out_start[part],
+                sizeof(uint32_t) * j->out_len[part]);
+        memmove(j->counts + entries, j->counts + j->out_start[part],
+                sizeof(uint64_t) * j->out_len[part]);
+        entries += j->out_len[part];
+      }
+      h->dense = false;
+      h->entries = entries;
+      h->colors = (uint32_t *) realloc(j->colors, sizeof(uint32_t) * (entries ? entries : 1));
+      h->counts = (uint64_t *) realloc(j->counts, sizeof(uint64_t) * (entries ? entries : 1));
+      h->bytes = (sizeof(uint32_t) + sizeof(uint64_t)) * entries;
+      err = HISTO_OK;
+    } else {
+      free(j->colors);
+      free(j->counts);
+    }
+  }
+
+  free(j->band_counts);
+  free(j->part_start);
+  free(j->out_start);
+  free(j->out_len);
+  free(j->keys);
+  free(j->local);
+  return err;
+}
+
+int histo_joint_compute(const histo_image *img, const histo_roi *roi, int bits,
+                        histo_joint **out) {
+  int err = check_image(img);
+  if(err)
+    return err;
+  if(!out || bits < 1 || bits > 8 ||
+     (unsigned long long) img->width * img->height > 0xFFFFFFFFULL)
+    return HISTO_EINVAL;
+
+  struct joint_job j;
+  memset(&j, 0, sizeof(j));
+  j.img = img;
+  j.bits = bits;
+  if(roi) {
+    if(roi->x < 0 || roi->y < 0 || roi->width < 0 || roi->height < 0 ||
+       roi->x > img->width - roi->width || roi->y > img->height - roi->height)
+      return HISTO_EROI;
+    j.roi = *roi;
+  } else {
+    j.roi.x = 0;
+    j.roi.y = 0;
+    j.roi.width = img->width;
+    j.roi.height = img->height;
+  }
+
+  struct pool *p = get_pool();
+  if(!p)
+    return HISTO_ENOMEM;
+  j.workers = pool_size(p);
+  j.bands = j.workers * 4 < j.roi.height ? j.workers * 4 : j.roi.height;
+  if(j.bands < 1)
+    j.bands = 1;
+
+  struct histo_joint *h = (struct histo_joint *) calloc(1, sizeof(*h));
+  j.row_keys = (uint32_t *) malloc(sizeof(uint32_t) * j.workers * (j.roi.width + 1));
+  if(!h || !j.row_keys) {
+    free(h);
+    free(j.row_keys);
+    return HISTO_ENOMEM;
+  }
+  h->bits = bits;
+
+  err = bits <= HISTO_JOINT_DENSE_BITS ? joint_dense(&j, p, h) : joint_sparse(&j, p, h);
+  free(j.row_keys);
+  if(err) {
+    free(h);
+    return err;
+  }
+  *out = h;
+  return HISTO_OK;
+}
+
+void histo_joint_free(histo_joint *h) {
+  if(!h)
+    return;
+  free(h->counts);
+  free(h->colors);
+  free(h);
+}
+
+int histo_joint_bits(const histo_joint *h) {
+  return h->bits;
+}
+
+size_t histo_joint_entries(const histo_joint *h) {
+  return h->entries;
+}
+
+size_t histo_joint_bytes(const histo_joint *h) {
+  return h->bytes + sizeof(*h);
+}
+
+uint64_t histo_joint_count(const histo_joint *h, int r, int g, int b) {
+  int shift = 8 - h->bits;
+  uint32_t key = ((uint32_t) ((r & 255) >> shift) << (2 * h->bits)) |
+                 ((uint32_t) ((g & 255) >> shift) << h->bits) |
+                 (uint32_t) ((b & 255) >> shift);
+  if(h->dense)
+    return h->counts[key];
+
+  size_t lo = 0, hi = h->entries;
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(h->colors[mid] < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < h->entries && h->colors[lo] == key ? h->counts[lo] : 0;
+}
+
+size_t histo_joint_list(const histo_joint *h, uint32_t *cells, uint64_t *counts,
+                        size_t max) {
+  size_t n = 0;
+  if(!h->dense) {
+    n = h->entries < max ? h->entries : max;
+    if(cells)
+      memcpy(cells, h->colors, sizeof(uint32_t) * n);
+    if(counts)
+      memcpy(counts, h->counts, sizeof(uint64_t) * n);
+    return n;
+  }
+  size_t total = (size_t) 1 << (3 * h->bits);
+  for(size_t i = 0; i < total && n < max; i++) {
+    if(h->counts[i]) {
+      if(cells)
+        cells[n] = (uint32_t) i;
+      if(counts)
+        counts[n] = h->counts[i];
+      n++;
+    }
+  }
+  return n;
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+/* libhisto: in-process RGB histograms over caller-owned pixel buffers.
+
+   The library never copies or allocates pixel data.  Counts are written into
+   caller-provided arrays of 256 uint64_t per channel.  Work is spread over a
+   persistent internal thread pool that is created on first use (or by
+   histo_init) and kept until histo_shutdown.  All entry points except
+   histo_shutdown are thread-safe; concurrent histo_compute calls share the
+   pool one at a time.
+
+   Functions returning int return HISTO_OK (0) on success and a negative
+   HISTO_E* code on failure. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define HISTO_API __attribute__((visibility("default")))
+#else
+#define HISTO_API
+#endif
+
+#define HISTO_API_VERSION 1
+#define HISTO_BINS 256
+
+enum {
+  HISTO_OK = 0,
+  HISTO_EINVAL = -1,   /* bad argument or image descriptor */
+  HISTO_EROI = -2,     /* ROI outside the image */
+  HISTO_ENOMEM = -3,
+  HISTO_EIDLE = -4,    /* histo_snapshot: no HISTO_LIVE job is running */
+};
+
+enum {
+  HISTO_LAYOUT_PLANAR = 0,      /* three separate 8-bit planes */
+  HISTO_LAYOUT_INTERLEAVED = 1, /* packed pixels, e.g. RGB, BGR, RGBX */
+};
+
+/* flags for histo_compute */
+enum {
+  HISTO_ACCUMULATE = 1,         /* add to the output arrays instead of overwriting */
+  HISTO_SINGLE_THREAD = 2,      /* count on the calling thread, bypassing the pool */
+  HISTO_LIVE = 4,               /* allow histo_snapshot while this call runs */
+};
+
+typedef struct histo_image {
+  int layout;
+  int width;
+  int height;
+  /* Planar: base of the R, G and B planes.
+     Interleaved: data[0] points at pixel (0,0), data[1] and data[2] unused. */
+  const unsigned char *data[3];
+  /* Bytes from the start of one row to the next (per plane when planar). */
+  ptrdiff_t pitch;
+  /* Interleaved only: bytes per pixel and byte offset of R, G, B in a pixel. */
+  int pixel_stride;
+  int offset[3];
+} histo_image;
+
+typedef struct histo_roi {
+  int x;
+  int y;
+  int width;
+  int height;
+} histo_roi;
+
+HISTO_API int histo_version(void);
+HISTO_API const char *histo_strerror(int err);
+
+/* Start the pool with the given number of threads (<= 0: one per online
+   CPU).  Optional; returns HISTO_EINVAL if the pool is already running. */
+HISTO_API int histo_init(int threads);
+HISTO_API void histo_shutdown(void);
+HISTO_API int histo_threads(void);
+
+/* Fill in a descriptor for three planes sharing the same pitch. */
+HISTO_API void histo_image_planar(histo_image *img, int width, int height,
+                                  const unsigned char *r, const unsigned char *g,
+                                  const unsigned char *b, ptrdiff_t pitch);
+
+/* Fill in a descriptor for packed pixels, e.g. stride 3 with offsets 0,1,2
+   for RGB, 2,1,0 for BGR, or stride 4 for RGBX/BGRX. */
+HISTO_API void histo_image_interleaved(histo_image *img, int width, int height,
+                                       const unsigned char *data, ptrdiff_t pitch,
+                                       int pixel_stride, int r_offset,
+                                       int g_offset, int b_offset);
+
+/* Histogram the pixels inside roi (NULL: the whole image).  Any of the
+   output arrays may be NULL if that channel is not wanted. */
+HISTO_API int histo_compute(const histo_image *img, const histo_roi *roi,
+                            uint64_t *hist_r, uint64_t *hist_g,
+                            uint64_t *hist_b, unsigned flags);
+
+/* Incremental update between two frames of identical geometry (pitches may
+   differ).  On entry hist_* hold the counts of all of prev; on return they
+   hold the counts of cur.  Only pixels that changed are touched, found by
+   a block compare, so nearly static frames cost little more than a memcmp.
+   *changed (may be NULL) receives the number of changed pixels.  Callers
+   that cannot trust hist_* should recount with histo_compute now and then. */
+HISTO_API int histo_update(const histo_image *prev, const histo_image *cur,
+                           uint64_t *hist_r, uint64_t *hist_g, uint64_t *hist_b,
+                           uint64_t *changed);
+
+/* Channels for histo_compute_channels, each 0..255.  Derived ones are
+   worked out from R, G and B inside the counting loop, 16 pixels at a
+   time in SIMD registers, without writing a converted image anywhere. */
+enum {
+  HISTO_CHANNEL_R = 0,
+  HISTO_CHANNEL_G = 1,
+  HISTO_CHANNEL_B = 2,
+  HISTO_CHANNEL_LUMA601 = 3,    /* (77 R + 150 G + 29 B + 128) >> 8 */
+  HISTO_CHANNEL_LUMA709 = 4,    /* (54 R + 183 G + 19 B + 128) >> 8 */
+  HISTO_CHANNEL_HUE = 5,        /* HSV hue, the full circle over 256 bins; 0 for grays */
+  HISTO_CHANNEL_SATURATION = 6, /* HSV saturation, (255 C + V / 2) / V */
+  HISTO_CHANNEL_VALUE = 7,      /* V = max(R, G, B) */
+  HISTO_CHANNEL_CHROMA = 8,     /* C = V - min(R, G, B) */
+  HISTO_CHANNELS = 9,
+};
+
+/* histo_compute for n (1..3) channels of the list above, into hists[0..n-1],
+   none of which may be NULL.  Everything else works as in histo_compute,
+   HISTO_LIVE included: histo_snapshot then reports these channels in its
+   first n arrays. */
+HISTO_API int histo_compute_channels(const histo_image *img, const histo_roi *roi,
+                                     const int *channels, int n, uint64_t *const *hists,
+                                     unsigned flags);
+
+/* histo_update for the histograms of histo_compute_channels. */
+HISTO_API int histo_update_channels(const histo_image *prev, const histo_image *cur,
+                                    const int *channels, int n, uint64_t *const *hists,
+                                    uint64_t *changed);
+
+/* Partial result of the HISTO_LIVE histo_compute running right now, from
+   any other thread.  The counts cover exactly *pixels pixels (every one of
+   them in all three channels) out of *total in the ROI; pixels and total may
+   be NULL.  Workers publish a copy of their private tables every few hundred
+   thousand pixels behind a sequence counter, so the counting loop itself has
+   no atomics and a snapshot never blocks the job.  Returns HISTO_EIDLE if no
+   live job is running or it finished while the snapshot was taken. */
+HISTO_API int histo_snapshot(uint64_t *hist_r, uint64_t *hist_g, uint64_t *hist_b,
+                             uint64_t *pixels, uint64_t *total);
+
+/* Summary statistics of one channel, derived from its 256 bins.  Since
+   every bin is a single value, sums, extremes and percentiles come out
+   exactly as a pass over the pixels would give them, for 256 steps
+   instead of one per pixel.  cumulative[v] counts the pixels at or below v
+   and answers histo_percentile. */
+typedef struct histo_stats {
+  uint64_t count;
+  int min;                      /* -1 for an empty histogram */
+  int max;
+  uint64_t sum;
+  uint64_t sum_squares;
+  double mean;
+  double variance;              /* of the population */
+  double entropy;               /* bits per pixel */
+  uint64_t cumulative[HISTO_BINS];
+} histo_stats;
+
+HISTO_API void histo_stats_compute(const uint64_t *hist, histo_stats *stats);
+
+/* Smallest value with at least p percent (0..100) of the pixels at or
+   below it, so 0 gives the minimum and 100 the maximum.  -1 when empty. */
+HISTO_API int histo_percentile(const histo_stats *stats, double p);
+
+/* Integral histogram for answering many rectangle queries on one image.
+   Building costs one parallel pass writing (width+1) * (height+1) * 3 * bins
+   32-bit counts, so bins (1..256) quantizes values to v * bins / 256 to keep
+   that in check; histo_integral_bytes reports the footprint.  Each query is
+   then four lookups per bin, whatever the size of the rectangle.  The image
+   may be freed once the build returns. */
+typedef struct histo_integral histo_integral;
+
+HISTO_API int histo_integral_build(const histo_image *img, int bins,
+                                   histo_integral **out);
+HISTO_API void histo_integral_free(histo_integral *ih);
+HISTO_API int histo_integral_bins(const histo_integral *ih);
+HISTO_API size_t histo_integral_bytes(const histo_integral *ih);
+
+/* Histograms of n rectangles into out, 3 * bins counts per rectangle (red,
+   green and blue bins in turn).  Large batches are split over the pool.
+   Returns HISTO_EROI, writing nothing, if any rectangle leaves the image. */
+HISTO_API int histo_integral_query(const histo_integral *ih, const histo_roi *rects,
+                                   int n, uint64_t *out);
+
+/* Joint histogram of (r, g, b) triples, each channel cut to its top bits
+   (1..8) bits: 3 gives 8x8x8 cells, 8 every 24-bit color.  Up to
+   HISTO_JOINT_DENSE_BITS the cells are held in a dense table; above that only occupied cells are
+   kept, sorted, and built by radix partitioning the pixels.  Cells are
+   numbered r << 2*bits | g << bits | b in quantized units. */
+#define HISTO_JOINT_DENSE_BITS 6
+
+typedef struct histo_joint histo_joint;
+
+HISTO_API int histo_joint_compute(const histo_image *img, const histo_roi *roi,
+                                  int bits, histo_joint **out);
+HISTO_API void histo_joint_free(histo_joint *h);
+HISTO_API int histo_joint_bits(const histo_joint *h);
+HISTO_API size_t histo_joint_entries(const histo_joint *h);   /* occupied cells */
+HISTO_API size_t histo_joint_bytes(const histo_joint *h);
+
+/* Count of the cell holding the 8-bit color (r, g, b). */
+HISTO_API uint64_t histo_joint_count(const histo_joint *h, int r, int g, int b);
+
+/* Up to max occupied cells in ascending order with their counts; either
+   array may be NULL.  Returns how many were written. */
+HISTO_API size_t histo_joint_list(const histo_joint *h, uint32_t *cells,
+                                  uint64_t *counts, size_t max);
+
+#ifdef __cplusplus
+}
+#endif
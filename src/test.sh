@@ -32,6 +32,33 @@ calculate_stats() {
     echo "$mean $std_dev"
 }
 
+# Pixel bytes of a W x H P6 image (args: file W H), one per line
+ppm_pixels() {
+    tail -c $(($2 * $3 * 3)) "$1" | od -An -v -tu1 | tr -s ' ' '\n' | grep -v '^$'
+}
+
+# The rank filter by brute force: sort each (2R+1)^2 window with the edges
+# replicated (args: file W H R P)
+median_reference() {
+    ppm_pixels "$1" $2 $3 |
+    awk -v w=$2 -v h=$3 -v r=$4 -v p=$5 '{ v[NR - 1] = $1 } END {
+        rank = int(((2 * r + 1) * (2 * r + 1) - 1) * p / 100)
+        for(y = 0; y < h; y++) for(x = 0; x < w; x++) for(c = 0; c < 3; c++) {
+            split("", n)
+            for(dy = -r; dy <= r; dy++) {
+                yy = y + dy < 0 ? 0 : y + dy >= h ? h - 1 : y + dy
+                for(dx = -r; dx <= r; dx++) {
+                    xx = x + dx < 0 ? 0 : x + dx >= w ? w - 1 : x + dx
+                    n[v[(yy * w + xx) * 3 + c]]++
+                }
+            }
+            m = 0
+            for(k = 0; k <= rank; k += n[m++]) ;
+            print m - 1
+        }
+    }'
+}
+
 # ==============================================
 # Valgrind Memory Leak Detection
 # ==============================================
@@ -91,11 +118,97 @@ echo "=== Verifying correctness with diff ===" > verification.txt
 ./histo_lockfree ../images/moon-small.ppm test_lockfree.hist 4
 ./histo_lock1 ../images/moon-small.ppm test_lock1.hist 4
 ./histo_lock2 ../images/moon-small.ppm test_lock2.hist 4
+./histo_lock2 ../images/moon-small.ppm test_lock2.csv 4
+./histo ../images/moon-small.ppm test_histo.hist 4
+./histo ../images/moon-small.ppm test_live.hist 4 --progress 0 > /dev/null
+./histo ../images/moon-small.ppm test_stats.hist 4 --stats > /dev/null
+echo ../images/moon-small.ppm > batch_list.txt
+./histo --batch batch_list.txt --out . > /dev/null
+rm -f test_store.hs
+./histo --batch batch_list.txt --store test_store.hs > /dev/null
+./histo --store2hist test_store.hs test_store.hist --key ../images/moon-small.ppm > /dev/null
 
 diff reference.hist test_private.hist && echo "histo_private:  PASS" >> verification.txt || echo "histo_private:  FAIL" >> verification.txt
 diff reference.hist test_lockfree.hist && echo "histo_lockfree: PASS" >> verification.txt || echo "histo_lockfree: FAIL" >> verification.txt
 diff reference.hist test_lock1.hist && echo "histo_lock1:    PASS" >> verification.txt || echo "histo_lock1:    FAIL" >> verification.txt
 diff reference.hist test_lock2.hist && echo "histo_lock2:    PASS" >> verification.txt || echo "histo_lock2:    FAIL" >> verification.txt
+awk -F, 'NR > 1 { if($1 != c) { c = $1; k++ } n[k]++; v[k] = v[k] $2 " " $3 "\n" }
+         END { for(i = 1; i <= k; i++) printf "%d\n%s", n[i], v[i] }' test_lock2.csv |
+    diff reference.hist - && echo "histo_lock2 .csv: PASS" >> verification.txt || echo "histo_lock2 .csv: FAIL" >> verification.txt
+diff reference.hist test_histo.hist && echo "histo:          PASS" >> verification.txt || echo "histo:          FAIL" >> verification.txt
+diff reference.hist moon-small.hist && echo "histo --batch:  PASS" >> verification.txt || echo "histo --batch:  FAIL" >> verification.txt
+diff reference.hist test_live.hist && echo "histo --progress: PASS" >> verification.txt || echo "histo --progress: FAIL" >> verification.txt
+diff reference.hist test_store.hist && echo "histo --store:  PASS" >> verification.txt || echo "histo --store:  FAIL" >> verification.txt
+grep -v '^# stats' test_stats.hist | diff reference.hist - && echo "histo --stats:  PASS" >> verification.txt || echo "histo --stats:  FAIL" >> verification.txt
+
+# The pipeline writes the same combined file as --batch
+./histo --batch batch_list.txt --pipeline --io stdio --combined test_pipeline_stdio.hist > /dev/null
+grep -v '^# ' test_pipeline_stdio.hist | diff reference.hist - \
+    && echo "histo --pipeline --io stdio: PASS" >> verification.txt \
+    || echo "histo --pipeline --io stdio: FAIL" >> verification.txt
+for io in pread uring; do
+    ./histo --batch batch_list.txt --pipeline --io $io --combined test_pipeline_$io.hist > /dev/null 2>&1
+    grep -v '^# ' test_pipeline_$io.hist | diff reference.hist - \
+        && echo "histo --pipeline --io $io: PASS" >> verification.txt \
+        || echo "histo --pipeline --io $io: FAIL" >> verification.txt
+done
+
+# A stream of three frames gives the reference histogram under each header
+cat ../images/moon-small.ppm ../images/moon-small.ppm ../images/moon-small.ppm > test_stream.ppm
+./histo --stream test_stream.ppm --combined test_stream.hist 2> /dev/null
+for i in 0 1 2; do echo "# frame $i"; cat reference.hist; done | diff - test_stream.hist \
+    && echo "histo --stream: PASS" >> verification.txt \
+    || echo "histo --stream: FAIL" >> verification.txt
+# --delta on frames that all differ, each checked against histogram
+./histo --generate noise test_frame_a.ppm --size 64x48 --seed 1 > /dev/null
+./histo --generate noise test_frame_b.ppm --size 64x48 --seed 2 > /dev/null
+./histogram test_frame_a.ppm test_frame_a.hist 1 > /dev/null
+./histogram test_frame_b.ppm test_frame_b.hist 1 > /dev/null
+cat test_frame_a.ppm test_frame_b.ppm test_frame_a.ppm test_frame_b.ppm |
+    ./histo --stream - --delta --refresh 0 > test_delta.hist 2> /dev/null
+i=0
+for f in a b a b; do echo "# frame $i"; cat test_frame_$f.hist; i=$((i + 1)); done |
+    diff - test_delta.hist \
+    && echo "histo --stream --delta: PASS" >> verification.txt \
+    || echo "histo --stream --delta: FAIL" >> verification.txt
+
+# Integral histograms of random rectangles against histo_compute
+./histo --integral ../images/moon-small.ppm --queries 2000 --verify 2000 | grep -q "^Verified: 2000 of 2000 match" \
+    && echo "histo --integral: PASS" >> verification.txt \
+    || echo "histo --integral: FAIL" >> verification.txt
+# Marginals summed out of the joint histogram, dense and sparse
+for bits in 5 8; do
+    ./histo --joint ../images/moon-small.ppm --bits $bits | grep -q "^Marginals: match" \
+        && echo "histo --joint --bits $bits: PASS" >> verification.txt \
+        || echo "histo --joint --bits $bits: FAIL" >> verification.txt
+done
+
+# Output images of a generated image, against the checksums of their
+# reviewed output; the result must not depend on the thread count
+./histo --generate noise test_golden.ppm --size 256x192 --seed 7 > /dev/null
+for case in "1351993848 --equalize" "3924586433 --equalize --luma" \
+            "1104778389 --clahe" "1633058658 --clahe --luma --tile 32" \
+            "2551057333 --quantize --colors 16" "2465529362 --quantize"; do
+    set -- $case
+    sum=$1
+    shift
+    ok=1
+    for t in 1 4; do
+        ./histo "$@" test_golden.ppm test_filtered.ppm --threads $t > /dev/null
+        [ "$(cksum < test_filtered.ppm | cut -d' ' -f1)" = "$sum" ] || ok=0
+    done
+    [ $ok = 1 ] && echo "histo $*: PASS" >> verification.txt || echo "histo $*: FAIL" >> verification.txt
+done
+
+# --median against the brute-force filter, down to r = 0 and past the edges
+./histo --generate noise test_median.ppm --size 20x12 --seed 3 > /dev/null
+for case in "0 50" "1 50" "3 50" "40 50" "2 0" "2 100" "2 25"; do
+    set -- $case
+    ./histo --median test_median.ppm test_median_out.ppm --radius $1 --percentile $2 --threads 4 > /dev/null
+    median_reference test_median.ppm 20 12 $1 $2 | diff - <(ppm_pixels test_median_out.ppm 20 12) > /dev/null \
+        && echo "histo --median --radius $1 --percentile $2: PASS" >> verification.txt \
+        || echo "histo --median --radius $1 --percentile $2: FAIL" >> verification.txt
+done
 
 cat verification.txt
 echo ""
@@ -103,175 +216,159 @@ echo ""
 # ==============================================
 # Performance Benchmarking
 # ==============================================
-echo "=== Testing histogram (baseline, single-threaded) ===" > histogram.txt
+# Every counting strategy in one process: each image is loaded once and
+# timed $ITERATIONS times per strategy and thread count after a warm-up
+paths=""
 for img in $IMAGES; do
-    echo "Image: $img" >> histogram.txt
-    echo "Threads 1:" >> histogram.txt
+    paths="$paths ../images/$img"
+done
+# It exits 1 when a strategy's counts are wrong or its timed region
+# allocates beyond its budget (ALLOCATES in the row); that goes on record.
+./histo_bench --iterations $ITERATIONS --warmup 5 --threads ${THREADS// /,} \
+    --json bench.json --csv bench.csv $paths > bench.txt \
+    && echo "histo_bench:    PASS" >> verification.txt \
+    || echo "histo_bench:    FAIL (see bench.txt)" >> verification.txt
+# Again with planes, tables and locks in one pre-faulted huge-page arena
+./histo_bench --arena --iterations $ITERATIONS --warmup 5 --threads ${THREADS// /,} \
+    $paths > bench_arena.txt \
+    && echo "histo_bench --arena: PASS" >> verification.txt \
+    || echo "histo_bench --arena: FAIL (see bench_arena.txt)" >> verification.txt
+grep histo_bench verification.txt
+
+# Generated images of known distribution: strong scaling on a fixed size,
+# then weak scaling with the image height growing with the thread count
+./histo_bench --iterations 20 --threads all --strategies serial,private,lockfree,pool \
+    synth:uniform:4000x4000 synth:single:4000x4000 synth:zipf:4000x4000 > scaling.txt
+./histo_bench --iterations 20 --threads all --weak --strategies private,lockfree,pool \
+    synth:uniform:4000x1000 synth:single:4000x1000 >> scaling.txt
+
+# Each strategy against the read bandwidth of the machine, with one image
+# that fits in the last level cache and one twice its size
+llc=$(getconf LEVEL3_CACHE_SIZE 2>/dev/null)
+[ -z "$llc" ] || [ "$llc" -le 0 ] && llc=33554432
+./histo_bench --roofline --iterations 5 --warmup 1 --threads all \
+    synth:uniform:4000x$((llc / 4 / 12000 + 1)) synth:uniform:4000x$((llc * 2 / 12000)) \
+    --csv roofline.csv > roofline.txt
+
+# Where the time goes inside each program's timed region, per thread
+echo "=== Phases (phobos.ppm, 4 threads) ===" > histo_phases.txt
+for prog in histogram histo_private histo_lockfree histo_lock1 histo_lock2; do
+    t=4
+    [ "$prog" = "histogram" ] && t=1
+    echo "--- $prog ---" >> histo_phases.txt
+    ./$prog ../images/phobos.ppm output_phases.hist $t --counters --trace trace_$prog.json >> histo_phases.txt 2>/dev/null
+    echo "" >> histo_phases.txt
+done
+
+# Peak RSS, heap and allocations of each program
+echo "=== Memory (phobos.ppm, 4 threads) ===" > histo_memory.txt
+for prog in histogram histo_private histo_lockfree histo_lock1 histo_lock2; do
+    t=4
+    [ "$prog" = "histogram" ] && t=1
+    echo "--- $prog ---" >> histo_memory.txt
+    ./$prog ../images/phobos.ppm output_memory.hist $t --memory | sed -n '/^Memory:/,$p' >> histo_memory.txt
+    echo "" >> histo_memory.txt
+done
+
+# Which bins the locked variants wait on
+echo "=== Lock contention (phobos.ppm, 4 threads) ===" > histo_contention.txt
+for prog in histo_lock1 histo_lock2; do
+    echo "--- $prog ---" >> histo_contention.txt
+    ./$prog ../images/phobos.ppm output_contention.hist 4 --contention | grep -v "^Time:" >> histo_contention.txt
+    echo "" >> histo_contention.txt
+done
+
+# Cost of HISTO_LIVE publishing with no reader, with a reader every 10 ms,
+# and with one snapshotting back to back
+echo "=== Testing histo live snapshots (phobos.ppm, 4 threads) ===" > histo_live.txt
+for mode in "off" "10" "0"; do
+    args=""
+    [ "$mode" != "off" ] && args="--progress $mode"
     times=()
+    snaps=""
     for i in $(seq 1 $ITERATIONS); do
-        output=$(./histogram ../images/$img output_histogram.hist 1 2>&1)
+        output=$(./histo ../images/phobos.ppm output_live.hist 4 $args 2>/dev/null)
         time_ns=$(echo "$output" | grep "Time:" | awk '{print $2}')
-        
-        # 只添加非空的时间值
         if [ -n "$time_ns" ]; then
             times+=($time_ns)
         fi
+        snaps=$(echo "$output" | grep "Snapshots:")
     done
-    
-    # 检查是否收集到有效数据
-    if [ ${#times[@]} -eq 0 ]; then
-        echo "  ERROR: No valid timing data collected" >> histogram.txt
-        echo "" >> histogram.txt
-        continue
-    fi
-    
     stats=($(calculate_stats "${times[@]}"))
-    mean=${stats[0]}
-    std_dev=${stats[1]}
-    
-    echo "  Average: $mean ns" >> histogram.txt
-    echo "  Std Dev: $std_dev ns" >> histogram.txt
-    echo "" >> histogram.txt
+    echo "Progress $mode:" >> histo_live.txt
+    echo "  Average: ${stats[0]} ns" >> histo_live.txt
+    echo "  Std Dev: ${stats[1]} ns" >> histo_live.txt
+    [ -n "$snaps" ] && echo "  Last run: $snaps" >> histo_live.txt
+    echo "" >> histo_live.txt
 done
 
-echo "=== Testing histo_private ===" > histo_private.txt
-for img in $IMAGES; do
-    echo "Image:  $img" >> histo_private.txt
-    for t in $THREADS; do
-        echo "Threads $t:" >> histo_private.txt
+# Global equalization against CLAHE on the aerial images
+echo "=== Testing histo --equalize vs --clahe (4 threads) ===" > histo_equalize.txt
+for img in flood.ppm university.ppm; do
+    echo "Image: $img" >> histo_equalize.txt
+    for mode in "--equalize" "--clahe" "--clahe --tile 32"; do
         times=()
         for i in $(seq 1 $ITERATIONS); do
-            output=$(./histo_private ../images/$img output_private.hist $t 2>&1)
+            output=$(./histo $mode ../images/$img output_equalize.ppm --threads 4 2>&1)
             time_ns=$(echo "$output" | grep "Time:" | awk '{print $2}')
-            
-            # 只添加非空的时间值
             if [ -n "$time_ns" ]; then
                 times+=($time_ns)
             fi
         done
-        
-        # 检查是否收集到有效数据
-        if [ ${#times[@]} -eq 0 ]; then
-            echo "  ERROR: No valid timing data collected" >> histo_private.txt
-            echo "" >> histo_private.txt
-            continue
-        fi
-        
         stats=($(calculate_stats "${times[@]}"))
-        mean=${stats[0]}
-        std_dev=${stats[1]}
-        
-        echo "  Average: $mean ns" >> histo_private.txt
-        echo "  Std Dev: $std_dev ns" >> histo_private.txt
-        echo "" >> histo_private.txt
+        echo "$mode:" >> histo_equalize.txt
+        echo "  Average: ${stats[0]} ns" >> histo_equalize.txt
+        echo "  Std Dev: ${stats[1]} ns" >> histo_equalize.txt
+        echo "$output" | grep -E "^  (load|histogram|cdf|tiles|apply|write)" >> histo_equalize.txt
+        echo "" >> histo_equalize.txt
     done
 done
 
-echo "=== Testing histo_lockfree ===" > histo_lockfree.txt
-for img in $IMAGES; do
-    echo "Image:  $img" >> histo_lockfree.txt
-    for t in $THREADS; do
-        echo "Threads $t:" >> histo_lockfree.txt
-        times=()
-        for i in $(seq 1 $ITERATIONS); do
-            output=$(./histo_lockfree ../images/$img output_lockfree.hist $t 2>&1)
-            time_ns=$(echo "$output" | grep "Time:" | awk '{print $2}')
-            
-            # 只添加非空的时间值
-            if [ -n "$time_ns" ]; then
-                times+=($time_ns)
-            fi
-        done
-        
-        # 检查是否收集到有效数据
-        if [ ${#times[@]} -eq 0 ]; then
-            echo "  ERROR: No valid timing data collected" >> histo_lockfree.txt
-            echo "" >> histo_lockfree.txt
-            continue
-        fi
-        
-        stats=($(calculate_stats "${times[@]}"))
-        mean=${stats[0]}
-        std_dev=${stats[1]}
-        
-        echo "  Average: $mean ns" >> histo_lockfree.txt
-        echo "  Std Dev:  $std_dev ns" >> histo_lockfree.txt
-        echo "" >> histo_lockfree.txt
-    done
+# The median filter should cost the same per pixel at every radius
+echo "=== Testing histo --median (phobos.ppm, 4 threads) ===" > histo_median.txt
+for r in 1 5 20 50; do
+    output=$(./histo --median ../images/phobos.ppm output_median.ppm --radius $r --threads 4 2>&1)
+    echo "Radius $r: $(echo "$output" | grep "filter" | sed 's/^ *//')" >> histo_median.txt
 done
 
-echo "=== Testing histo_lock1 (Test-and-Set) ===" > histo_lock1.txt
-for img in $IMAGES; do
-    echo "Image: $img" >> histo_lock1.txt
-    for t in $THREADS; do
-        echo "Threads $t:" >> histo_lock1.txt
-        times=()
-        for i in $(seq 1 $ITERATIONS); do
-            output=$(./histo_lock1 ../images/$img output_lock1.hist $t 2>&1)
-            time_ns=$(echo "$output" | grep "Time:" | awk '{print $2}')
-            
-            # 只添加非空的时间值
-            if [ -n "$time_ns" ]; then
-                times+=($time_ns)
-            fi
-        done
-        
-        # 检查是否收集到有效数据
-        if [ ${#times[@]} -eq 0 ]; then
-            echo "  ERROR:  No valid timing data collected" >> histo_lock1.txt
-            echo "" >> histo_lock1.txt
-            continue
+# Derived channels are converted in the counting loop; compare with plain RGB
+echo "=== Testing histo --channels (phobos.ppm, 4 threads) ===" > histo_channels.txt
+for channels in r,g,b luma601 luma709,hue hue,saturation,value chroma; do
+    times=()
+    for i in $(seq 1 $ITERATIONS); do
+        output=$(./histo ../images/phobos.ppm output_channels.hist 4 --channels $channels 2>&1)
+        time_ns=$(echo "$output" | grep "Time:" | awk '{print $2}')
+        if [ -n "$time_ns" ]; then
+            times+=($time_ns)
         fi
-        
-        stats=($(calculate_stats "${times[@]}"))
-        mean=${stats[0]}
-        std_dev=${stats[1]}
-        
-        echo "  Average: $mean ns" >> histo_lock1.txt
-        echo "  Std Dev: $std_dev ns" >> histo_lock1.txt
-        echo "" >> histo_lock1.txt
     done
+    stats=($(calculate_stats "${times[@]}"))
+    echo "$channels: ${stats[0]} ns (std dev ${stats[1]} ns)" >> histo_channels.txt
 done
 
-echo "=== Testing histo_lock2 (Ticket Lock) ===" > histo_lock2.txt
-for img in $IMAGES; do
-    echo "Image:  $img" >> histo_lock2.txt
-    for t in $THREADS; do
-        echo "Threads $t:" >> histo_lock2.txt
-        times=()
-        for i in $(seq 1 $ITERATIONS); do
-            output=$(./histo_lock2 ../images/$img output_lock2.hist $t 2>&1)
-            time_ns=$(echo "$output" | grep "Time:" | awk '{print $2}')
-            
-            # 只添加非空的时间值
-            if [ -n "$time_ns" ]; then
-                times+=($time_ns)
-            fi
-        done
-        
-        # 检查是否收集到有效数据
-        if [ ${#times[@]} -eq 0 ]; then
-            echo "  ERROR: No valid timing data collected" >> histo_lock2.txt
-            echo "" >> histo_lock2.txt
-            continue
-        fi
-        
-        stats=($(calculate_stats "${times[@]}"))
-        mean=${stats[0]}
-        std_dev=${stats[1]}
-        
-        echo "  Average: $mean ns" >> histo_lock2.txt
-        echo "  Std Dev: $std_dev ns" >> histo_lock2.txt
-        echo "" >> histo_lock2.txt
+# Palette cost depends on occupied cells, not pixels; the map scales with threads
+echo "=== Testing histo --quantize (phobos.ppm) ===" > histo_quantize.txt
+for t in 1 4; do
+    for colors in 16 256; do
+        output=$(./histo --quantize ../images/phobos.ppm output_quantize.ppm --colors $colors --threads $t 2>&1)
+        echo "Threads $t, $colors colors:" >> histo_quantize.txt
+        echo "$output" | grep -E "^(Error|  (histogram|palette|table|map))" >> histo_quantize.txt
     done
 done
 
 echo ""
 echo "Benchmark complete. Results saved to:"
-echo "  - histogram.txt (baseline)"
-echo "  - histo_private.txt"
-echo "  - histo_lockfree.txt"
-echo "  - histo_lock1.txt"
-echo "  - histo_lock2.txt"
+echo "  - bench.txt, bench.json, bench.csv (all strategies)"
+echo "  - bench_arena.txt (the same in a huge-page arena)"
+echo "  - scaling.txt (synthetic images, strong and weak scaling)"
+echo "  - roofline.txt, roofline.csv (share of read bandwidth)"
+echo "  - histo_phases.txt, trace_*.json (chrome://tracing)"
+echo "  - histo_memory.txt"
+echo "  - histo_contention.txt"
+echo "  - histo_live.txt"
+echo "  - histo_equalize.txt"
+echo "  - histo_median.txt"
+echo "  - histo_channels.txt"
+echo "  - histo_quantize.txt"
 echo "  - verification.txt"
 echo "  - valgrind_report.txt"
\ No newline at end of file